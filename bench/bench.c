@@ -0,0 +1,287 @@
+// generates a set of .pyasm workloads and times pyasm and pyrite on them.
+//
+//     pyrite-bench [--runs N] [--jit] [--pyasm PATH] [--pyrite PATH]
+//                  [--dir PATH] [--scale N]
+//
+// every workload is assembled and executed --runs times as a separate
+// process. assembly is reported as MB/s of source, execution as ns per
+// source instruction (process start up included, so use the large
+// workloads for per instruction costs), both with their standard deviation.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+typedef struct {
+    char const* name;
+    void (*generate)(FILE* stream, int64_t count);
+    int64_t count; // instructions at --scale 1.
+} Workload;
+
+static void generate_int_arith(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < count; i += 8) {
+        fprintf(stream, "ipush 12345\nipush 678\nimul\nipush 91\niadd\n"
+                        "ipush 7\nidiv\npop\n");
+    }
+    fprintf(stream, "halt\n");
+}
+
+static void generate_double_arith(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < count; i += 8) {
+        fprintf(stream, "dpush 1.5\ndpush 2.25\ndmul\ndpush 0.75\ndadd\n"
+                        "dpush 3.0\nddiv\npop\n");
+    }
+    fprintf(stream, "halt\n");
+}
+
+static void generate_push_pop(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < count; i += 6)
+        fprintf(stream, "ipush 1\ndpush 2.0\nipush 3\npop\npop\npop\n");
+    fprintf(stream, "halt\n");
+}
+
+static void generate_print_heavy(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < count; i += 4)
+        fprintf(stream, "ipush 123456\nprint\ndpush 3.14159\nprint\n");
+    fprintf(stream, "halt\n");
+}
+
+static void generate_labels(FILE* stream, int64_t count)
+{
+    int64_t labels = count / 2;
+
+    fprintf(stream, "@segment readonly\n");
+    for (int64_t i = 0; i < labels; i++)
+        fprintf(stream, "c%ld: %ld.5\n", i, i);
+
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < labels; i++)
+        fprintf(stream, "dpush c%ld\npop\n", i);
+    fprintf(stream, "halt\n");
+}
+
+static void generate_large(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment readonly\nscale: 1.0001\nstep: 3\n");
+    fprintf(stream, "@segment code\n");
+    for (int64_t i = 0; i < count; i += 14) {
+        fprintf(stream, "ipush %ld\nipush step\nimul\nipush 5\nisub\npop\n",
+            i);
+        fprintf(stream, "dpush 0.%ld\ndpush scale\ndmul\ndpush 2.5\ndadd\n"
+                        "dpush 1.25\ndsub\npop\n",
+            i % 1000 + 1);
+    }
+    fprintf(stream, "halt\n");
+}
+
+// the vector instructions run over an array of 1024 doubles, so the time
+// per instruction is mostly the kernels'.
+static void generate_vector(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment readonly\nxs:");
+    for (int32_t i = 0; i < 1024; i++)
+        fprintf(stream, " %d.25", i % 100);
+    fprintf(stream, "\n@segment code\n");
+    for (int64_t i = 0; i < count; i += 8) {
+        fprintf(stream, "vpush xs\nvpush xs\nvdot\npop\n"
+                        "vpush xs\nvpush xs\nvadd\npop\n");
+    }
+    fprintf(stream, "halt\n");
+}
+
+// each object replaces the previous one in a field of the first, so almost
+// all of them die young while every store goes through the write barrier.
+static void generate_alloc(FILE* stream, int64_t count)
+{
+    fprintf(stream, "@segment code\nalloc 2\n");
+    for (int64_t i = 0; i < count; i += 7) {
+        fprintf(stream, "dup\nalloc 4\nstore 1\n"
+                        "dup\npload 1\nipush 3\nstore 0\n");
+    }
+    fprintf(stream, "halt\n");
+}
+
+static Workload const workloads[] = {
+    { "int_arith", generate_int_arith, 200000 },
+    { "double_arith", generate_double_arith, 200000 },
+    { "push_pop", generate_push_pop, 200000 },
+    { "print_heavy", generate_print_heavy, 200000 },
+    { "labels", generate_labels, 20000 },
+    { "large", generate_large, 2000000 },
+    { "vector", generate_vector, 20000 },
+    { "alloc", generate_alloc, 2000000 },
+};
+
+typedef struct {
+    double sum;
+    double sum_squares;
+    int32_t count;
+} Stats;
+
+static void stats_add(Stats* stats, double value)
+{
+    stats->sum += value;
+    stats->sum_squares += value * value;
+    stats->count += 1;
+}
+
+static double stats_mean(Stats const* stats)
+{
+    return stats->sum / stats->count;
+}
+
+static double stats_stddev(Stats const* stats)
+{
+    double mean = stats_mean(stats);
+    double variance = stats->sum_squares / stats->count - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// runs argv with stdout sent to /dev/null, returns the wall clock seconds.
+static double run(char* const* argv)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(
+        &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    double start = now();
+
+    pid_t pid;
+    int error = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    if (error != 0) {
+        fprintf(stderr, "ERROR: cannot run '%s': %s\n", argv[0],
+            strerror(error));
+        exit(1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now() - start;
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: '%s %s' failed\n", argv[0], argv[1]);
+        exit(1);
+    }
+
+    return elapsed;
+}
+
+static int64_t file_size(char const* path)
+{
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "ERROR: cannot stat '%s': %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+
+    return info.st_size;
+}
+
+int main(int argc, char** argv)
+{
+    char const* pyasm = "./pyasm";
+    char const* pyrite = "./pyrite";
+    char const* dir = "bench/workloads";
+    int32_t runs = 5;
+    int64_t scale = 1;
+    bool jit = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--pyasm") == 0 && i + 1 < argc) {
+            pyasm = argv[++i];
+        } else if (strcmp(argv[i], "--pyrite") == 0 && i + 1 < argc) {
+            pyrite = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else {
+            fprintf(stderr, "ERROR: unknown argument '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (runs < 1 || scale < 1) {
+        fprintf(stderr, "ERROR: --runs and --scale must be positive\n");
+        return 1;
+    }
+
+    mkdir(dir, 0755);
+
+    printf("%-14s %12s %10s %16s %16s\n", "workload", "instructions",
+        "source MB", "assemble MB/s", "execute ns/ins");
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        Workload const* workload = &workloads[w];
+        int64_t count = workload->count * scale;
+
+        char source[4096];
+        char program[4096];
+        snprintf(source, sizeof(source), "%s/%s.pyasm", dir, workload->name);
+        snprintf(program, sizeof(program), "%s/%s.pyrite", dir,
+            workload->name);
+
+        FILE* stream = fopen(source, "w");
+        if (!stream) {
+            fprintf(stderr, "ERROR: cannot open file '%s': %s\n", source,
+                strerror(errno));
+            return 1;
+        }
+        workload->generate(stream, count);
+        fclose(stream);
+
+        double megabytes = file_size(source) / (1024.0 * 1024.0);
+
+        char* assemble[] = { (char*)pyasm, source, program, NULL };
+        char* execute[]
+            = { (char*)pyrite, program, jit ? "--jit" : NULL, NULL };
+
+        Stats assemble_rate = { 0 };
+        Stats execute_cost = { 0 };
+
+        for (int32_t run_index = 0; run_index < runs; run_index++) {
+            stats_add(&assemble_rate, megabytes / run(assemble));
+            stats_add(&execute_cost, run(execute) * 1e9 / count);
+        }
+
+        printf("%-14s %12ld %10.2f %9.2f ±%5.2f %9.2f ±%5.2f\n",
+            workload->name, count, megabytes, stats_mean(&assemble_rate),
+            stats_stddev(&assemble_rate), stats_mean(&execute_cost),
+            stats_stddev(&execute_cost));
+    }
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGNMENT 16
+
+// a bump allocator over a list of large blocks. nothing is freed on its own,
+// arena_free releases every block at once.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t cap;
+    _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head; // the block allocations are bumped from.
+} Arena;
+
+static inline void arena_init(Arena* arena)
+{
+    arena->head = NULL;
+}
+
+static inline size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static inline ArenaBlock* arena_block_make(size_t cap)
+{
+    ArenaBlock* block = malloc(sizeof(*block) + cap);
+    if (!block) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    block->next = NULL;
+    block->used = 0;
+    block->cap = cap;
+    return block;
+}
+
+static inline void* arena_alloc(Arena* arena, size_t size)
+{
+    size = arena_align(size);
+
+    ArenaBlock* head = arena->head;
+    if (head && head->cap - head->used >= size) {
+        void* memory = head->data + head->used;
+        head->used += size;
+        return memory;
+    }
+
+    // big requests get a block of their own behind the head, so the space
+    // left in the head is not thrown away.
+    if (head && size > ARENA_BLOCK_SIZE / 4) {
+        ArenaBlock* block = arena_block_make(size);
+        block->used = size;
+        block->next = head->next;
+        head->next = block;
+        return block->data;
+    }
+
+    ArenaBlock* block
+        = arena_block_make(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    block->used = size;
+    block->next = head;
+    arena->head = block;
+    return block->data;
+}
+
+// grows memory to new_size. the latest allocation grows in place while its
+// block has room, anything else is copied.
+static inline void* arena_realloc(
+    Arena* arena, void* memory, size_t old_size, size_t new_size)
+{
+    ArenaBlock* head = arena->head;
+    unsigned char* bytes = memory;
+
+    if (bytes && head && bytes + arena_align(old_size) == head->data + head->used
+        && (size_t)(bytes - head->data) + arena_align(new_size) <= head->cap) {
+        head->used = bytes - head->data + arena_align(new_size);
+        return memory;
+    }
+
+    void* moved = arena_alloc(arena, new_size);
+    if (bytes)
+        memcpy(moved, bytes, old_size);
+
+    return moved;
+}
+
+static inline void arena_free(Arena* arena)
+{
+    ArenaBlock* block = arena->head;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head = NULL;
+}
@@ -3,51 +3,107 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+#include "arena.h"
+
+// arrays start with room for this many elements and double when full, so n
+// appends cost O(n) copying overall.
+#define DYNARRAY_INITIAL_CAP 16
+
 typedef struct {
     size_t length;
     size_t cap;
     size_t elem_size;
+    Arena* arena; // NULL when the array lives on the heap.
 } DynArrHeader;
 
-#define DYNARRAY_MAKE(___TYPE)                                                      \
-    ({                                                                              \
-         DynArrHeader* ___header = malloc(sizeof(*___header) + sizeof(___TYPE));    \
-         if (!___header) {                                                          \
-             perror("Memory allocation failed");                                    \
-             exit(EXIT_FAILURE);                                                    \
-         }                                                                          \
-         ___header->length = 0;                                                     \
-         ___header->cap = 1;                                                        \
-         ___header->elem_size = sizeof(___TYPE);                                    \
-         ___TYPE* ___start = (___TYPE*)(___header + 1);                             \
-         ___start;                                                                  \
+#define DYNARRAY_MAKE(___TYPE) DYNARRAY_MAKE_IN(___TYPE, NULL)
+
+// arena backed arrays grow inside the arena and are never freed one by one,
+// they go away with the arena.
+#define DYNARRAY_MAKE_IN(___TYPE, ___ARENA)                                                  \
+    ({                                                                                       \
+         Arena* ___arena = (___ARENA);                                                       \
+         size_t ___size = sizeof(DynArrHeader) + sizeof(___TYPE) * DYNARRAY_INITIAL_CAP;     \
+         DynArrHeader* ___header = ___arena                                                  \
+             ? arena_alloc(___arena, ___size)                                                \
+             : malloc(___size);                                                              \
+         if (!___header) {                                                                   \
+             perror("Memory allocation failed");                                             \
+             exit(EXIT_FAILURE);                                                             \
+         }                                                                                   \
+         ___header->length = 0;                                                              \
+         ___header->cap = DYNARRAY_INITIAL_CAP;                                              \
+         ___header->elem_size = sizeof(___TYPE);                                             \
+         ___header->arena = ___arena;                                                        \
+         ___TYPE* ___start = (___TYPE*)(___header + 1);                                      \
+         ___start;                                                                           \
      })
 
 #define DYNARRAY_FREE(___DYNARR)                                    \
     {                                                               \
         DynArrHeader* ___header = (DynArrHeader*)___DYNARR - 1;     \
-        free(___header);                                            \
+        if (!___header->arena)                                      \
+            free(___header);                                        \
     }
 
 #define DYNARRAY_APPEND(___DYNARR, ___DATA)                                                     \
     {                                                                                           \
         typeof(___DYNARR) ___raw_header = (___DYNARR);                                          \
-        DynArrHeader* ___header = (DynArrHeader*)(*___raw_header) - 1;                                 \
+        DynArrHeader* ___header = (DynArrHeader*)(*___raw_header) - 1;                          \
         if (___header->length >= ___header->cap) {                                              \
-            ___header->cap += 1;                                                                \
-            size_t ___new_size = ___header->elem_size * ___header->cap;                         \
-            DynArrHeader* ___new_header = realloc(___header, sizeof(*___header) + ___new_size); \
+            size_t ___old_size = sizeof(*___header) + ___header->elem_size * ___header->cap;    \
+            size_t ___new_size = sizeof(*___header) + ___header->elem_size * ___header->cap * 2; \
+            DynArrHeader* ___new_header = ___header->arena                                      \
+                ? arena_realloc(___header->arena, ___header, ___old_size, ___new_size)          \
+                : realloc(___header, ___new_size);                                              \
             if (!___new_header) {                                                               \
                 perror("Memory reallocation failed");                                           \
                 exit(EXIT_FAILURE);                                                             \
             }                                                                                   \
             ___header = ___new_header;                                                          \
+            ___header->cap *= 2;                                                                \
         }                                                                                       \
-        typeof(*___DYNARR) ___start = (typeof(*___DYNARR))(___header + 1);                        \
-        *___raw_header = ___start;                                                                   \
+        typeof(*___DYNARR) ___start = (typeof(*___DYNARR))(___header + 1);                      \
+        *___raw_header = ___start;                                                              \
         ___start[___header->length++] = ___DATA;                                                \
     }
 
+// makes room for at least ___CAP elements without changing the length.
+#define DYNARRAY_RESERVE(___DYNARR, ___CAP)                                                     \
+    {                                                                                           \
+        typeof(___DYNARR) ___raw_header = (___DYNARR);                                          \
+        DynArrHeader* ___header = (DynArrHeader*)(*___raw_header) - 1;                          \
+        size_t ___cap = (___CAP);                                                               \
+        if (___header->cap < ___cap) {                                                          \
+            size_t ___old_size = sizeof(*___header) + ___header->elem_size * ___header->cap;    \
+            size_t ___new_size = sizeof(*___header) + ___header->elem_size * ___cap;            \
+            DynArrHeader* ___new_header = ___header->arena                                      \
+                ? arena_realloc(___header->arena, ___header, ___old_size, ___new_size)          \
+                : realloc(___header, ___new_size);                                              \
+            if (!___new_header) {                                                               \
+                perror("Memory reallocation failed");                                           \
+                exit(EXIT_FAILURE);                                                             \
+            }                                                                                   \
+            ___header = ___new_header;                                                          \
+            ___header->cap = ___cap;                                                            \
+            *___raw_header = (typeof(*___DYNARR))(___header + 1);                               \
+        }                                                                                       \
+    }
+
+// drops every element but keeps the memory for reuse.
+#define DYNARRAY_CLEAR(___DYNARR)                                   \
+    {                                                               \
+        DynArrHeader* ___header = (DynArrHeader*)___DYNARR - 1;     \
+        ___header->length = 0;                                      \
+    }
+
+// drops the elements from ___LENGTH on, keeping the memory for reuse.
+#define DYNARRAY_TRUNCATE(___DYNARR, ___LENGTH)                     \
+    {                                                               \
+        DynArrHeader* ___header = (DynArrHeader*)___DYNARR - 1;     \
+        ___header->length = (___LENGTH);                            \
+    }
+
 #define DYNARRAY_LENGTH(___DYNARR)                                      \
     ({                                                                  \
         DynArrHeader* ___header = (DynArrHeader*)___DYNARR - 1;  \
@@ -6,6 +6,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
 #include "dynarr.h"
 #include "pyrite.h"
 
@@ -40,6 +50,7 @@ static bool span_equal_to_cstr(Span lhs, char const* rhs)
 typedef enum {
     PREC_SEGMENT,
     PREC_IMPORT,
+    PREC_EXPORT,
 } PreprocessorKind;
 
 typedef enum {
@@ -53,6 +64,7 @@ typedef struct {
     union {
         Segment as_segment;
         Span as_import;
+        Span as_export;
     };
 } Preprocessor;
 
@@ -66,6 +78,11 @@ static Preprocessor preprocessor_make_import(Span import)
     return (Preprocessor) { .kind = PREC_IMPORT, .as_import = import };
 }
 
+static Preprocessor preprocessor_make_export(Span name)
+{
+    return (Preprocessor) { .kind = PREC_EXPORT, .as_export = name };
+}
+
 typedef enum {
     TOK_INSTRUCTION,
     TOK_LABEL,
@@ -74,6 +91,10 @@ typedef enum {
     TOK_DOUBLE_LITERAL,
     TOK_STRING_LITERAL,
     TOK_PREPROCESSOR,
+
+    // never lexed, the value of a data label holding more than one double:
+    // the text of their literals separated by single spaces.
+    TOK_ARRAY_LITERAL,
 } TokenKind;
 
 typedef struct {
@@ -107,12 +128,20 @@ static Token token_make_preprocessor(Preprocessor prec, int32_t line)
 
 typedef struct {
     Span name;
-    int32_t address;
+    int32_t address; // -1 until the label is defined.
+    int32_t line; // where it was first seen, for undefined label errors.
+
+    // when streaming, the file offset of the newest jump operand waiting for
+    // this label, -1 for none. each waiting operand holds the offset of the
+    // one before it, so the chain lives in the output rather than in memory.
+    int32_t patches;
 } Label;
 
-static Label label_make(Span name, int32_t address)
+static Label label_make(Span name, int32_t address, int32_t line)
 {
-    return (Label) { .name = name, .address = address };
+    return (Label) {
+        .name = name, .address = address, .line = line, .patches = -1
+    };
 }
 
 typedef struct {
@@ -132,6 +161,7 @@ typedef enum {
 
 typedef struct {
     SymbolKind kind;
+    bool exported; // named by an @export, so other modules can use it.
     union {
         Label as_label;
         DataLabel as_data_label;
@@ -148,20 +178,369 @@ static Symbol symbol_make_data_label(DataLabel data_label)
     return (Symbol) { .kind = SYMBOL_DATA_LABEL, .as_data_label = data_label };
 }
 
+typedef struct {
+    PyriteInstruction opcode;
+    PyriteValue operand;
+    bool unresolved; // the operand indexes Assembler.unresolved.
+} Instruction;
+
+static Instruction instruction_make(
+    PyriteInstruction opcode, PyriteValue operand)
+{
+    return (Instruction) { .opcode = opcode, .operand = operand };
+}
+
+// pairs of instructions that are replaced by a single superinstruction. the
+// fused instruction keeps the operand of the first one, so the second must
+// not carry an operand of its own. to add a fusion, pick a hot pair from the
+// profiler's opcode pair counts, add a PyriteInstruction and a handler in
+// vm_execute, and list it here.
+typedef struct {
+    PyriteInstruction first;
+    PyriteInstruction second;
+    PyriteInstruction fused;
+} Fusion;
+
+static Fusion const fusions[] = {
+    { INS_IPUSH, INS_IADD, INS_IPUSH_IADD },
+    { INS_IPUSH, INS_ISUB, INS_IPUSH_ISUB },
+    { INS_IPUSH, INS_IMUL, INS_IPUSH_IMUL },
+    { INS_IPUSH, INS_IDIV, INS_IPUSH_IDIV },
+    { INS_DPUSH, INS_DADD, INS_DPUSH_DADD },
+    { INS_DPUSH, INS_DSUB, INS_DPUSH_DSUB },
+    { INS_DPUSH, INS_DMUL, INS_DPUSH_DMUL },
+    { INS_DPUSH, INS_DDIV, INS_DPUSH_DDIV },
+    { INS_IADD, INS_PRINT, INS_IADD_PRINT },
+    { INS_ISUB, INS_PRINT, INS_ISUB_PRINT },
+    { INS_IMUL, INS_PRINT, INS_IMUL_PRINT },
+    { INS_IDIV, INS_PRINT, INS_IDIV_PRINT },
+    { INS_DADD, INS_PRINT, INS_DADD_PRINT },
+    { INS_DSUB, INS_PRINT, INS_DSUB_PRINT },
+    { INS_DMUL, INS_PRINT, INS_DMUL_PRINT },
+    { INS_DDIV, INS_PRINT, INS_DDIV_PRINT },
+};
+
+// open addressing over indices into an array of symbols, keyed by name.
+typedef struct {
+    int32_t* slots; // -1 marks an empty slot.
+    int32_t cap; // always a power of two.
+    int32_t count;
+} SymbolTable;
+
+typedef enum {
+    RELOC_JUMP,
+    RELOC_INT,
+    RELOC_DOUBLE,
+    RELOC_STRING,
+    RELOC_ARRAY,
+} RelocationKind;
+
+// an operand the linker fills in: a jump to a label the module does not
+// define, or a use of a data label, which becomes the index of its value in
+// the program's constant pool.
+typedef struct {
+    RelocationKind kind;
+    int32_t offset; // of the operand in the module's code.
+    int32_t line;
+    Span name;
+} Relocation;
+
+// an assembled source file: its code, with jump targets relative to the
+// start of the module, the symbols it defines and the operands left to the
+// linker. imported modules are cached in object files next to their source
+// and only reassembled when the hash of the source changes.
+typedef struct {
+    char* path;
+    dev_t device;
+    ino_t inode;
+    uint64_t hash;
+    bool cached;
+
+    // the -O level, which the cached object has to match, and the bytes
+    // it saved.
+    int32_t optimization;
+    int32_t saved;
+
+    Span* imports; // paths as written, relative to the module's directory.
+    int32_t import_count;
+    int32_t* dependencies; // the module each import resolved to.
+
+    uint8_t* code;
+    int32_t code_length;
+
+    Symbol* symbols; // code label addresses are byte offsets into code.
+    int32_t symbol_count;
+
+    Relocation* relocations;
+    int32_t relocation_count;
+
+    Arena arena; // everything above that is not the path lives here.
+} Module;
+
 typedef struct {
     char const* input_file;
+    FILE* input;
+    bool input_done;
+
+    // the source is read and lexed a chunk of whole lines at a time, the
+    // buffer only grows for lines longer than a chunk.
     char* source;
     int32_t source_length;
+    int32_t source_cap;
 
     int32_t line;
     int32_t cursor;
 
     Symbol* symbols;
+    Span* imports;
+    Token* exports; // the names of @export directives, checked at the end.
+
+    // the tokens of the current chunk, consumed by the parser.
     Token* tokens;
+    int32_t token_cursor;
+    int32_t previous_line; // line of the last token consumed.
+
+    Instruction* code;
+
+    // the last instruction is held back until it is clear nothing fuses
+    // into it.
+    Instruction pending;
+    bool has_pending;
+
+    // set when streaming: instructions are encoded into this file as soon
+    // as they are final instead of being collected in code.
+    FILE* output;
+    int32_t output_length;
+    int32_t output_count; // instructions written so far.
+
+    // data operands whose symbol is not known yet, and where they ended up
+    // once encoded. when streaming, relocation offsets are file offsets.
+    Relocation* unresolved;
+    Relocation* relocations;
 
     uint8_t* program;
+
+    // tokens, symbols, code, program bytes and copied names all live here
+    // and are freed together.
+    Arena arena;
+
+    SymbolTable symbol_table;
 } Assembler;
 
+typedef struct {
+    char const* name;
+    PyriteInstruction instruction;
+} Mnemonic;
+
+static Mnemonic const mnemonics[] = {
+    { "halt", INS_HALT },
+    { "ipush", INS_IPUSH },
+    { "dpush", INS_DPUSH },
+    { "spush", INS_SCONST },
+    { "pop", INS_POP },
+    { "print", INS_PRINT },
+    { "iadd", INS_IADD },
+    { "isub", INS_ISUB },
+    { "imul", INS_IMUL },
+    { "idiv", INS_IDIV },
+    { "dadd", INS_DADD },
+    { "dsub", INS_DSUB },
+    { "dmul", INS_DMUL },
+    { "ddiv", INS_DDIV },
+    { "dup", INS_DUP },
+    { "jmp", INS_JMP },
+    { "ijeq", INS_IJEQ },
+    { "ijne", INS_IJNE },
+    { "ijlt", INS_IJLT },
+    { "ijle", INS_IJLE },
+    { "ijgt", INS_IJGT },
+    { "ijge", INS_IJGE },
+    { "djeq", INS_DJEQ },
+    { "djne", INS_DJNE },
+    { "djlt", INS_DJLT },
+    { "djle", INS_DJLE },
+    { "djgt", INS_DJGT },
+    { "djge", INS_DJGE },
+    { "call", INS_CALL },
+    { "ret", INS_RET },
+    { "arg", INS_ARG },
+    { "vpush", INS_VCONST },
+    { "vadd", INS_VADD },
+    { "vsub", INS_VSUB },
+    { "vmul", INS_VMUL },
+    { "vscale", INS_VSCALE },
+    { "vfma", INS_VFMA },
+    { "vsum", INS_VSUM },
+    { "vdot", INS_VDOT },
+    { "vlen", INS_VLEN },
+    { "alloc", INS_ALLOC },
+    { "store", INS_STORE },
+    { "iload", INS_ILOAD },
+    { "dload", INS_DLOAD },
+    { "pload", INS_PLOAD },
+    { "vload", INS_VLOAD },
+};
+
+// every mnemonic fits in eight bytes, so a name is looked up as a single
+// integer key: one multiplicative hash into a small table and one compare.
+#define MNEMONIC_TABLE_BITS 7
+#define MNEMONIC_TABLE_SIZE (1 << MNEMONIC_TABLE_BITS)
+
+typedef struct {
+    uint64_t key; // 0 marks an empty slot.
+    PyriteInstruction instruction;
+} MnemonicSlot;
+
+static MnemonicSlot mnemonic_table[MNEMONIC_TABLE_SIZE];
+
+static uint64_t mnemonic_key(char const* name, int32_t length)
+{
+    uint64_t key = 0;
+    memcpy(&key, name, length);
+    return key;
+}
+
+static uint32_t mnemonic_slot(uint64_t key)
+{
+    return (key * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - MNEMONIC_TABLE_BITS);
+}
+
+static void init_mnemonics(void)
+{
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+        uint64_t key
+            = mnemonic_key(mnemonics[i].name, strlen(mnemonics[i].name));
+
+        uint32_t slot = mnemonic_slot(key);
+        while (mnemonic_table[slot].key != 0)
+            slot = (slot + 1) % MNEMONIC_TABLE_SIZE;
+
+        mnemonic_table[slot].key = key;
+        mnemonic_table[slot].instruction = mnemonics[i].instruction;
+    }
+}
+
+// the instruction a mnemonic stands for, -1 for any other identifier.
+static int32_t lookup_mnemonic(Span span)
+{
+    if (span.length > (int32_t)sizeof(uint64_t))
+        return -1;
+
+    uint64_t key = mnemonic_key(span.start, span.length);
+    for (uint32_t slot = mnemonic_slot(key); mnemonic_table[slot].key != 0;
+        slot = (slot + 1) % MNEMONIC_TABLE_SIZE) {
+        if (mnemonic_table[slot].key == key)
+            return mnemonic_table[slot].instruction;
+    }
+
+    return -1;
+}
+
+// bytes of source read and lexed at a time.
+#define SOURCE_CHUNK (1024 * 1024)
+
+// the source buffer has this many bytes of slack past its capacity, so the
+// scanners below can always load a whole block, even right at the
+// terminator.
+#define SOURCE_PADDING 16
+
+#ifdef __SSE2__
+// bytes in [low, low + count), as an unsigned range check on signed lanes.
+static __m128i bytes_in_range(__m128i bytes, uint8_t low, uint8_t count)
+{
+    __m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8((char)(128 - low)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(count - 128)));
+}
+#endif
+
+// length of the run of isspace() bytes at text. the newlines in it are added
+// to newlines.
+static int32_t whitespace_run(char const* text, int32_t* newlines)
+{
+    int32_t length = 0;
+
+#ifdef __SSE2__
+    for (;;) {
+        __m128i bytes = _mm_loadu_si128((__m128i const*)(text + length));
+        __m128i space = _mm_or_si128(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+            bytes_in_range(bytes, '\t', 5)); // \t \n \v \f \r
+        uint32_t lines = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+        uint32_t other = ~_mm_movemask_epi8(space) & 0xffff;
+
+        if (other == 0) {
+            *newlines += __builtin_popcount(lines);
+            length += 16;
+            continue;
+        }
+
+        int32_t run = __builtin_ctz(other);
+        *newlines += __builtin_popcount(lines & ((1u << run) - 1));
+        return length + run;
+    }
+#else
+    while (isspace((unsigned char)text[length])) {
+        *newlines += text[length] == '\n';
+        length += 1;
+    }
+
+    return length;
+#endif
+}
+
+// length of the run of decimal digits at text.
+static int32_t digit_run(char const* text)
+{
+    int32_t length = 0;
+
+#ifdef __SSE2__
+    for (;;) {
+        __m128i bytes = _mm_loadu_si128((__m128i const*)(text + length));
+        uint32_t other
+            = ~_mm_movemask_epi8(bytes_in_range(bytes, '0', 10)) & 0xffff;
+
+        if (other != 0)
+            return length + __builtin_ctz(other);
+
+        length += 16;
+    }
+#else
+    while (isdigit((unsigned char)text[length]))
+        length += 1;
+
+    return length;
+#endif
+}
+
+// length of the run of identifier bytes ([A-Za-z0-9_]) at text.
+static int32_t identifier_run(char const* text)
+{
+    int32_t length = 0;
+
+#ifdef __SSE2__
+    for (;;) {
+        __m128i bytes = _mm_loadu_si128((__m128i const*)(text + length));
+        __m128i word = _mm_or_si128(
+            _mm_or_si128(bytes_in_range(bytes, 'a', 26),
+                bytes_in_range(bytes, 'A', 26)),
+            _mm_or_si128(bytes_in_range(bytes, '0', 10),
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'))));
+        uint32_t other = ~_mm_movemask_epi8(word) & 0xffff;
+
+        if (other != 0)
+            return length + __builtin_ctz(other);
+
+        length += 16;
+    }
+#else
+    while (isalnum((unsigned char)text[length]) || text[length] == '_')
+        length += 1;
+
+    return length;
+#endif
+}
+
 static char current(Assembler* assembler)
 {
     return assembler->source[assembler->cursor] != '\0'
@@ -183,14 +562,38 @@ static void advance(Assembler* assembler)
 
 static void skip_whitespace(Assembler* assembler)
 {
-    while (isspace(current(assembler)))
+    int32_t newlines = 0;
+    assembler->cursor += whitespace_run(
+        assembler->source + assembler->cursor, &newlines);
+    assembler->line += newlines;
+}
+
+// the contents of the string literal at the cursor, which is on its opening
+// quote.
+static Span lex_string(Assembler* assembler, int32_t line)
+{
+    advance(assembler);
+    char const* start = assembler->source + assembler->cursor;
+
+    int32_t length = 0;
+    while (current(assembler) && current(assembler) != '"'
+        && current(assembler) != '\n') {
+        length += 1;
         advance(assembler);
+    }
+
+    if (current(assembler) != '"') {
+        fprintf(stderr, "%s:%d: ERROR: unterminated string literal\n",
+            assembler->input_file, line);
+        exit(1);
+    }
+
+    advance(assembler);
+    return span_make(start, length);
 }
 
 static void get_tokens(Assembler* assembler)
 {
-    assembler->tokens = DYNARRAY_MAKE(Token);
-
     while (current(assembler)) {
         skip_whitespace(assembler);
 
@@ -218,10 +621,8 @@ static void get_tokens(Assembler* assembler)
                 kind = PREC_SEGMENT;
             } else if (span_equal_to_cstr(prec, "import")) {
                 kind = PREC_IMPORT;
-                fprintf(stderr,
-                    "%s:%d: ERROR: import preprocessor is not implemented "
-                    "yet\n",
-                    assembler->input_file, line);
+            } else if (span_equal_to_cstr(prec, "export")) {
+                kind = PREC_EXPORT;
             } else {
                 fprintf(stderr,
                     "%s:%d: ERROR: '%.*s' is not a valid preprocessor\n",
@@ -257,15 +658,40 @@ static void get_tokens(Assembler* assembler)
 
                 continue;
             }
+
+            if (kind == PREC_EXPORT) {
+                if (!isalpha(current(assembler)) && current(assembler) != '_') {
+                    fprintf(stderr, "%s:%d: ERROR: expected a symbol name\n",
+                        assembler->input_file, line);
+                    exit(1);
+                }
+
+                length = identifier_run(start);
+                assembler->cursor += length;
+                DYNARRAY_APPEND(&assembler->tokens,
+                    token_make_preprocessor(
+                        preprocessor_make_export(span_make(start, length)),
+                        line));
+                continue;
+            }
+
+            if (current(assembler) != '"') {
+                fprintf(stderr, "%s:%d: ERROR: expected a module path\n",
+                    assembler->input_file, line);
+                exit(1);
+            }
+
+            DYNARRAY_APPEND(&assembler->tokens,
+                token_make_preprocessor(
+                    preprocessor_make_import(lex_string(assembler, line)),
+                    line));
+            continue;
         }
 
         if (isalpha(current(assembler)) || current(assembler) == '_') {
-            int32_t length = 0;
-            do {
-                length += 1;
-                advance(assembler);
-            } while (current(assembler)
-                && (isalnum(current(assembler)) || current(assembler) == '_'));
+            // identifiers never span lines, so the cursor can jump.
+            int32_t length = identifier_run(start);
+            assembler->cursor += length;
 
             if (current(assembler) == ':') {
                 advance(assembler);
@@ -276,45 +702,10 @@ static void get_tokens(Assembler* assembler)
 
             Span span = span_make(start, length);
 
-            if (span_equal_to_cstr(span, "halt")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_HALT, line));
-            } else if (span_equal_to_cstr(span, "ipush")) {
+            int32_t instruction = lookup_mnemonic(span);
+            if (instruction >= 0) {
                 DYNARRAY_APPEND(&assembler->tokens,
-                    token_make_instruction(INS_IPUSH, line));
-            } else if (span_equal_to_cstr(span, "dpush")) {
-                DYNARRAY_APPEND(&assembler->tokens,
-                    token_make_instruction(INS_DPUSH, line));
-            } else if (span_equal_to_cstr(span, "pop")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_POP, line));
-            } else if (span_equal_to_cstr(span, "print")) {
-                DYNARRAY_APPEND(&assembler->tokens,
-                    token_make_instruction(INS_PRINT, line));
-            } else if (span_equal_to_cstr(span, "iadd")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_IADD, line));
-            } else if (span_equal_to_cstr(span, "isub")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_ISUB, line));
-            } else if (span_equal_to_cstr(span, "imul")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_IMUL, line));
-            } else if (span_equal_to_cstr(span, "idiv")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_IDIV, line));
-            } else if (span_equal_to_cstr(span, "dadd")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_DADD, line));
-            } else if (span_equal_to_cstr(span, "dsub")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_DSUB, line));
-            } else if (span_equal_to_cstr(span, "dmul")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_DMUL, line));
-            } else if (span_equal_to_cstr(span, "ddiv")) {
-                DYNARRAY_APPEND(
-                    &assembler->tokens, token_make_instruction(INS_DDIV, line));
+                    token_make_instruction(instruction, line));
             } else {
                 DYNARRAY_APPEND(&assembler->tokens,
                     token_make(TOK_IDENTIFIER, line, span_make(start, length)));
@@ -324,21 +715,16 @@ static void get_tokens(Assembler* assembler)
         }
 
         if (isdigit(current(assembler))) {
-            int32_t length = 0;
-            do {
-                length += 1;
-                advance(assembler);
-            } while (current(assembler) && isdigit(current(assembler)));
+            int32_t length = digit_run(start);
+            assembler->cursor += length;
 
             if (current(assembler) == '.') {
                 length += 1;
                 advance(assembler);
 
-                int32_t mantissa_length = 0;
-                while (current(assembler) && isdigit(current(assembler))) {
-                    mantissa_length += 1;
-                    advance(assembler);
-                }
+                int32_t mantissa_length
+                    = digit_run(assembler->source + assembler->cursor);
+                assembler->cursor += mantissa_length;
 
                 if (mantissa_length == 0) {
                     fprintf(stderr,
@@ -359,26 +745,9 @@ static void get_tokens(Assembler* assembler)
         }
 
         if (current(assembler) == '"') {
-            advance(assembler);
-            start = assembler->source + assembler->cursor;
-
-            int32_t length = 0;
-            while (current(assembler) && current(assembler) != '"'
-                && current(assembler) != '\n') {
-                length += 1;
-                advance(assembler);
-            }
-
-            if (current(assembler) != '"') {
-                fprintf(stderr, "%s:%d: ERROR: unterminated string literal\n",
-                    assembler->input_file, line);
-                exit(1);
-            }
-
-            advance(assembler);
-
             DYNARRAY_APPEND(&assembler->tokens,
-                token_make(TOK_STRING_LITERAL, line, span_make(start, length)));
+                token_make(
+                    TOK_STRING_LITERAL, line, lex_string(assembler, line)));
             continue;
         }
 
@@ -394,157 +763,600 @@ static void get_tokens(Assembler* assembler)
     }
 }
 
-static void assembler_init(Assembler* assembler, char const* input_file)
+// the offset just past the last newline in the first length bytes of text,
+// 0 when there is none.
+static int32_t line_boundary(char const* text, int32_t length)
 {
-    assembler->input_file = input_file;
-    assembler->source = NULL;
-    assembler->line = 1;
+    while (length > 0 && text[length - 1] != '\n')
+        length -= 1;
+
+    return length;
+}
+
+// replaces the tokens with those of the next chunk of source, returns false
+// once the source is used up. the spans of the previous tokens point into
+// the buffer that is refilled here, so they must not be used afterwards.
+static bool next_chunk(Assembler* assembler)
+{
+    if (assembler->input_done)
+        return false;
+
+    // the partial line the last chunk ended with is carried over.
+    int32_t tail = assembler->source_length - assembler->cursor;
+    memmove(assembler->source, assembler->source + assembler->cursor, tail);
+    assembler->source_length = tail;
     assembler->cursor = 0;
 
-    FILE* stream = fopen(input_file, "r");
-    if (!stream) {
-        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", input_file,
-            strerror(errno));
-        exit(1);
-    }
+    int32_t end;
+    for (;;) {
+        if (assembler->source_length == assembler->source_cap) {
+            assembler->source_cap *= 2;
+            assembler->source = realloc(
+                assembler->source, assembler->source_cap + 1 + SOURCE_PADDING);
+            if (!assembler->source) {
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-    fseek(stream, 0, SEEK_END);
-    long size = ftell(stream);
-    fseek(stream, 0, SEEK_SET);
+        int32_t scanned = assembler->source_length;
+        size_t read = fread(assembler->source + assembler->source_length, 1,
+            assembler->source_cap - assembler->source_length, assembler->input);
+        assembler->source_length += read;
 
-    if (size == 0) {
-        fprintf(stderr, "WARNING: file '%s' is empty\n", input_file);
-        fprintf(stderr, "exiting now...\n");
-        exit(0);
-    }
+        if (read == 0) {
+            if (ferror(assembler->input)) {
+                fprintf(stderr, "ERROR: cannot read file '%s'\n",
+                    assembler->input_file);
+                exit(1);
+            }
 
-    assembler->source = malloc(sizeof(char) * size + 1);
-    if (!fread(assembler->source, sizeof(char), size, stream)) {
-        fprintf(stderr, "ERROR: cannot read file '%s'\n", input_file);
-        exit(1);
-    }
+            end = assembler->source_length;
+            assembler->input_done = true;
+            break;
+        }
 
-    fclose(stream);
+        end = line_boundary(assembler->source + scanned, read);
+        if (end > 0) {
+            end += scanned;
+            break;
+        }
+    }
 
-    assembler->source[size] = '\0'; // null terminated.
-    assembler->source_length = size;
+    DYNARRAY_CLEAR(assembler->tokens);
+    assembler->token_cursor = 0;
 
+    // literals are parsed straight out of the source, after the last chunk
+    // nothing else bounds the final one, so its terminator stays.
+    char saved = assembler->source[end];
+    assembler->source[end] = '\0';
     get_tokens(assembler);
-    assembler->cursor = 0; // now the cursor is used by the parser.
+    if (!assembler->input_done)
+        assembler->source[end] = saved;
+
+    // like a whole file, the source ends at the first null byte.
+    if (assembler->cursor < end)
+        assembler->input_done = true;
 
-    assembler->symbols = DYNARRAY_MAKE(Symbol);
-    assembler->program = DYNARRAY_MAKE(uint8_t);
+    return true;
 }
 
-static void assembler_free(Assembler* assembler)
+static Span symbol_name(Symbol const* symbol)
 {
-    DYNARRAY_FREE(assembler->program);
-    DYNARRAY_FREE(assembler->symbols);
-    DYNARRAY_FREE(assembler->tokens);
-    free(assembler->source);
+    return symbol->kind == SYMBOL_LABEL ? symbol->as_label.name
+                                        : symbol->as_data_label.name;
 }
 
-static int32_t program_counter(Assembler* assembler)
+// fnv-1a over the bytes of the name.
+static uint32_t span_hash(Span span)
 {
-    return DYNARRAY_LENGTH(assembler->program);
+    uint32_t hash = 2166136261u;
+    for (int32_t i = 0; i < span.length; i++) {
+        hash ^= (uint8_t)span.start[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
 }
 
-static void put_label(Assembler* assembler, Label label)
+// the slot holding name, or the empty slot where it would go.
+static int32_t symbol_table_slot(
+    SymbolTable const* table, Symbol const* symbols, Span name)
 {
-    DYNARRAY_APPEND(&assembler->symbols, symbol_make_label(label));
+    uint32_t mask = table->cap - 1;
+
+    for (uint32_t slot = span_hash(name) & mask;; slot = (slot + 1) & mask) {
+        int32_t index = table->slots[slot];
+        if (index == -1 || span_equal(name, symbol_name(&symbols[index])))
+            return slot;
+    }
 }
 
-static int32_t lookup_label(Assembler* assembler, Span label)
+// a table need not cover every symbol in the array, so only the indices
+// it already holds are filed again.
+static void symbol_table_resize(
+    SymbolTable* table, Symbol const* symbols, int32_t cap)
 {
-    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(assembler->symbols); i++) {
-        if (assembler->symbols[i].kind == SYMBOL_LABEL) {
-            if (span_equal(label, assembler->symbols[i].as_label.name)) {
-                return i;
-            }
-        } else {
-            if (span_equal(label, assembler->symbols[i].as_data_label.name)) {
-                return i;
-            }
-        }
+    int32_t* old_slots = table->slots;
+    int32_t old_cap = table->cap;
+
+    table->cap = cap;
+    table->slots = malloc(sizeof(int32_t) * cap);
+    if (!table->slots) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
     }
 
-    return -1;
+    for (int32_t slot = 0; slot < cap; slot++)
+        table->slots[slot] = -1;
+
+    for (int32_t slot = 0; old_slots && slot < old_cap; slot++) {
+        int32_t index = old_slots[slot];
+        if (index == -1)
+            continue;
+
+        Span name = symbol_name(&symbols[index]);
+        table->slots[symbol_table_slot(table, symbols, name)] = index;
+    }
+
+    free(old_slots);
 }
 
-static void patch_label(Assembler* assembler, int32_t index, int32_t address)
+static void symbol_table_init(SymbolTable* table, Symbol const* symbols)
 {
-    assembler->symbols[index].as_label.address = address;
+    table->slots = NULL;
+    table->cap = 0;
+    table->count = 0;
+    symbol_table_resize(table, symbols, 64);
 }
 
-static bool is_eof(Assembler* assembler)
+// files the symbol at index under the empty slot found for its name.
+static void symbol_table_file(
+    SymbolTable* table, Symbol const* symbols, int32_t slot, int32_t index)
 {
-    return assembler->cursor >= (int32_t)DYNARRAY_LENGTH(assembler->tokens);
+    table->slots[slot] = index;
+    table->count += 1;
+
+    // keep the table at most half full so probe runs stay short.
+    if (table->count * 2 > table->cap)
+        symbol_table_resize(table, symbols, table->cap * 2);
 }
 
-static Token current_token(Assembler* assembler)
+// appends symbol and files it under the empty slot found for its name.
+static int32_t symbol_table_put(
+    SymbolTable* table, Symbol** symbols, int32_t slot, Symbol symbol)
 {
-    return assembler->tokens[assembler->cursor];
+    int32_t index = DYNARRAY_LENGTH(*symbols);
+    DYNARRAY_APPEND(symbols, symbol);
+    symbol_table_file(table, *symbols, slot, index);
+    return index;
 }
 
-static void advance_token(Assembler* assembler)
+// the source buffer only holds the current chunk, so anything that outlives
+// it is copied into the arena. the copy is null terminated for strtoll and
+// strtod.
+static Span copy_span(Assembler* assembler, Span span)
 {
-    if (is_eof(assembler))
-        return;
+    char* copy = arena_alloc(&assembler->arena, span.length + 1);
+    memcpy(copy, span.start, span.length);
+    copy[span.length] = '\0';
+    return span_make(copy, span.length);
+}
 
-    assembler->cursor += 1;
+// the symbol called name, added as an undefined code label when it has not
+// been seen before. jumps may refer to a label before it is defined, it is
+// resolved once the label shows up.
+static int32_t put_label(Assembler* assembler, Span name, int32_t line)
+{
+    SymbolTable* table = &assembler->symbol_table;
+    int32_t slot = symbol_table_slot(table, assembler->symbols, name);
+    if (table->slots[slot] != -1)
+        return table->slots[slot];
+
+    return symbol_table_put(table, &assembler->symbols, slot,
+        symbol_make_label(label_make(copy_span(assembler, name), -1, line)));
 }
 
-static void match_token(Assembler* assembler, TokenKind kind)
+// symbols never move once added, so the returned index stays valid for
+// patch_label and for turning a label into a data label in place.
+static int32_t lookup_label(Assembler* assembler, Span label)
 {
-    if (is_eof(assembler)) {
-        Token previous
-            = assembler->tokens[DYNARRAY_LENGTH(assembler->tokens) - 1];
-        fprintf(stderr, "%s:%d: ERROR: unexpected end of file\n",
-            assembler->input_file, previous.line);
+    SymbolTable* table = &assembler->symbol_table;
+    return table->slots[symbol_table_slot(table, assembler->symbols, label)];
+}
+
+static void assembler_init(Assembler* assembler, char const* input_file)
+{
+    assembler->input_file = input_file;
+    assembler->input_done = false;
+    assembler->line = 1;
+    assembler->cursor = 0;
+    arena_init(&assembler->arena);
+
+    assembler->input = fopen(input_file, "r");
+    if (!assembler->input) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", input_file,
+            strerror(errno));
         exit(1);
     }
-    if (current_token(assembler).kind != kind) {
-        fprintf(stderr, "%s:%d: ERROR: unexpected token\n",
-            assembler->input_file, current_token(assembler).line);
-        exit(1);
+
+    int first = fgetc(assembler->input);
+    if (first == EOF) {
+        fprintf(stderr, "WARNING: file '%s' is empty\n", input_file);
+        fprintf(stderr, "exiting now...\n");
+        exit(0);
+    }
+    ungetc(first, assembler->input);
+
+    assembler->source_length = 0;
+    assembler->source_cap = SOURCE_CHUNK;
+    assembler->source = malloc(assembler->source_cap + 1 + SOURCE_PADDING);
+    if (!assembler->source) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
     }
 
-    advance_token(assembler);
+    // roughly one token per four bytes of source in practice. the pages of
+    // an over estimate are never touched, an under estimate just grows.
+    assembler->tokens = DYNARRAY_MAKE_IN(Token, &assembler->arena);
+    DYNARRAY_RESERVE(&assembler->tokens, SOURCE_CHUNK / 4 + 16);
+    assembler->token_cursor = 0;
+    assembler->previous_line = 1;
+
+    assembler->symbols = DYNARRAY_MAKE_IN(Symbol, &assembler->arena);
+    symbol_table_init(&assembler->symbol_table, assembler->symbols);
+    assembler->imports = DYNARRAY_MAKE_IN(Span, &assembler->arena);
+    assembler->exports = DYNARRAY_MAKE_IN(Token, &assembler->arena);
+    assembler->code = DYNARRAY_MAKE_IN(Instruction, &assembler->arena);
+    assembler->has_pending = false;
+    assembler->output = NULL;
+    assembler->output_length = 0;
+    assembler->output_count = 0;
+    assembler->unresolved = DYNARRAY_MAKE_IN(Relocation, &assembler->arena);
+    assembler->relocations = DYNARRAY_MAKE_IN(Relocation, &assembler->arena);
+    assembler->program = DYNARRAY_MAKE_IN(uint8_t, &assembler->arena);
 }
 
-#define GENERATE_SINGLE_INSTRUCTION(INSTRUCTION)           \
-    {                                                      \
-        DYNARRAY_APPEND(&assembler->program, INSTRUCTION); \
-        advance_token(assembler);                          \
-    }
+static void assembler_free(Assembler* assembler)
+{
+    arena_free(&assembler->arena);
+    free(assembler->symbol_table.slots);
+    free(assembler->source);
+    fclose(assembler->input);
+}
 
-static bool is_single_instruction(PyriteInstruction instruction)
+static int32_t operand_size(PyriteInstruction instruction);
+static bool is_jump_instruction(PyriteInstruction instruction);
+
+// the output is a v2 file with a fixed set of sections, the code comes
+// right after the section table.
+#define SECTION_COUNT 3
+#define CODE_OFFSET \
+    (sizeof(PyriteFileHeader) + SECTION_COUNT * sizeof(PyriteSection))
+
+// the bytes of an instruction at offset into the code: its opcode, zero
+// padding up to the operand's alignment and the operand. returns how many
+// there are.
+static int32_t encode_instruction(uint8_t* bytes, int32_t offset,
+    PyriteInstruction opcode, PyriteValue operand)
 {
-    switch (instruction) {
-    case INS_HALT:
-    case INS_POP:
-    case INS_PRINT:
-    case INS_IADD:
-    case INS_ISUB:
-    case INS_IMUL:
-    case INS_IDIV:
+    int32_t size = operand_size(opcode);
+    int32_t operand_offset = pyrite_operand_offset(offset, size) - offset;
+
+    memset(bytes, 0, operand_offset);
+    bytes[0] = opcode;
+    memcpy(bytes + operand_offset, &operand, size);
+    return operand_offset + size;
+}
+
+// the address of the next instruction: an index into code, or a byte offset
+// when streaming.
+static int32_t program_counter(Assembler* assembler)
+{
+    return assembler->output ? assembler->output_length
+                             : (int32_t)DYNARRAY_LENGTH(assembler->code);
+}
+
+static void write_instruction(Assembler* assembler, Instruction instruction)
+{
+    int32_t operand = pyrite_operand_offset(
+        assembler->output_length, operand_size(instruction.opcode));
+
+    // jumps to labels that are not defined yet are chained up and patched
+    // by link_streamed, as are unresolved data operands.
+    if (instruction.unresolved) {
+        Relocation relocation
+            = assembler->unresolved[instruction.operand.as_int];
+        relocation.offset = CODE_OFFSET + operand;
+        DYNARRAY_APPEND(&assembler->relocations, relocation);
+        instruction.operand.as_int = 0;
+    } else if (is_jump_instruction(instruction.opcode)) {
+        Label* label = &assembler->symbols[instruction.operand.as_int].as_label;
+        instruction.operand.as_int = label->address;
+
+        if (label->address == -1) {
+            instruction.operand.as_int = label->patches;
+            label->patches = CODE_OFFSET + operand;
+        }
+    }
+
+    uint8_t bytes[2 * sizeof(PyriteValue)];
+    int32_t size = encode_instruction(bytes, assembler->output_length,
+        instruction.opcode, instruction.operand);
+    fwrite(bytes, 1, size, assembler->output);
+    assembler->output_length += size;
+    assembler->output_count += 1;
+}
+
+static void flush_instruction(Assembler* assembler)
+{
+    if (!assembler->has_pending)
+        return;
+
+    assembler->has_pending = false;
+
+    if (assembler->output) {
+        write_instruction(assembler, assembler->pending);
+    } else {
+        DYNARRAY_APPEND(&assembler->code, assembler->pending);
+    }
+}
+
+static void emit_instruction(Assembler* assembler, Instruction instruction)
+{
+    if (assembler->has_pending) {
+        Instruction* previous = &assembler->pending;
+        for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+            if (fusions[i].first == previous->opcode
+                && fusions[i].second == instruction.opcode) {
+                previous->opcode = fusions[i].fused;
+                return;
+            }
+        }
+
+        flush_instruction(assembler);
+    }
+
+    assembler->pending = instruction;
+    assembler->has_pending = true;
+}
+
+static void patch_label(Assembler* assembler, int32_t index, int32_t address)
+{
+    assembler->symbols[index].as_label.address = address;
+}
+
+// lexes more source when the parser has used up the current chunk.
+static bool is_eof(Assembler* assembler)
+{
+    while (assembler->token_cursor
+        >= (int32_t)DYNARRAY_LENGTH(assembler->tokens)) {
+        if (!next_chunk(assembler))
+            return true;
+    }
+
+    return false;
+}
+
+static Token current_token(Assembler* assembler)
+{
+    if (is_eof(assembler)) {
+        fprintf(stderr, "%s:%d: ERROR: unexpected end of file\n",
+            assembler->input_file, assembler->previous_line);
+        exit(1);
+    }
+
+    return assembler->tokens[assembler->token_cursor];
+}
+
+// never lexes, so the spans of the token advanced over stay valid until the
+// next is_eof or current_token.
+static void advance_token(Assembler* assembler)
+{
+    if (assembler->token_cursor
+        >= (int32_t)DYNARRAY_LENGTH(assembler->tokens))
+        return;
+
+    assembler->previous_line
+        = assembler->tokens[assembler->token_cursor].line;
+    assembler->token_cursor += 1;
+}
+
+static void match_token(Assembler* assembler, TokenKind kind)
+{
+    if (current_token(assembler).kind != kind) {
+        fprintf(stderr, "%s:%d: ERROR: unexpected token\n",
+            assembler->input_file, current_token(assembler).line);
+        exit(1);
+    }
+
+    advance_token(assembler);
+}
+
+#define GENERATE_SINGLE_INSTRUCTION(INSTRUCTION)                           \
+    {                                                                      \
+        emit_instruction(assembler,                                        \
+            instruction_make(INSTRUCTION, (PyriteValue) { .as_int = 0 })); \
+        advance_token(assembler);                                          \
+    }
+
+static bool is_single_instruction(PyriteInstruction instruction)
+{
+    switch (instruction) {
+    case INS_HALT:
+    case INS_POP:
+    case INS_PRINT:
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
     case INS_DADD:
     case INS_DSUB:
     case INS_DMUL:
     case INS_DDIV:
+    case INS_DUP:
+    case INS_VADD:
+    case INS_VSUB:
+    case INS_VMUL:
+    case INS_VSCALE:
+    case INS_VFMA:
+    case INS_VSUM:
+    case INS_VDOT:
+    case INS_VLEN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_jump_instruction(PyriteInstruction instruction)
+{
+    switch (instruction) {
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+    case INS_CALL:
         return true;
     default:
         return false;
     }
 }
 
+static Token expect_operand(Assembler* assembler, Token instruction)
+{
+    if (is_eof(assembler)) {
+        fprintf(stderr, "%s:%d: ERROR: missing operand\n",
+            assembler->input_file, instruction.line);
+        exit(1);
+    }
+
+    Token operand = current_token(assembler);
+    advance_token(assembler);
+    return operand;
+}
+
+// jump targets are code labels. the operand holds the symbol index until
+// the jump is encoded into an absolute byte offset, labels that are only
+// defined further down are patched in at the end.
+static void parse_jump(Assembler* assembler, Token current)
+{
+    advance_token(assembler);
+
+    Token operand = expect_operand(assembler, current);
+    if (operand.kind != TOK_IDENTIFIER) {
+        fprintf(stderr, "%s:%d: ERROR: expected a label\n",
+            assembler->input_file, operand.line);
+        exit(1);
+    }
+
+    int32_t index = put_label(assembler, operand.as_span, operand.line);
+    if (assembler->symbols[index].kind != SYMBOL_LABEL) {
+        fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is not a code label\n",
+            assembler->input_file, operand.line, operand.as_span.length,
+            operand.as_span.start);
+        exit(1);
+    }
+
+    emit_instruction(assembler,
+        instruction_make(
+            current.as_instruction, (PyriteValue) { .as_int = index }));
+}
+
+// `ret n`, `arg n` and the heap instructions' field counts and indices are
+// small non negative counts.
+static void parse_count(Assembler* assembler, Token current)
+{
+    advance_token(assembler);
+
+    Token operand = expect_operand(assembler, current);
+    if (operand.kind != TOK_INT_LITERAL) {
+        fprintf(stderr, "%s:%d: ERROR: expected an integer literal\n",
+            assembler->input_file, operand.line);
+        exit(1);
+    }
+
+    int64_t count = strtoll(operand.as_span.start, nullptr, 10);
+    if (count < 0 || count > INT32_MAX) {
+        fprintf(stderr, "%s:%d: ERROR: count is out of range\n",
+            assembler->input_file, operand.line);
+        exit(1);
+    }
+
+    emit_instruction(assembler,
+        instruction_make(
+            current.as_instruction, (PyriteValue) { .as_int = count }));
+}
+
+// data labels are loaded from the constant pool, which only the linker
+// builds: it holds the values of every module, so every use of a data label
+// is left to it, defined further down, in another module or not. the one
+// exception is a number this module already defined, which is pushed as an
+// immediate so it still fuses with the instruction after it.
+static void parse_data_operand(Assembler* assembler, PyriteInstruction opcode,
+    RelocationKind kind, Token operand)
+{
+    int32_t symbol = lookup_label(assembler, operand.as_span);
+    if (symbol != -1
+        && assembler->symbols[symbol].kind == SYMBOL_DATA_LABEL) {
+        Token data = assembler->symbols[symbol].as_data_label.data;
+        if (opcode == INS_ICONST && data.kind == TOK_INT_LITERAL) {
+            int64_t integer = strtoll(data.as_span.start, nullptr, 10);
+            emit_instruction(assembler,
+                instruction_make(
+                    INS_IPUSH, (PyriteValue) { .as_int = integer }));
+            return;
+        }
+
+        if (opcode == INS_DCONST && data.kind == TOK_DOUBLE_LITERAL) {
+            double_t dbl = strtod(data.as_span.start, nullptr);
+            emit_instruction(assembler,
+                instruction_make(
+                    INS_DPUSH, (PyriteValue) { .as_double = dbl }));
+            return;
+        }
+    }
+
+    Relocation use = { .kind = kind,
+        .offset = -1,
+        .line = operand.line,
+        .name = copy_span(assembler, operand.as_span) };
+
+    int32_t index = DYNARRAY_LENGTH(assembler->unresolved);
+    Instruction instruction
+        = instruction_make(opcode, (PyriteValue) { .as_int = index });
+    instruction.unresolved = true;
+
+    DYNARRAY_APPEND(&assembler->unresolved, use);
+    emit_instruction(assembler, instruction);
+}
+
 static void parse_instruction(Assembler* assembler)
 {
     Token current = current_token(assembler);
 
     if (current.kind == TOK_LABEL) {
-        patch_label(assembler, lookup_label(assembler, current.as_span),
-            program_counter(assembler));
+        int32_t index = put_label(assembler, current.as_span, current.line);
+        Symbol symbol = assembler->symbols[index];
+        if (symbol.kind != SYMBOL_LABEL || symbol.as_label.address != -1) {
+            fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is already defined\n",
+                assembler->input_file, current.line, current.as_span.length,
+                current.as_span.start);
+            exit(1);
+        }
+
+        // never fuse across a label, something may jump right in between.
+        flush_instruction(assembler);
+        patch_label(assembler, index, program_counter(assembler));
         advance_token(assembler);
         return;
     }
@@ -560,162 +1372,197 @@ static void parse_instruction(Assembler* assembler)
         return;
     }
 
+    if (is_jump_instruction(current.as_instruction)) {
+        parse_jump(assembler, current);
+        return;
+    }
+
     switch (current.as_instruction) {
     case INS_IPUSH: {
-        DYNARRAY_APPEND(&assembler->program, INS_IPUSH);
         advance_token(assembler);
 
         Token operand = current_token(assembler);
         if (operand.kind == TOK_IDENTIFIER) {
             advance_token(assembler);
 
-            int32_t index = lookup_label(assembler, operand.as_span);
-            if (index == -1) {
-                fprintf(stderr, "%s:%d: ERROR: no such symbol '%.*s'\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            Symbol symbol = assembler->symbols[index];
-            if (symbol.kind != SYMBOL_DATA_LABEL) {
-                fprintf(stderr,
-                    "%s:%d: ERROR: symbol '%.*s' is not a data label\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            Token data = symbol.as_data_label.data;
-            if (data.kind != TOK_INT_LITERAL) {
-                fprintf(stderr,
-                    "%s:%d: ERROR: symbol '%.*s' is not an integer literal\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            int64_t integer = strtoll(data.as_span.start, nullptr, 10);
-            uint8_t bytes[sizeof(int64_t)];
-            memcpy(bytes, &integer, sizeof(int64_t));
-
-            for (int32_t i = 0; i < (int32_t)sizeof(int64_t); i++)
-                DYNARRAY_APPEND(&assembler->program, bytes[i]);
-
+            parse_data_operand(assembler, INS_ICONST, RELOC_INT, operand);
             break;
         }
 
         match_token(assembler, TOK_INT_LITERAL);
 
         int64_t integer = strtoll(operand.as_span.start, nullptr, 10);
-        uint8_t bytes[sizeof(int64_t)];
-        memcpy(bytes, &integer, sizeof(int64_t));
-
-        for (int32_t i = 0; i < (int32_t)sizeof(int64_t); i++)
-            DYNARRAY_APPEND(&assembler->program, bytes[i]);
+        emit_instruction(assembler,
+            instruction_make(INS_IPUSH, (PyriteValue) { .as_int = integer }));
     } break;
     case INS_DPUSH: {
-        DYNARRAY_APPEND(&assembler->program, INS_DPUSH);
         advance_token(assembler);
 
         Token operand = current_token(assembler);
         if (operand.kind == TOK_IDENTIFIER) {
             advance_token(assembler);
 
-            int32_t index = lookup_label(assembler, operand.as_span);
-            if (index == -1) {
-                fprintf(stderr, "%s:%d: ERROR: no such symbol '%.*s'\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            Symbol symbol = assembler->symbols[index];
-            if (symbol.kind != SYMBOL_DATA_LABEL) {
-                fprintf(stderr,
-                    "%s:%d: ERROR: symbol '%.*s' is not a data label\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            Token data = symbol.as_data_label.data;
-            if (data.kind != TOK_DOUBLE_LITERAL) {
-                fprintf(stderr,
-                    "%s:%d: ERROR: symbol '%.*s' is not a double literal\n",
-                    assembler->input_file, operand.line, operand.as_span.length,
-                    operand.as_span.start);
-                exit(1);
-            }
-
-            double_t integer = strtod(data.as_span.start, nullptr);
-            uint8_t bytes[sizeof(double_t)];
-            memcpy(bytes, &integer, sizeof(double_t));
-
-            for (int32_t i = 0; i < (int32_t)sizeof(double_t); i++)
-                DYNARRAY_APPEND(&assembler->program, bytes[i]);
-
+            parse_data_operand(assembler, INS_DCONST, RELOC_DOUBLE, operand);
             break;
         }
 
         match_token(assembler, TOK_DOUBLE_LITERAL);
 
         double_t dbl = strtod(operand.as_span.start, nullptr);
-        uint8_t bytes[sizeof(double_t)];
+        emit_instruction(assembler,
+            instruction_make(INS_DPUSH, (PyriteValue) { .as_double = dbl }));
+    } break;
+    case INS_SCONST:
+    case INS_VCONST: {
+        advance_token(assembler);
 
-        memcpy(bytes, &dbl, sizeof(double_t));
+        Token operand = expect_operand(assembler, current);
+        if (operand.kind != TOK_IDENTIFIER) {
+            fprintf(stderr, "%s:%d: ERROR: expected a data label\n",
+                assembler->input_file, operand.line);
+            exit(1);
+        }
 
-        for (int32_t i = 0; i < (int32_t)sizeof(double_t); i++)
-            DYNARRAY_APPEND(&assembler->program, bytes[i]);
+        parse_data_operand(assembler, current.as_instruction,
+            current.as_instruction == INS_SCONST ? RELOC_STRING : RELOC_ARRAY,
+            operand);
     } break;
+    case INS_RET:
+    case INS_ARG:
+    case INS_ALLOC:
+    case INS_STORE:
+    case INS_ILOAD:
+    case INS_DLOAD:
+    case INS_PLOAD:
+    case INS_VLOAD:
+        parse_count(assembler, current);
+        break;
     default:
         break;
     }
 }
 
+// adds a space and literal to the end of text, which has to be the latest
+// allocation in the arena for it to grow in place.
+static Span append_literal(Assembler* assembler, Span text, Span literal)
+{
+    int32_t length = text.length + 1 + literal.length;
+    char* start = arena_realloc(
+        &assembler->arena, (char*)text.start, text.length + 1, length + 1);
+
+    start[text.length] = ' ';
+    memcpy(start + text.length + 1, literal.start, literal.length);
+    start[length] = '\0';
+    return span_make(start, length);
+}
+
 static void parse_readonly(Assembler* assembler)
 {
     Token name = current_token(assembler);
+    if (name.kind == TOK_INT_LITERAL || name.kind == TOK_STRING_LITERAL) {
+        fprintf(stderr, "%s:%d: ERROR: arrays can only hold double literals\n",
+            assembler->input_file, name.line);
+        exit(1);
+    }
 
-    if (name.kind == TOK_LABEL) {
-        advance_token(assembler);
-        Token data = current_token(assembler);
+    if (name.kind != TOK_LABEL) {
+        fprintf(stderr, "%s:%d: ERROR: expected a data label\n",
+            assembler->input_file, name.line);
+        exit(1);
+    }
 
-        if (data.kind != TOK_INT_LITERAL && data.kind != TOK_DOUBLE_LITERAL
-            && data.kind != TOK_STRING_LITERAL) {
-            fprintf(stderr, "%s:%d: ERROR: data labels can only holds value\n",
-                assembler->input_file, data.line);
-            exit(1);
+    int32_t index = lookup_label(assembler, name.as_span);
+    if (index != -1) {
+        Symbol symbol = assembler->symbols[index];
+        if (symbol.kind == SYMBOL_LABEL && symbol.as_label.address == -1) {
+            fprintf(stderr,
+                "%s:%d: ERROR: symbol '%.*s' is not a code label\n",
+                assembler->input_file, symbol.as_label.line,
+                name.as_span.length, name.as_span.start);
+        } else {
+            fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is already defined\n",
+                assembler->input_file, name.line, name.as_span.length,
+                name.as_span.start);
         }
+        exit(1);
+    }
 
-        int32_t index = lookup_label(assembler, name.as_span);
-        assembler->symbols[index]
-            = symbol_make_data_label(data_label_make(name.as_span, data));
+    // the name has to be in the table before advancing, which may lex the
+    // next chunk over it.
+    index = put_label(assembler, name.as_span, name.line);
+    advance_token(assembler);
+    Token data = current_token(assembler);
+
+    if (data.kind != TOK_INT_LITERAL && data.kind != TOK_DOUBLE_LITERAL
+        && data.kind != TOK_STRING_LITERAL) {
+        fprintf(stderr, "%s:%d: ERROR: data labels can only holds value\n",
+            assembler->input_file, data.line);
+        exit(1);
+    }
+
+    // a label followed by several doubles holds an array of them. the
+    // literals are copied before the next token, which may lex the next
+    // chunk over them.
+    data.as_span = copy_span(assembler, data.as_span);
+    advance_token(assembler);
+
+    while ((data.kind == TOK_DOUBLE_LITERAL || data.kind == TOK_ARRAY_LITERAL)
+        && !is_eof(assembler)
+        && current_token(assembler).kind == TOK_DOUBLE_LITERAL) {
+        data.kind = TOK_ARRAY_LITERAL;
+        data.as_span = append_literal(
+            assembler, data.as_span, current_token(assembler).as_span);
         advance_token(assembler);
     }
+
+    assembler->symbols[index] = symbol_make_data_label(data_label_make(
+        assembler->symbols[index].as_label.name, data));
 }
 
-static void parse_tokens(Assembler* assembler)
+// labels and data labels are local to their module unless it exports them
+// with "@export name", anywhere in the file.
+static void export_symbols(Assembler* assembler)
 {
-    while (assembler->cursor < (int32_t)DYNARRAY_LENGTH(assembler->tokens)) {
-        if (current_token(assembler).kind == TOK_LABEL) {
-            // this is an unknown label so it will be replaced soon by the
-            // corresponding segment.
-            put_label(
-                assembler, label_make(current_token(assembler).as_span, -1));
+    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(assembler->exports);
+        i++) {
+        Token name = assembler->exports[i];
+        int32_t index = lookup_label(assembler, name.as_span);
+        Symbol* symbol = index == -1 ? NULL : &assembler->symbols[index];
+        if (!symbol
+            || (symbol->kind == SYMBOL_LABEL
+                && symbol->as_label.address == -1)) {
+            fprintf(stderr,
+                "%s:%d: ERROR: exported symbol '%.*s' is not defined\n",
+                assembler->input_file, name.line, name.as_span.length,
+                name.as_span.start);
+            exit(1);
         }
-        advance_token(assembler);
+
+        symbol->exported = true;
     }
+}
 
-    // reset cursor.
-    assembler->cursor = 0;
+// a single pass over the tokens as they are lexed, so neither the source
+// nor its tokens are ever held in memory as a whole.
+static void parse_tokens(Assembler* assembler)
+{
     Segment current_segment = SEGMENT_UNKNOWN;
 
     while (!is_eof(assembler)) {
         Token current = current_token(assembler);
         if (current.kind == TOK_PREPROCESSOR) {
             Preprocessor prec = current.as_preprocessor;
-            current_segment = prec.as_segment;
+            if (prec.kind == PREC_IMPORT) {
+                DYNARRAY_APPEND(
+                    &assembler->imports, copy_span(assembler, prec.as_import));
+            } else if (prec.kind == PREC_EXPORT) {
+                DYNARRAY_APPEND(&assembler->exports,
+                    token_make(TOK_IDENTIFIER, current.line,
+                        copy_span(assembler, prec.as_export)));
+            } else {
+                current_segment = prec.as_segment;
+            }
+
             advance_token(assembler);
             continue;
         }
@@ -733,37 +1580,1684 @@ static void parse_tokens(Assembler* assembler)
             exit(1);
         }
     }
+
+    // labels that are still undefined are left to the linker.
+    flush_instruction(assembler);
+    export_symbols(assembler);
 }
 
-static void assembler_generate(Assembler* assembler, char const* output_file)
+static int32_t operand_size(PyriteInstruction instruction)
 {
-    parse_tokens(assembler);
+    switch (instruction) {
+    case INS_IPUSH:
+    case INS_IPUSH_IADD:
+    case INS_IPUSH_ISUB:
+    case INS_IPUSH_IMUL:
+    case INS_IPUSH_IDIV:
+        return sizeof(int64_t);
+    case INS_DPUSH:
+    case INS_DPUSH_DADD:
+    case INS_DPUSH_DSUB:
+    case INS_DPUSH_DMUL:
+    case INS_DPUSH_DDIV:
+        return sizeof(double_t);
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+    case INS_CALL:
+    case INS_RET:
+    case INS_ARG:
+    case INS_ICONST:
+    case INS_DCONST:
+    case INS_SCONST:
+    case INS_VCONST:
+    case INS_ALLOC:
+    case INS_STORE:
+    case INS_ILOAD:
+    case INS_DLOAD:
+    case INS_PLOAD:
+    case INS_VLOAD:
+        return sizeof(int32_t);
+    default:
+        return 0;
+    }
+}
 
-    FILE* stream = fopen(output_file, "wb");
-    if (!stream) {
-        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", output_file,
-            strerror(errno));
-        exit(1);
+// the size of code once encoded, padding included.
+static int32_t code_size(Instruction const* code, int32_t length)
+{
+    int32_t offset = 0;
+    for (int32_t i = 0; i < length; i++) {
+        int32_t size = operand_size(code[i].opcode);
+        offset = pyrite_operand_offset(offset, size) + size;
     }
 
-    fwrite("PYRITE", 1, 6, stream);
+    return offset;
+}
 
-    int32_t program_length = DYNARRAY_LENGTH(assembler->program);
-    fwrite(&program_length, 1, sizeof(int32_t), stream);
-    fwrite(assembler->program, 1, program_length, stream);
+// whether instruction pushes a value known while assembling: a literal, or
+// a data label of this module. data labels of other modules are only known
+// to the linker.
+static bool constant_push(Assembler* assembler, Instruction instruction,
+    PyriteValueType* type, PyriteValue* value)
+{
+    switch (instruction.opcode) {
+    case INS_IPUSH:
+        *type = PR_INT;
+        *value = instruction.operand;
+        return true;
+    case INS_DPUSH:
+        *type = PR_DOUBLE;
+        *value = instruction.operand;
+        return true;
+    case INS_ICONST:
+    case INS_DCONST:
+    case INS_SCONST:
+    case INS_VCONST:
+        break;
+    default:
+        return false;
+    }
 
-    printf("program length: %d bytes\n", program_length);
+    Relocation use = assembler->unresolved[instruction.operand.as_int];
+    int32_t index = lookup_label(assembler, use.name);
+    if (index == -1 || assembler->symbols[index].kind != SYMBOL_DATA_LABEL)
+        return false;
 
-    fclose(stream);
+    Token data = assembler->symbols[index].as_data_label.data;
+    if (instruction.opcode == INS_ICONST && data.kind == TOK_INT_LITERAL) {
+        *type = PR_INT;
+        value->as_int = strtoll(data.as_span.start, nullptr, 10);
+        return true;
+    }
+
+    if (instruction.opcode == INS_DCONST && data.kind == TOK_DOUBLE_LITERAL) {
+        *type = PR_DOUBLE;
+        value->as_double = strtod(data.as_span.start, nullptr);
+        return true;
+    }
+
+    // strings and arrays are never folded, but they can still be dropped.
+    if (instruction.opcode == INS_VCONST) {
+        *type = PR_ARRAY;
+        return data.kind == TOK_DOUBLE_LITERAL
+            || data.kind == TOK_ARRAY_LITERAL;
+    }
+
+    *type = PR_STRING;
+    return instruction.opcode == INS_SCONST
+        && data.kind == TOK_STRING_LITERAL;
 }
 
-int main()
+// the plain arithmetic instruction behind a superinstruction.
+static PyriteInstruction arithmetic_of(PyriteInstruction opcode)
 {
-    char const* input = "input.pyasm";
-    char const* output = "output.pyrite";
+    for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+        if (fusions[i].fused != opcode)
+            continue;
 
-    Assembler assembler;
-    assembler_init(&assembler, input);
-    assembler_generate(&assembler, output);
+        return fusions[i].first == INS_IPUSH || fusions[i].first == INS_DPUSH
+            ? fusions[i].second
+            : fusions[i].first;
+    }
+
+    return opcode;
+}
+
+// lhs <op> rhs exactly as the vm computes it. ints wrap, and since boxed
+// ints keep only their low 48 bits, which the low bits of a sum, difference
+// or product do not depend on, only division needs operands that fit. false
+// when the operation has to be left to run time, where a division by zero
+// or of INT64_MIN by -1 traps.
+static bool fold_arithmetic(PyriteInstruction opcode, PyriteValueType type,
+    PyriteValue lhs, PyriteValue rhs, PyriteValue* result)
+{
+    bool is_double = opcode == INS_DADD || opcode == INS_DSUB
+        || opcode == INS_DMUL || opcode == INS_DDIV;
+    if (type != (is_double ? PR_DOUBLE : PR_INT))
+        return false;
+
+    uint64_t a = lhs.as_int;
+    uint64_t b = rhs.as_int;
+    int64_t boxed = INT64_C(1) << 47;
+
+    switch (opcode) {
+    case INS_IADD:
+        result->as_int = (int64_t)(a + b);
+        return true;
+    case INS_ISUB:
+        result->as_int = (int64_t)(a - b);
+        return true;
+    case INS_IMUL:
+        result->as_int = (int64_t)(a * b);
+        return true;
+    case INS_IDIV:
+        if (rhs.as_int == 0 || lhs.as_int < -boxed || lhs.as_int >= boxed
+            || rhs.as_int < -boxed || rhs.as_int >= boxed)
+            return false;
+        result->as_int = lhs.as_int / rhs.as_int;
+        return true;
+    case INS_DADD:
+        result->as_double = lhs.as_double + rhs.as_double;
+        return true;
+    case INS_DSUB:
+        result->as_double = lhs.as_double - rhs.as_double;
+        return true;
+    case INS_DMUL:
+        result->as_double = lhs.as_double * rhs.as_double;
+        return true;
+    case INS_DDIV:
+        result->as_double = lhs.as_double / rhs.as_double;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_arithmetic(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
+    case INS_DADD:
+    case INS_DSUB:
+    case INS_DMUL:
+    case INS_DDIV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_push_arithmetic(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_IPUSH_IADD:
+    case INS_IPUSH_ISUB:
+    case INS_IPUSH_IMUL:
+    case INS_IPUSH_IDIV:
+    case INS_DPUSH_DADD:
+    case INS_DPUSH_DSUB:
+    case INS_DPUSH_DMUL:
+    case INS_DPUSH_DDIV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// appends instruction to the optimized code and folds it into the constant
+// pushes right before it, as long as they come at or after barrier, the
+// position of the last label.
+static void append_optimized(Assembler* assembler, Instruction* code,
+    int32_t* length, int32_t barrier, Instruction instruction)
+{
+    PyriteInstruction opcode = instruction.opcode;
+    PyriteInstruction arithmetic = arithmetic_of(opcode);
+
+    PyriteValueType lhs_type = PR_PTR;
+    PyriteValueType rhs_type = PR_PTR;
+    PyriteValue lhs;
+    PyriteValue rhs;
+
+    // the constant pushes the instruction would consume.
+    int32_t operands = opcode == INS_POP || is_push_arithmetic(opcode) ? 1 : 2;
+    bool constant = (opcode == INS_POP || is_arithmetic(arithmetic))
+        && *length - operands >= barrier
+        && constant_push(
+            assembler, code[*length - 1], &rhs_type, &rhs)
+        && (operands == 1
+            || constant_push(
+                assembler, code[*length - 2], &lhs_type, &lhs));
+
+    if (constant && opcode == INS_POP) {
+        *length -= 1;
+        return;
+    }
+
+    if (constant && is_push_arithmetic(opcode)) {
+        lhs_type = rhs_type;
+        lhs = rhs;
+        rhs_type = opcode == INS_IPUSH_IADD || opcode == INS_IPUSH_ISUB
+                || opcode == INS_IPUSH_IMUL || opcode == INS_IPUSH_IDIV
+            ? PR_INT
+            : PR_DOUBLE;
+        rhs = instruction.operand;
+    }
+
+    PyriteValue result;
+    if (constant && lhs_type == rhs_type
+        && fold_arithmetic(arithmetic, lhs_type, lhs, rhs, &result)) {
+        *length -= operands;
+        append_optimized(assembler, code, length, barrier,
+            instruction_make(
+                lhs_type == PR_INT ? INS_IPUSH : INS_DPUSH, result));
+
+        // the print forms still print the result.
+        if (arithmetic != opcode && !is_push_arithmetic(opcode))
+            append_optimized(assembler, code, length, barrier,
+                instruction_make(INS_PRINT, (PyriteValue) { .as_int = 0 }));
+        return;
+    }
+
+    // a folded constant may fuse with the instruction after it.
+    if (*length > barrier) {
+        Instruction* previous = &code[*length - 1];
+        for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+            if (fusions[i].first == previous->opcode
+                && fusions[i].second == opcode) {
+                previous->opcode = fusions[i].fused;
+                return;
+            }
+        }
+    }
+
+    code[(*length)++] = instruction;
+}
+
+static bool ends_block(PyriteInstruction opcode)
+{
+    return opcode == INS_HALT || opcode == INS_JMP || opcode == INS_RET;
+}
+
+// -O1 folds arithmetic on constants and drops constants that are popped
+// right away, -O2 also drops code no jump can reach, which is anything
+// after a halt, jmp or ret up to the next label. nothing is moved across a
+// label, which may be jumped to from anywhere in the module, or from others
+// when it is exported. returns the bytes saved.
+static int32_t optimize(Assembler* assembler, int32_t level)
+{
+    if (level <= 0)
+        return 0;
+
+    Instruction* code = assembler->code;
+    int32_t length = DYNARRAY_LENGTH(code);
+    int32_t before = code_size(code, length);
+
+    // labels sit before the instruction at their index, moved maps every
+    // index to where it ends up. code is rewritten in place, it never grows
+    // faster than it is read.
+    bool* labelled = calloc(length + 1, sizeof(bool));
+    int32_t* moved = malloc(sizeof(int32_t) * (length + 1));
+    if (!labelled || !moved) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int32_t symbol_count = DYNARRAY_LENGTH(assembler->symbols);
+    for (int32_t i = 0; i < symbol_count; i++) {
+        Symbol* symbol = &assembler->symbols[i];
+        if (symbol->kind == SYMBOL_LABEL && symbol->as_label.address != -1)
+            labelled[symbol->as_label.address] = true;
+    }
+
+    int32_t optimized = 0;
+    int32_t barrier = 0;
+    bool reachable = true;
+    for (int32_t i = 0; i < length; i++) {
+        if (labelled[i]) {
+            barrier = optimized;
+            reachable = true;
+        }
+
+        moved[i] = optimized;
+
+        Instruction instruction = code[i];
+        if (!reachable)
+            continue;
+
+        reachable = level < 2 || !ends_block(instruction.opcode);
+        append_optimized(assembler, code, &optimized, barrier, instruction);
+    }
+    moved[length] = optimized;
+
+    for (int32_t i = 0; i < symbol_count; i++) {
+        Label* label = &assembler->symbols[i].as_label;
+        if (assembler->symbols[i].kind == SYMBOL_LABEL && label->address != -1)
+            label->address = moved[label->address];
+    }
+
+    DYNARRAY_TRUNCATE(assembler->code, optimized);
+    free(moved);
+    free(labelled);
+
+    return before - code_size(code, optimized);
+}
+
+// encodes the code, jump targets become byte offsets from the start of the
+// module and code labels are moved to byte offsets too. operands that are
+// still unresolved are left to the linker as relocations.
+static void encode_module(Assembler* assembler, Module* module)
+{
+    int32_t length = DYNARRAY_LENGTH(assembler->code);
+
+    // byte offset of every instruction, plus one past the end for labels
+    // that close the program.
+    int32_t* offsets = malloc(sizeof(int32_t) * (length + 1));
+    if (!offsets) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    offsets[0] = 0;
+    for (int32_t i = 0; i < length; i++) {
+        int32_t size = operand_size(assembler->code[i].opcode);
+        offsets[i + 1] = pyrite_operand_offset(offsets[i], size) + size;
+    }
+
+    DYNARRAY_RESERVE(&assembler->program, offsets[length]);
+
+    for (int32_t i = 0; i < length; i++) {
+        Instruction instruction = assembler->code[i];
+        int32_t operand = pyrite_operand_offset(
+            offsets[i], operand_size(instruction.opcode));
+
+        if (instruction.unresolved) {
+            Relocation relocation
+                = assembler->unresolved[instruction.operand.as_int];
+            relocation.offset = operand;
+            DYNARRAY_APPEND(&assembler->relocations, relocation);
+            instruction.operand.as_int = 0;
+        } else if (is_jump_instruction(instruction.opcode)) {
+            int32_t index = instruction.operand.as_int;
+            Label label = assembler->symbols[index].as_label;
+            if (label.address == -1) {
+                Relocation relocation = { .kind = RELOC_JUMP,
+                    .offset = operand,
+                    .line = label.line,
+                    .name = label.name };
+                DYNARRAY_APPEND(&assembler->relocations, relocation);
+                instruction.operand.as_int = 0;
+            } else {
+                instruction.operand.as_int = offsets[label.address];
+            }
+        }
+
+        uint8_t bytes[2 * sizeof(PyriteValue)];
+        int32_t size = encode_instruction(
+            bytes, offsets[i], instruction.opcode, instruction.operand);
+
+        for (int32_t j = 0; j < size; j++)
+            DYNARRAY_APPEND(&assembler->program, bytes[j]);
+    }
+
+    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(assembler->symbols); i++) {
+        Label* label = &assembler->symbols[i].as_label;
+        if (assembler->symbols[i].kind == SYMBOL_LABEL && label->address != -1)
+            label->address = offsets[label->address];
+    }
+
+    free(offsets);
+
+    module->code = assembler->program;
+    module->code_length = DYNARRAY_LENGTH(assembler->program);
+    module->symbols = assembler->symbols;
+    module->symbol_count = DYNARRAY_LENGTH(assembler->symbols);
+    module->relocations = assembler->relocations;
+    module->relocation_count = DYNARRAY_LENGTH(assembler->relocations);
+    module->imports = assembler->imports;
+    module->import_count = DYNARRAY_LENGTH(assembler->imports);
+}
+
+// fnv-1a over the whole file. returns false when it cannot be read.
+static bool hash_file(char const* path, uint64_t* hash, long* size)
+{
+    FILE* stream = fopen(path, "rb");
+    if (!stream)
+        return false;
+
+    *hash = UINT64_C(14695981039346656037);
+    *size = 0;
+
+    uint8_t buffer[64 * 1024];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), stream)) > 0) {
+        for (size_t i = 0; i < read; i++) {
+            *hash ^= buffer[i];
+            *hash *= UINT64_C(1099511628211);
+        }
+        *size += read;
+    }
+
+    fclose(stream);
+    return true;
+}
+
+// object files are "PYOBJ", a version, the hash of the source they were
+// assembled from, the -O level and the bytes it saved, then the imports,
+// code, symbols and relocations. strings are a length, the bytes and a null
+// byte.
+#define OBJECT_VERSION 5
+
+static void write_int32(FILE* stream, int32_t value)
+{
+    fwrite(&value, sizeof(int32_t), 1, stream);
+}
+
+static void write_span(FILE* stream, Span span)
+{
+    write_int32(stream, span.length);
+    fwrite(span.start, 1, span.length, stream);
+    fputc('\0', stream);
+}
+
+// "foo.pyasm" is cached in "foo.pyo".
+static char* object_path(char const* path)
+{
+    size_t length = strlen(path);
+    if (length > 6 && strcmp(path + length - 6, ".pyasm") == 0)
+        length -= 6;
+
+    char* object = malloc(length + sizeof(".pyo"));
+    if (!object) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(object, path, length);
+    strcpy(object + length, ".pyo");
+    return object;
+}
+
+static void write_object(Module* module)
+{
+    char* path = object_path(module->path);
+
+    // written aside and renamed over, so a reader never sees half a file.
+    char* temporary = malloc(strlen(path) + sizeof(".tmp"));
+    if (!temporary) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(temporary, "%s.tmp", path);
+
+    FILE* stream = fopen(temporary, "wb");
+    if (!stream) {
+        fprintf(stderr, "WARNING: cannot write '%s': %s\n", temporary,
+            strerror(errno));
+        free(temporary);
+        free(path);
+        return;
+    }
+
+    fwrite("PYOBJ", 1, 5, stream);
+    write_int32(stream, OBJECT_VERSION);
+    fwrite(&module->hash, sizeof(uint64_t), 1, stream);
+    write_int32(stream, module->optimization);
+    write_int32(stream, module->saved);
+
+    write_int32(stream, module->import_count);
+    for (int32_t i = 0; i < module->import_count; i++)
+        write_span(stream, module->imports[i]);
+
+    write_int32(stream, module->code_length);
+    fwrite(module->code, 1, module->code_length, stream);
+
+    write_int32(stream, module->symbol_count);
+    for (int32_t i = 0; i < module->symbol_count; i++) {
+        Symbol symbol = module->symbols[i];
+        write_span(stream, symbol_name(&symbol));
+        fputc(symbol.kind, stream);
+        fputc(symbol.exported, stream);
+
+        if (symbol.kind == SYMBOL_LABEL) {
+            write_int32(stream, symbol.as_label.address);
+        } else {
+            fputc(symbol.as_data_label.data.kind, stream);
+            write_span(stream, symbol.as_data_label.data.as_span);
+        }
+    }
+
+    write_int32(stream, module->relocation_count);
+    for (int32_t i = 0; i < module->relocation_count; i++) {
+        Relocation relocation = module->relocations[i];
+        fputc(relocation.kind, stream);
+        write_int32(stream, relocation.offset);
+        write_int32(stream, relocation.line);
+        write_span(stream, relocation.name);
+    }
+
+    if (fclose(stream) != 0 || rename(temporary, path) != 0) {
+        fprintf(stderr, "WARNING: cannot write '%s': %s\n", path,
+            strerror(errno));
+        remove(temporary);
+    }
+
+    free(temporary);
+    free(path);
+}
+
+typedef struct {
+    uint8_t const* data;
+    size_t length;
+    size_t cursor;
+    bool failed; // set on the first read past the end.
+} ObjectReader;
+
+static void read_bytes(ObjectReader* reader, void* bytes, size_t size)
+{
+    if (reader->failed || reader->length - reader->cursor < size) {
+        reader->failed = true;
+        memset(bytes, 0, size);
+        return;
+    }
+
+    memcpy(bytes, reader->data + reader->cursor, size);
+    reader->cursor += size;
+}
+
+static int32_t read_int32(ObjectReader* reader)
+{
+    int32_t value;
+    read_bytes(reader, &value, sizeof(int32_t));
+    return value;
+}
+
+static uint8_t read_uint8(ObjectReader* reader)
+{
+    uint8_t value;
+    read_bytes(reader, &value, sizeof(uint8_t));
+    return value;
+}
+
+// spans point into the object, which stays loaded with the module.
+static Span read_span(ObjectReader* reader)
+{
+    int32_t length = read_int32(reader);
+    if (reader->failed || length < 0
+        || reader->length - reader->cursor < (size_t)length + 1
+        || reader->data[reader->cursor + length] != '\0') {
+        reader->failed = true;
+        return span_make("", 0);
+    }
+
+    Span span
+        = span_make((char const*)reader->data + reader->cursor, length);
+    reader->cursor += length + 1;
+    return span;
+}
+
+// an array of count elements of size bytes in the module's arena, false when
+// count cannot be right for what is left of the object.
+static void* read_array(
+    ObjectReader* reader, Module* module, int32_t count, size_t size)
+{
+    if (reader->failed || count < 0
+        || (size_t)count > reader->length - reader->cursor) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    return arena_alloc(&module->arena, size * count + 1);
+}
+
+// loads the module from its object file when that was assembled from a
+// source with the given hash. anything unexpected just means a rebuild.
+static bool read_object(Module* module, uint64_t hash)
+{
+    char* path = object_path(module->path);
+    FILE* stream = fopen(path, "rb");
+    free(path);
+    if (!stream)
+        return false;
+
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+
+    uint8_t* data = arena_alloc(&module->arena, size > 0 ? size : 1);
+    bool read = size > 0 && fread(data, 1, size, stream) == (size_t)size;
+    fclose(stream);
+    if (!read)
+        return false;
+
+    ObjectReader reader = { .data = data, .length = size };
+
+    char magic[5];
+    read_bytes(&reader, magic, sizeof(magic));
+    int32_t version = read_int32(&reader);
+    uint64_t object_hash;
+    read_bytes(&reader, &object_hash, sizeof(uint64_t));
+    int32_t optimization = read_int32(&reader);
+    module->saved = read_int32(&reader);
+
+    if (reader.failed || memcmp(magic, "PYOBJ", 5) != 0
+        || version != OBJECT_VERSION || object_hash != hash
+        || optimization != module->optimization)
+        return false;
+
+    module->import_count = read_int32(&reader);
+    module->imports
+        = read_array(&reader, module, module->import_count, sizeof(Span));
+    for (int32_t i = 0; !reader.failed && i < module->import_count; i++)
+        module->imports[i] = read_span(&reader);
+
+    module->code_length = read_int32(&reader);
+    module->code = read_array(&reader, module, module->code_length, 1);
+    if (module->code)
+        read_bytes(&reader, module->code, module->code_length);
+
+    module->symbol_count = read_int32(&reader);
+    module->symbols
+        = read_array(&reader, module, module->symbol_count, sizeof(Symbol));
+    for (int32_t i = 0; !reader.failed && i < module->symbol_count; i++) {
+        Span name = read_span(&reader);
+        SymbolKind kind = read_uint8(&reader);
+        bool exported = read_uint8(&reader);
+
+        if (kind == SYMBOL_LABEL) {
+            module->symbols[i] = symbol_make_label(
+                label_make(name, read_int32(&reader), 0));
+        } else {
+            Token data = { .kind = read_uint8(&reader) };
+            data.as_span = read_span(&reader);
+            module->symbols[i]
+                = symbol_make_data_label(data_label_make(name, data));
+        }
+        module->symbols[i].exported = exported;
+    }
+
+    module->relocation_count = read_int32(&reader);
+    module->relocations = read_array(
+        &reader, module, module->relocation_count, sizeof(Relocation));
+    for (int32_t i = 0; !reader.failed && i < module->relocation_count; i++) {
+        Relocation* relocation = &module->relocations[i];
+        relocation->kind = read_uint8(&reader);
+        relocation->offset = read_int32(&reader);
+        relocation->line = read_int32(&reader);
+        relocation->name = read_span(&reader);
+    }
+
+    module->hash = hash;
+    return !reader.failed && reader.cursor == reader.length;
+}
+
+static void assemble_module(Module* module)
+{
+    Assembler assembler;
+    assembler_init(&assembler, module->path);
+    parse_tokens(&assembler);
+    module->saved = optimize(&assembler, module->optimization);
+    encode_module(&assembler, module);
+
+    // the module keeps the arena its code, symbols and imports live in.
+    arena_free(&module->arena);
+    module->arena = assembler.arena;
+    arena_init(&assembler.arena);
+    assembler_free(&assembler);
+}
+
+static void load_module(Module* module)
+{
+    uint64_t hash;
+    long size;
+    if (!hash_file(module->path, &hash, &size)) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", module->path,
+            strerror(errno));
+        exit(1);
+    }
+
+    // an empty module contributes nothing.
+    if (size == 0)
+        return;
+
+    if (read_object(module, hash)) {
+        module->cached = true;
+        return;
+    }
+
+    module->import_count = 0;
+    module->code_length = 0;
+    module->symbol_count = 0;
+    module->relocation_count = 0;
+
+    assemble_module(module);
+    module->hash = hash;
+    write_object(module);
+}
+
+// every module reachable from the main program, each loaded once however
+// many modules import it.
+typedef struct {
+    Module** modules; // the main program comes first.
+    int32_t next; // first module no worker has picked up yet.
+    int32_t busy; // workers in the middle of loading a module.
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ModuleSet;
+
+static Module* module_make(
+    char* path, struct stat const* info, int32_t optimization)
+{
+    Module* module = calloc(1, sizeof(*module));
+    if (!module) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    module->path = path;
+    module->device = info->st_dev;
+    module->inode = info->st_ino;
+    module->optimization = optimization;
+    arena_init(&module->arena);
+    return module;
+}
+
+// imports are relative to the directory of the module naming them.
+static char* import_path(Module const* module, Span import)
+{
+    char const* slash = strrchr(module->path, '/');
+    int32_t directory = import.length > 0 && import.start[0] == '/'
+        ? 0
+        : (slash ? slash - module->path + 1 : 0);
+
+    char* path = malloc(directory + import.length + 1);
+    if (!path) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(path, module->path, directory);
+    memcpy(path + directory, import.start, import.length);
+    path[directory + import.length] = '\0';
+    return path;
+}
+
+// adds the modules imported by module that are not in the set yet. called
+// with the lock held.
+static void add_imports(ModuleSet* set, Module* module)
+{
+    module->dependencies = arena_alloc(
+        &module->arena, sizeof(int32_t) * (module->import_count + 1));
+
+    for (int32_t i = 0; i < module->import_count; i++) {
+        char* path = import_path(module, module->imports[i]);
+
+        struct stat info;
+        if (stat(path, &info) != 0) {
+            fprintf(stderr, "%s: ERROR: cannot import '%s': %s\n",
+                module->path, path, strerror(errno));
+            exit(1);
+        }
+
+        int32_t count = DYNARRAY_LENGTH(set->modules);
+        int32_t index = 0;
+        while (index < count
+            && (set->modules[index]->device != info.st_dev
+                || set->modules[index]->inode != info.st_ino))
+            index += 1;
+
+        if (index == count) {
+            DYNARRAY_APPEND(&set->modules,
+                module_make(path, &info, module->optimization));
+        } else {
+            free(path);
+        }
+
+        module->dependencies[i] = index;
+    }
+}
+
+static void* run_module_worker(void* argument)
+{
+    ModuleSet* set = argument;
+
+    pthread_mutex_lock(&set->lock);
+    for (;;) {
+        if (set->next < (int32_t)DYNARRAY_LENGTH(set->modules)) {
+            Module* module = set->modules[set->next++];
+            set->busy += 1;
+            pthread_mutex_unlock(&set->lock);
+
+            load_module(module);
+
+            pthread_mutex_lock(&set->lock);
+            add_imports(set, module);
+            set->busy -= 1;
+            pthread_cond_broadcast(&set->changed);
+        } else if (set->busy == 0) {
+            break;
+        } else {
+            pthread_cond_wait(&set->changed, &set->lock);
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    return NULL;
+}
+
+// loads everything the main program imports, directly or not. modules do
+// not depend on each other's contents until linking, so they are assembled
+// in parallel, as soon as some module names them.
+static void load_imports(ModuleSet* set)
+{
+    set->next = 1;
+    set->busy = 0;
+    add_imports(set, set->modules[0]);
+
+    if (DYNARRAY_LENGTH(set->modules) == 1)
+        return;
+
+    int32_t thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count < 1)
+        thread_count = 1;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * thread_count);
+    if (!threads) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->changed, NULL);
+
+    for (int32_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, run_module_worker, set) != 0) {
+            fprintf(stderr, "ERROR: cannot start assembler thread\n");
+            exit(1);
+        }
+    }
+
+    for (int32_t i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&set->changed);
+    pthread_mutex_destroy(&set->lock);
+    free(threads);
+}
+
+// modules are laid out depth first in import order from the main program,
+// which does not depend on the order they happened to be loaded in.
+static void layout_module(
+    ModuleSet* set, int32_t index, bool* placed, int32_t* order, int32_t* count)
+{
+    if (placed[index])
+        return;
+
+    placed[index] = true;
+    order[(*count)++] = index;
+
+    Module* module = set->modules[index];
+    for (int32_t i = 0; i < module->import_count; i++)
+        layout_module(set, module->dependencies[i], placed, order, count);
+}
+
+// the program's constant pool, one entry per distinct value. strings and
+// arrays are told apart by their contents, so every use of the same text
+// or the same doubles shares one copy.
+typedef struct {
+    PyriteValue* values; // strings and arrays hold their byte offset.
+    uint8_t* types;
+    char* strings;
+    PyriteValue* arrays; // each is its length and then its elements.
+
+    int32_t* slots; // open addressing over entries, -1 marks an empty slot.
+    int32_t cap;
+} ConstantPool;
+
+static Span constant_key(ConstantPool const* pool, int32_t index)
+{
+    if (pool->types[index] == PR_ARRAY) {
+        PyriteValue const* array
+            = pool->arrays + pool->values[index].as_int / sizeof(PyriteValue);
+        return span_make(
+            (char const*)(array + 1), array->as_int * sizeof(PyriteValue));
+    }
+
+    if (pool->types[index] != PR_STRING)
+        return span_make(
+            (char const*)&pool->values[index], sizeof(PyriteValue));
+
+    char const* string = pool->strings + pool->values[index].as_int;
+    return span_make(string, strlen(string));
+}
+
+static int32_t constant_pool_slot(
+    ConstantPool const* pool, uint8_t type, Span key)
+{
+    uint32_t mask = pool->cap - 1;
+
+    for (uint32_t slot = (span_hash(key) ^ type) & mask;;
+        slot = (slot + 1) & mask) {
+        int32_t index = pool->slots[slot];
+        if (index == -1
+            || (pool->types[index] == type
+                && span_equal(key, constant_key(pool, index))))
+            return slot;
+    }
+}
+
+static void constant_pool_resize(ConstantPool* pool, int32_t cap)
+{
+    free(pool->slots);
+
+    pool->cap = cap;
+    pool->slots = malloc(sizeof(int32_t) * cap);
+    if (!pool->slots) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t slot = 0; slot < cap; slot++)
+        pool->slots[slot] = -1;
+
+    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(pool->values); i++) {
+        Span key = constant_key(pool, i);
+        pool->slots[constant_pool_slot(pool, pool->types[i], key)] = i;
+    }
+}
+
+static void constant_pool_init(ConstantPool* pool)
+{
+    pool->values = DYNARRAY_MAKE(PyriteValue);
+    pool->types = DYNARRAY_MAKE(uint8_t);
+    pool->strings = DYNARRAY_MAKE(char);
+    pool->arrays = DYNARRAY_MAKE(PyriteValue);
+    pool->slots = NULL;
+    constant_pool_resize(pool, 64);
+}
+
+static void constant_pool_free(ConstantPool* pool)
+{
+    DYNARRAY_FREE(pool->values);
+    DYNARRAY_FREE(pool->types);
+    DYNARRAY_FREE(pool->strings);
+    DYNARRAY_FREE(pool->arrays);
+    free(pool->slots);
+}
+
+// the index of the entry holding value, or bytes for PR_STRING and
+// PR_ARRAY, added when the pool has no such entry yet. the bytes of an
+// array are its packed elements.
+static int32_t intern_constant(
+    ConstantPool* pool, uint8_t type, PyriteValue value, Span bytes)
+{
+    Span key = type == PR_STRING || type == PR_ARRAY
+        ? bytes
+        : span_make((char const*)&value, sizeof(PyriteValue));
+
+    int32_t slot = constant_pool_slot(pool, type, key);
+    if (pool->slots[slot] != -1)
+        return pool->slots[slot];
+
+    if (type == PR_STRING) {
+        value.as_int = DYNARRAY_LENGTH(pool->strings);
+        for (int32_t i = 0; i < bytes.length; i++)
+            DYNARRAY_APPEND(&pool->strings, bytes.start[i]);
+        DYNARRAY_APPEND(&pool->strings, '\0');
+    } else if (type == PR_ARRAY) {
+        int32_t length = bytes.length / sizeof(PyriteValue);
+        value.as_int = DYNARRAY_LENGTH(pool->arrays) * sizeof(PyriteValue);
+        DYNARRAY_APPEND(&pool->arrays, (PyriteValue) { .as_int = length });
+        for (int32_t i = 0; i < length; i++) {
+            PyriteValue element;
+            memcpy(&element, bytes.start + i * sizeof(PyriteValue),
+                sizeof(PyriteValue));
+            DYNARRAY_APPEND(&pool->arrays, element);
+        }
+    }
+
+    int32_t index = DYNARRAY_LENGTH(pool->values);
+    pool->slots[slot] = index;
+    DYNARRAY_APPEND(&pool->values, value);
+    DYNARRAY_APPEND(&pool->types, type);
+
+    // keep the table at most half full so probe runs stay short.
+    if ((index + 1) * 2 > pool->cap)
+        constant_pool_resize(pool, pool->cap * 2);
+
+    return index;
+}
+
+// laid out the way the vm maps it: "POOL", the entry count, the values,
+// their types, the arrays and the strings. the pool starts 8 byte aligned
+// in the file, the arrays are padded to stay that way and the offsets of
+// both kinds of literals are moved past whatever comes before them.
+// returns the size of the pool.
+static int64_t write_constant_pool(ConstantPool const* pool, FILE* stream)
+{
+    int32_t count = DYNARRAY_LENGTH(pool->values);
+    int64_t literals = 4 + sizeof(int32_t) + count * (sizeof(PyriteValue) + 1);
+    int64_t arrays_size = DYNARRAY_LENGTH(pool->arrays) * sizeof(PyriteValue);
+    int64_t padding = arrays_size == 0
+        ? 0
+        : (PYRITE_ALIGNMENT - literals % PYRITE_ALIGNMENT) % PYRITE_ALIGNMENT;
+
+    fwrite("POOL", 1, 4, stream);
+    fwrite(&count, sizeof(int32_t), 1, stream);
+
+    for (int32_t i = 0; i < count; i++) {
+        PyriteValue value = pool->values[i];
+        if (pool->types[i] == PR_ARRAY)
+            value.as_int += padding;
+        else if (pool->types[i] == PR_STRING)
+            value.as_int += padding + arrays_size;
+
+        fwrite(&value, sizeof(PyriteValue), 1, stream);
+    }
+
+    fwrite(pool->types, 1, count, stream);
+    for (int64_t i = 0; i < padding; i++)
+        fputc(0, stream);
+    fwrite(pool->arrays, 1, arrays_size, stream);
+    fwrite(pool->strings, 1, DYNARRAY_LENGTH(pool->strings), stream);
+
+    return literals + padding + arrays_size + DYNARRAY_LENGTH(pool->strings);
+}
+
+// every symbol of every module, code labels at their final address, and the
+// constant pool the data labels that are used end up in. a module sees its
+// own symbols first and then those any module exports, so two modules can
+// each have a label of the same name as long as at most one exports it.
+typedef struct {
+    SymbolTable table; // the exported symbols.
+    SymbolTable* locals; // each module's own, in layout order.
+    int32_t module_count;
+    Symbol* symbols;
+    char const** files; // the module each symbol comes from.
+    ConstantPool pool;
+
+    // the pool entry of each symbol used as an array, -1 until then, so a
+    // large array is parsed once rather than once per vpush.
+    int32_t* arrays;
+} Linker;
+
+static void link_symbols(
+    Linker* linker, Module* module, SymbolTable* locals, int32_t base)
+{
+    symbol_table_init(locals, linker->symbols);
+
+    for (int32_t i = 0; i < module->symbol_count; i++) {
+        Symbol symbol = module->symbols[i];
+        if (symbol.kind == SYMBOL_LABEL && symbol.as_label.address == -1)
+            continue;
+
+        if (symbol.kind == SYMBOL_LABEL)
+            symbol.as_label.address += base;
+
+        Span name = symbol_name(&symbol);
+        int32_t index = symbol_table_put(locals, &linker->symbols,
+            symbol_table_slot(locals, linker->symbols, name), symbol);
+        DYNARRAY_APPEND(&linker->files, module->path);
+        DYNARRAY_APPEND(&linker->arrays, -1);
+
+        if (!symbol.exported)
+            continue;
+
+        int32_t slot = symbol_table_slot(&linker->table, linker->symbols, name);
+        if (linker->table.slots[slot] != -1) {
+            fprintf(stderr,
+                "%s: ERROR: symbol '%.*s' is also exported by '%s'\n",
+                module->path, name.length, name.start,
+                linker->files[linker->table.slots[slot]]);
+            exit(1);
+        }
+
+        symbol_table_file(&linker->table, linker->symbols, slot, index);
+    }
+}
+
+// the pool entry for a data label used as the operand of ipush (RELOC_INT),
+// dpush (RELOC_DOUBLE), spush (RELOC_STRING) or vpush (RELOC_ARRAY). a
+// label holding a single double is an array of one for vpush.
+static int32_t intern_data(
+    Linker* linker, char const* file, Relocation use, int32_t index)
+{
+    Symbol const* symbol = &linker->symbols[index];
+    if (symbol->kind != SYMBOL_DATA_LABEL) {
+        fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is not a data label\n",
+            file, use.line, use.name.length, use.name.start);
+        exit(1);
+    }
+
+    Token data = symbol->as_data_label.data;
+    if (use.kind == RELOC_INT) {
+        if (data.kind != TOK_INT_LITERAL) {
+            fprintf(stderr,
+                "%s:%d: ERROR: symbol '%.*s' is not an integer literal\n",
+                file, use.line, use.name.length, use.name.start);
+            exit(1);
+        }
+
+        PyriteValue value
+            = { .as_int = strtoll(data.as_span.start, nullptr, 10) };
+        return intern_constant(&linker->pool, PR_INT, value, data.as_span);
+    }
+
+    if (use.kind == RELOC_STRING) {
+        if (data.kind != TOK_STRING_LITERAL) {
+            fprintf(stderr,
+                "%s:%d: ERROR: symbol '%.*s' is not a string literal\n",
+                file, use.line, use.name.length, use.name.start);
+            exit(1);
+        }
+
+        PyriteValue value = { .as_int = 0 };
+        return intern_constant(&linker->pool, PR_STRING, value, data.as_span);
+    }
+
+    if (use.kind == RELOC_ARRAY && linker->arrays[index] != -1)
+        return linker->arrays[index];
+
+    if (use.kind == RELOC_ARRAY) {
+        if (data.kind != TOK_ARRAY_LITERAL && data.kind != TOK_DOUBLE_LITERAL) {
+            fprintf(stderr,
+                "%s:%d: ERROR: symbol '%.*s' is not an array of doubles\n",
+                file, use.line, use.name.length, use.name.start);
+            exit(1);
+        }
+
+        double_t* elements = DYNARRAY_MAKE(double_t);
+        for (char const* cursor = data.as_span.start;
+            cursor < data.as_span.start + data.as_span.length;) {
+            char* end;
+            double_t element = strtod(cursor, &end);
+            if (end == cursor)
+                break;
+
+            DYNARRAY_APPEND(&elements, element);
+            cursor = end;
+        }
+
+        PyriteValue value = { .as_int = 0 };
+        linker->arrays[index] = intern_constant(&linker->pool, PR_ARRAY, value,
+            span_make((char const*)elements,
+                DYNARRAY_LENGTH(elements) * sizeof(double_t)));
+        DYNARRAY_FREE(elements);
+        return linker->arrays[index];
+    }
+
+    if (data.kind != TOK_DOUBLE_LITERAL) {
+        fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is not a double literal\n",
+            file, use.line, use.name.length, use.name.start);
+        exit(1);
+    }
+
+    PyriteValue value = { .as_double = strtod(data.as_span.start, nullptr) };
+    return intern_constant(&linker->pool, PR_DOUBLE, value, data.as_span);
+}
+
+// the operand a relocation resolves to: a code address for jumps, a constant
+// pool index for everything else.
+static int32_t resolve_relocation(Linker* linker, SymbolTable const* locals,
+    char const* file, Relocation relocation)
+{
+    Span name = relocation.name;
+    int32_t index
+        = locals->slots[symbol_table_slot(locals, linker->symbols, name)];
+    if (index == -1)
+        index = linker->table.slots[symbol_table_slot(
+            &linker->table, linker->symbols, name)];
+
+    if (index == -1) {
+        // point at a module that has it but keeps it to itself.
+        for (int32_t i = 0; i < linker->module_count; i++) {
+            SymbolTable const* other = &linker->locals[i];
+            int32_t hidden
+                = other->slots[symbol_table_slot(other, linker->symbols, name)];
+            if (hidden == -1)
+                continue;
+
+            fprintf(stderr,
+                "%s:%d: ERROR: symbol '%.*s' is not exported by '%s'\n", file,
+                relocation.line, name.length, name.start,
+                linker->files[hidden]);
+            exit(1);
+        }
+
+        fprintf(stderr, "%s:%d: ERROR: no such symbol '%.*s'\n", file,
+            relocation.line, name.length, name.start);
+        exit(1);
+    }
+
+    if (relocation.kind != RELOC_JUMP)
+        return intern_data(linker, file, relocation, index);
+
+    Symbol const* symbol = &linker->symbols[index];
+    if (symbol->kind != SYMBOL_LABEL) {
+        fprintf(stderr, "%s:%d: ERROR: symbol '%.*s' is not a code label\n",
+            file, relocation.line, relocation.name.length,
+            relocation.name.start);
+        exit(1);
+    }
+
+    return symbol->as_label.address;
+}
+
+// moves the module's jump targets to where it is laid out and fills in its
+// relocations. returns the number of instructions in the module.
+static int32_t link_module(
+    Linker* linker, Module* module, SymbolTable const* locals, int32_t base)
+{
+    uint8_t* code = module->code;
+    int32_t count = 0;
+
+    for (int32_t i = 0; i < module->code_length; count++) {
+        int32_t size = operand_size(code[i]);
+        int32_t operand = pyrite_operand_offset(i, size);
+
+        if (is_jump_instruction(code[i])) {
+            int32_t target;
+            memcpy(&target, &code[operand], sizeof(int32_t));
+            target += base;
+            memcpy(&code[operand], &target, sizeof(int32_t));
+        }
+
+        i = operand + size;
+    }
+
+    for (int32_t i = 0; i < module->relocation_count; i++) {
+        Relocation relocation = module->relocations[i];
+        int32_t value
+            = resolve_relocation(linker, locals, module->path, relocation);
+        memcpy(&code[relocation.offset], &value, sizeof(int32_t));
+    }
+
+    return count;
+}
+
+// the streamed main program is already in the output, its jumps to labels
+// that were never defined are chained through their operands and its other
+// relocations hold file offsets. it is laid out first, so its symbols are
+// the first locals.
+static void link_streamed(Linker* linker, Assembler* assembler)
+{
+    FILE* stream = assembler->output;
+    SymbolTable const* locals = &linker->locals[0];
+
+    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(assembler->symbols); i++) {
+        Symbol symbol = assembler->symbols[i];
+        if (symbol.kind != SYMBOL_LABEL || symbol.as_label.patches == -1)
+            continue;
+
+        int32_t address = symbol.as_label.address;
+        if (address == -1) {
+            Relocation relocation = { .kind = RELOC_JUMP,
+                .line = symbol.as_label.line,
+                .name = symbol.as_label.name };
+            address = resolve_relocation(
+                linker, locals, assembler->input_file, relocation);
+        }
+
+        for (int32_t patch = symbol.as_label.patches; patch != -1;) {
+            fseek(stream, patch, SEEK_SET);
+            if (fread(&patch, sizeof(int32_t), 1, stream) != 1) {
+                fprintf(stderr, "ERROR: cannot read back the output\n");
+                exit(1);
+            }
+
+            fseek(stream, -(long)sizeof(int32_t), SEEK_CUR);
+            fwrite(&address, sizeof(int32_t), 1, stream);
+        }
+    }
+
+    for (int32_t i = 0; i < (int32_t)DYNARRAY_LENGTH(assembler->relocations);
+        i++) {
+        Relocation relocation = assembler->relocations[i];
+        int32_t value = resolve_relocation(
+            linker, locals, assembler->input_file, relocation);
+
+        fseek(stream, relocation.offset, SEEK_SET);
+        fwrite(&value, sizeof(int32_t), 1, stream);
+    }
+
+    fseek(stream, 0, SEEK_END);
+}
+
+// the header and the section table are written once the program is done,
+// until then they are zeros.
+static FILE* open_output(char const* output_file)
+{
+    FILE* stream = fopen(output_file, "w+b");
+    if (!stream) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", output_file,
+            strerror(errno));
+        exit(1);
+    }
+
+    static uint8_t const placeholder[CODE_OFFSET];
+    fwrite(placeholder, 1, CODE_OFFSET, stream);
+    return stream;
+}
+
+// zeros up to the next aligned offset, which is returned.
+static int64_t pad_output(FILE* stream, int64_t offset)
+{
+    static uint8_t const padding[PYRITE_ALIGNMENT];
+    int32_t length = -offset & (PYRITE_ALIGNMENT - 1);
+    fwrite(padding, 1, length, stream);
+    return offset + length;
+}
+
+typedef struct {
+    int32_t* depths; // per byte offset, -1 where nothing arrived yet.
+    int32_t* worklist;
+    int32_t worklist_length;
+    bool consistent;
+} DepthWalk;
+
+// records that offset is reached with depth. returns whether this is the
+// first time, a second arrival with another depth makes the walk give up.
+static bool reach_offset(DepthWalk* walk, int32_t offset, int32_t depth)
+{
+    if (walk->depths[offset] < 0) {
+        walk->depths[offset] = depth;
+        return true;
+    }
+
+    if (walk->depths[offset] != depth)
+        walk->consistent = false;
+
+    return false;
+}
+
+// the deepest the stack gets when the linked code runs from its start, not
+// counting any inputs, walked the way the vm's verifier does it. 0 means
+// unknown: the code builds call frames, underflows or reaches an offset
+// with two different depths, and the vm then starts with a small stack.
+static uint32_t max_stack_depth(uint8_t const* code, int32_t length)
+{
+    DepthWalk walk = {
+        .depths = malloc(sizeof(int32_t) * (length + 1)),
+        .worklist = malloc(sizeof(int32_t) * (length + 1)),
+        .consistent = true,
+    };
+    if (!walk.depths || !walk.worklist) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t offset = 0; offset <= length; offset++)
+        walk.depths[offset] = -1;
+
+    int32_t max_depth = 0;
+    reach_offset(&walk, 0, 0);
+    walk.worklist[walk.worklist_length++] = 0;
+
+    while (walk.consistent && walk.worklist_length > 0) {
+        int32_t offset = walk.worklist[--walk.worklist_length];
+        int32_t depth = walk.depths[offset];
+
+        // running off the end lands on the halt the vm appends.
+        while (walk.consistent && offset < length) {
+            int32_t pops, pushes;
+            if (!pyrite_stack_effect(code[offset], &pops, &pushes)
+                || depth < pops) {
+                walk.consistent = false;
+                break;
+            }
+
+            depth += pushes - pops;
+            if (depth > max_depth)
+                max_depth = depth;
+
+            int32_t size = operand_size(code[offset]);
+            int32_t operand = pyrite_operand_offset(offset, size);
+            if (code[offset] == INS_HALT || operand + size > length)
+                break;
+
+            if (is_jump_instruction(code[offset])) {
+                int32_t target;
+                memcpy(&target, code + operand, sizeof(int32_t));
+                if (target < 0 || target > length) {
+                    walk.consistent = false;
+                    break;
+                }
+
+                if (reach_offset(&walk, target, depth))
+                    walk.worklist[walk.worklist_length++] = target;
+                if (code[offset] == INS_JMP)
+                    break;
+            }
+
+            offset = operand + size;
+            if (!reach_offset(&walk, offset, depth))
+                break;
+        }
+    }
+
+    free(walk.worklist);
+    free(walk.depths);
+    return walk.consistent ? max_depth : 0;
+}
+
+// runs max_stack_depth over the code as it ended up in the output.
+static uint32_t output_stack_depth(FILE* stream, int32_t program_length)
+{
+    if (program_length == 0)
+        return 0;
+
+    fflush(stream);
+    size_t size = CODE_OFFSET + program_length;
+    uint8_t* mapping
+        = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(stream), 0);
+    if (mapping == MAP_FAILED)
+        return 0;
+
+    uint32_t depth = max_stack_depth(mapping + CODE_OFFSET, program_length);
+    munmap(mapping, size);
+    return depth;
+}
+
+// appends the constant pool and the metadata after the code, then fills in
+// the section table and the header. the checksum is taken over the file as
+// it ended up on disk, streamed jumps were patched in place.
+static void finish_output(FILE* stream, int32_t program_length,
+    ConstantPool const* pool, PyriteMetadata metadata)
+{
+    PyriteSection sections[SECTION_COUNT] = {
+        { .kind = SECTION_CODE, .offset = CODE_OFFSET, .size = program_length },
+    };
+
+    int64_t offset = pad_output(stream, CODE_OFFSET + program_length);
+    sections[1] = (PyriteSection) { .kind = SECTION_CONSTANTS,
+        .offset = offset,
+        .size = write_constant_pool(pool, stream) };
+
+    offset = pad_output(stream, offset + sections[1].size);
+    sections[2] = (PyriteSection) {
+        .kind = SECTION_METADATA, .offset = offset, .size = sizeof(metadata)
+    };
+    metadata.max_stack_depth = output_stack_depth(stream, program_length);
+    fwrite(&metadata, sizeof(metadata), 1, stream);
+
+    PyriteFileHeader header = { .magic = PYRITE_MAGIC,
+        .version = PYRITE_VERSION,
+        .section_count = SECTION_COUNT,
+        .checksum = PYRITE_CHECKSUM_INIT };
+
+    fseek(stream, CODE_OFFSET, SEEK_SET);
+    uint8_t buffer[64 * 1024];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+        header.checksum = pyrite_checksum(header.checksum, buffer, read);
+
+    fseek(stream, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, stream);
+    fwrite(sections, sizeof(PyriteSection), SECTION_COUNT, stream);
+}
+
+// the main program comes first, at offset zero, and every module it imports
+// follows it. streaming writes the main program to the output while it is
+// parsed, without ever holding all of it, but leaves a partial output
+// behind on errors.
+static void assembler_generate(Assembler* assembler, char const* output_file,
+    bool streaming, int32_t optimization)
+{
+    struct stat info;
+    if (stat(assembler->input_file, &info) != 0) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n",
+            assembler->input_file, strerror(errno));
+        exit(1);
+    }
+
+    Module* main
+        = module_make((char*)assembler->input_file, &info, optimization);
+
+    FILE* stream = NULL;
+    if (streaming) {
+        stream = open_output(output_file);
+        assembler->output = stream;
+
+        parse_tokens(assembler);
+
+        main->symbols = assembler->symbols;
+        main->symbol_count = DYNARRAY_LENGTH(assembler->symbols);
+        main->imports = assembler->imports;
+        main->import_count = DYNARRAY_LENGTH(assembler->imports);
+        main->code_length = assembler->output_length;
+    } else {
+        parse_tokens(assembler);
+        main->saved = optimize(assembler, optimization);
+        encode_module(assembler, main);
+    }
+
+    ModuleSet set = { .modules = DYNARRAY_MAKE(Module*) };
+    DYNARRAY_APPEND(&set.modules, main);
+    load_imports(&set);
+
+    int32_t module_count = DYNARRAY_LENGTH(set.modules);
+    bool* placed = calloc(module_count, sizeof(bool));
+    int32_t* order = malloc(sizeof(int32_t) * module_count);
+    int32_t* bases = malloc(sizeof(int32_t) * module_count);
+    if (!placed || !order || !bases) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int32_t count = 0;
+    layout_module(&set, 0, placed, order, &count);
+
+    Linker linker = { .symbols = DYNARRAY_MAKE(Symbol),
+        .locals = malloc(sizeof(SymbolTable) * count),
+        .module_count = count,
+        .files = DYNARRAY_MAKE(char const*),
+        .arrays = DYNARRAY_MAKE(int32_t) };
+    if (!linker.locals) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    symbol_table_init(&linker.table, linker.symbols);
+    constant_pool_init(&linker.pool);
+
+    // every module starts aligned, so its operands stay aligned. the zeros
+    // in between decode as halts.
+    int32_t program_length = 0;
+    int32_t cached = 0;
+    int32_t saved = 0;
+    for (int32_t i = 0; i < count; i++) {
+        Module* module = set.modules[order[i]];
+        program_length = (program_length + PYRITE_ALIGNMENT - 1)
+            & -PYRITE_ALIGNMENT;
+        bases[i] = program_length;
+        program_length += module->code_length;
+        cached += module->cached;
+        saved += module->saved;
+        link_symbols(&linker, module, &linker.locals[i], bases[i]);
+    }
+
+    if (streaming) {
+        link_streamed(&linker, assembler);
+    } else {
+        stream = open_output(output_file);
+    }
+
+    PyriteMetadata metadata = { .module_count = module_count };
+    if (streaming)
+        metadata.instruction_count = assembler->output_count;
+
+    int32_t written = streaming ? main->code_length : 0;
+    for (int32_t i = streaming ? 1 : 0; i < count; i++) {
+        Module* module = set.modules[order[i]];
+        metadata.instruction_count += bases[i] - written;
+        pad_output(stream, CODE_OFFSET + written);
+
+        metadata.instruction_count
+            += link_module(&linker, module, &linker.locals[i], bases[i]);
+        fwrite(module->code, 1, module->code_length, stream);
+        written = bases[i] + module->code_length;
+    }
+
+    finish_output(stream, program_length, &linker.pool, metadata);
+
+    printf("program length: %d bytes\n", program_length);
+    if (DYNARRAY_LENGTH(linker.pool.values) > 0)
+        printf("constant pool: %d entries, %d bytes of strings, %d bytes of "
+               "arrays\n",
+            (int32_t)DYNARRAY_LENGTH(linker.pool.values),
+            (int32_t)DYNARRAY_LENGTH(linker.pool.strings),
+            (int32_t)(DYNARRAY_LENGTH(linker.pool.arrays)
+                * sizeof(PyriteValue)));
+    if (module_count > 1)
+        printf("modules: %d, %d from cache\n", module_count - 1, cached);
+    if (optimization > 0)
+        printf("optimizer saved %d bytes\n", saved);
+
+    fclose(stream);
+
+    for (int32_t i = 1; i < module_count; i++) {
+        arena_free(&set.modules[i]->arena);
+        free(set.modules[i]->path);
+        free(set.modules[i]);
+    }
+    arena_free(&main->arena);
+    free(main);
+
+    free(linker.table.slots);
+    for (int32_t i = 0; i < count; i++)
+        free(linker.locals[i].slots);
+    free(linker.locals);
+    constant_pool_free(&linker.pool);
+    DYNARRAY_FREE(linker.symbols);
+    DYNARRAY_FREE(linker.files);
+    DYNARRAY_FREE(linker.arrays);
+    DYNARRAY_FREE(set.modules);
+    free(bases);
+    free(order);
+    free(placed);
+}
+
+int main(int argc, char** argv)
+{
+    char const* input = "input.pyasm";
+    char const* output = "output.pyrite";
+    bool streaming = false;
+    int32_t optimization = 0;
+
+    int32_t positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            streaming = true;
+        } else if (strncmp(argv[i], "-O", 2) == 0) {
+            optimization = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        } else if (positional++ == 0) {
+            input = argv[i];
+        } else {
+            output = argv[i];
+        }
+    }
+
+    init_mnemonics();
+
+    Assembler assembler;
+    assembler_init(&assembler, input);
+    if (streaming && optimization > 0)
+        fprintf(stderr, "WARNING: --stream never holds the main program, "
+                        "only imported modules are optimized\n");
+
+    assembler_generate(&assembler, output, streaming, optimization);
     assembler_free(&assembler);
 }
@@ -1,194 +1,1210 @@
 #include "pyrite.h"
 
-#include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static uint8_t fetch(VirtualMachine* vm)
+static DecodedInstruction const* fetch(VirtualMachine* vm)
 {
-    return vm->program[++vm->program_counter];
+    return &vm->code[++vm->program_counter];
 }
 
-static Word fetch_word(VirtualMachine* vm, PyriteValueType type)
+static void runtime_error(VirtualMachine* vm, char const* message)
 {
-    uint8_t buffer[8];
+    if (vm->error_jump) {
+        vm->error = message;
+        longjmp(*vm->error_jump, 1);
+    }
 
-    Word word;
-    word.type = type;
+    vm_flush_output(vm);
+    fprintf(
+        stderr, "ERROR: %s at instruction %d\n", message, vm->program_counter);
+    exit(1);
+}
 
-    switch (type) {
-    case PR_INT:
-        for (size_t i = 0; i < sizeof(int64_t); i++) {
-            buffer[i] = fetch(vm);
-        }
-        memcpy(&word.value.as_int, buffer, sizeof(int64_t));
-        break;
-    case PR_DOUBLE:
-        for (size_t i = 0; i < sizeof(double_t); i++) {
-            buffer[i] = fetch(vm);
-        }
-        memcpy(&word.value.as_double, buffer, sizeof(double_t));
-        break;
-    case PR_PTR:
-        for (size_t i = 0; i < sizeof(void*); i++) {
-            buffer[i] = fetch(vm);
-        }
-        memcpy(&word.value.as_ptr, buffer, sizeof(void*));
-        break;
+// makes room for at least slots words, keeping what is on the stack.
+void vm_reserve_stack(VirtualMachine* vm, int64_t slots)
+{
+    if (slots <= vm->stack_cap)
+        return;
+
+    if (slots > STACK_LIMIT) {
+        fprintf(stderr, "ERROR: the stack cannot hold more than %d words\n",
+            STACK_LIMIT);
+        exit(1);
     }
 
-    return word;
+    vm->stack = realloc(vm->stack, sizeof(Word) * slots);
+    if (!vm->stack) {
+        perror("Memory reallocation failed");
+        exit(EXIT_FAILURE);
+    }
+    vm->stack_cap = slots;
+}
+
+static void grow_stack(VirtualMachine* vm)
+{
+    if (vm->stack_cap >= STACK_LIMIT)
+        runtime_error(vm, "stack overflow");
+
+    int64_t slots = vm->stack_cap > 0 ? (int64_t)vm->stack_cap * 2 : 1;
+    vm_reserve_stack(vm, slots < STACK_LIMIT ? slots : STACK_LIMIT);
 }
 
+// verified programs run on a stack already big enough for them, only the
+// checked interpreter ever grows it.
 static void push(VirtualMachine* vm, Word word)
 {
-    assert(vm->stack_pointer < STACK_CAP && "STACK OVERFLOW!");
+    if (vm->stack_pointer + 1 >= vm->stack_cap)
+        grow_stack(vm);
 
     vm->stack[++vm->stack_pointer] = word;
 }
 
+// recursion has no depth the verifier could size the stack for, so verified
+// programs make room for each frame as it is entered.
+static void reserve_frame(VirtualMachine* vm)
+{
+    int64_t slots = (int64_t)vm->stack_pointer + 1 + vm->max_frame_depth;
+    if (slots > STACK_LIMIT)
+        runtime_error(vm, "stack overflow");
+
+    int64_t doubled = (int64_t)vm->stack_cap * 2;
+    if (doubled > STACK_LIMIT)
+        doubled = STACK_LIMIT;
+    vm_reserve_stack(vm, slots > doubled ? slots : doubled);
+}
+
 static Word pop(VirtualMachine* vm)
 {
-    assert(vm->stack_pointer >= 0 && "STACK UNDERFLOW!");
+    if (vm->stack_pointer < 0)
+        runtime_error(vm, "stack underflow");
 
     return vm->stack[vm->stack_pointer--];
 }
 
-static void print_word(Word word)
+static Word* top(VirtualMachine* vm)
 {
-    switch (word.type) {
-    case PR_INT:
-        printf("%ld\n", word.value.as_int);
-        break;
-    case PR_DOUBLE:
-        printf("%lf\n", word.value.as_double);
-        break;
-    case PR_PTR:
-        printf("%p\n", word.value.as_ptr);
-        break;
+    if (vm->stack_pointer < 0)
+        runtime_error(vm, "stack underflow");
+
+    return &vm->stack[vm->stack_pointer];
+}
+
+static void expect_type(VirtualMachine* vm, Word word, PyriteValueType type)
+{
+    if (word_type(word) != type)
+        runtime_error(vm, "operand type mismatch");
+}
+
+// the operand helpers are spelled PUSH/POP/TOP/PEEK/EXPECT_TYPE so each
+// instantiation of pyrite_loop.h can decide whether they are checked.
+#define arithop_int(OP)                                      \
+    ({                                                       \
+        Word rhs = POP();                                    \
+        Word lhs = POP();                                    \
+        EXPECT_TYPE(lhs, PR_INT);                            \
+        EXPECT_TYPE(rhs, PR_INT);                            \
+        word_make_int(word_as_int(lhs) OP word_as_int(rhs)); \
+    })
+
+#define arithop_double(OP)                                            \
+    ({                                                                \
+        Word rhs = POP();                                             \
+        Word lhs = POP();                                             \
+        EXPECT_TYPE(lhs, PR_DOUBLE);                                  \
+        EXPECT_TYPE(rhs, PR_DOUBLE);                                  \
+        word_make_double(word_as_double(lhs) OP word_as_double(rhs)); \
+    })
+
+void vm_division_error(VirtualMachine* vm, int64_t divisor)
+{
+    runtime_error(vm, divisor == 0 ? "division by zero" : "integer overflow");
+}
+
+// a zero divisor and INT64_MIN / -1 trap on x86-64, so integer division is
+// checked even for verified programs.
+static int64_t divide(VirtualMachine* vm, int64_t lhs, int64_t rhs)
+{
+    if (rhs == 0 || (rhs == -1 && lhs == INT64_MIN))
+        vm_division_error(vm, rhs);
+
+    return lhs / rhs;
+}
+
+#define divide_int()                                                   \
+    ({                                                                 \
+        Word rhs = POP();                                              \
+        Word lhs = POP();                                              \
+        EXPECT_TYPE(lhs, PR_INT);                                      \
+        EXPECT_TYPE(rhs, PR_INT);                                      \
+        word_make_int(divide(vm, word_as_int(lhs), word_as_int(rhs))); \
+    })
+
+// the immediate forms work on the top of the stack in place, with the
+// instruction operand as the right hand side.
+#define arithop_int_immediate(OP)                              \
+    {                                                          \
+        Word* lhs = TOP();                                     \
+        EXPECT_TYPE(*lhs, PR_INT);                             \
+        *lhs = word_make_int(                                  \
+            word_as_int(*lhs) OP instruction->operand.as_int); \
+    }
+
+#define arithop_double_immediate(OP)                                 \
+    {                                                                \
+        Word* lhs = TOP();                                           \
+        EXPECT_TYPE(*lhs, PR_DOUBLE);                                \
+        *lhs = word_make_double(                                     \
+            word_as_double(*lhs) OP instruction->operand.as_double); \
     }
+
+#define ARITHOP(TYPE, OP) PUSH(arithop_##TYPE(OP))
+#define ARITHOP_IMMEDIATE(TYPE, OP) arithop_##TYPE##_immediate(OP)
+#define ARITHOP_PRINT(TYPE, OP) vm_print_word(vm, arithop_##TYPE(OP))
+
+#define DIVIDE() PUSH(divide_int())
+#define DIVIDE_PRINT() vm_print_word(vm, divide_int())
+#define DIVIDE_IMMEDIATE()                                               \
+    {                                                                    \
+        Word* lhs = TOP();                                               \
+        EXPECT_TYPE(*lhs, PR_INT);                                       \
+        *lhs = word_make_int(                                            \
+            divide(vm, word_as_int(*lhs), instruction->operand.as_int)); \
+    }
+
+// jump targets are decoded into instruction indices. fetch pre-increments the
+// program counter, hence the - 1.
+#define JUMP(INDEX) (vm->program_counter = (INDEX) - 1)
+
+#define branch_int(OP)                            \
+    {                                             \
+        Word rhs = POP();                         \
+        Word lhs = POP();                         \
+        EXPECT_TYPE(lhs, PR_INT);                 \
+        EXPECT_TYPE(rhs, PR_INT);                 \
+        if (word_as_int(lhs) OP word_as_int(rhs)) \
+            JUMP(instruction->operand.as_int);    \
+    }
+
+#define branch_double(OP)                               \
+    {                                                   \
+        Word rhs = POP();                               \
+        Word lhs = POP();                               \
+        EXPECT_TYPE(lhs, PR_DOUBLE);                    \
+        EXPECT_TYPE(rhs, PR_DOUBLE);                    \
+        if (word_as_double(lhs) OP word_as_double(rhs)) \
+            JUMP(instruction->operand.as_int);          \
+    }
+
+#define BRANCH(TYPE, OP) branch_##TYPE(OP)
+
+// a new array of length elements on the vm's heap, for the vector
+// instructions to fill in. the operands have to stay on the stack until
+// this returns, a collection moves them.
+static PyriteArray* make_array(VirtualMachine* vm, int64_t length)
+{
+    PyriteArray* array = vm_heap_alloc(
+        vm, HEAP_ARRAY, sizeof(PyriteArray) + sizeof(double_t) * length);
+    array->length = length;
+    return array;
+}
+
+// array lengths are only known at run time, so they are checked even for
+// verified programs.
+static void expect_same_length(
+    VirtualMachine* vm, PyriteArray const* lhs, PyriteArray const* rhs)
+{
+    if (lhs->length != rhs->length)
+        runtime_error(vm, "vector lengths differ");
+}
+
+// the slot depth entries below the top of the stack.
+static Word* peek(VirtualMachine* vm, int32_t depth)
+{
+    if (vm->stack_pointer - depth < 0)
+        runtime_error(vm, "stack underflow");
+
+    return &vm->stack[vm->stack_pointer - depth];
 }
 
-#define arithop_int(OP)                                             \
+#define VECTOR_BINARY(KERNEL)                                       \
     {                                                               \
-        Word rhs = pop(vm);                                         \
-        Word lhs = pop(vm);                                         \
-        assert(lhs.type == PR_INT && rhs.type == PR_INT);           \
-        Word result;                                                \
-        result.type = PR_INT;                                       \
-        result.value.as_int = lhs.value.as_int OP rhs.value.as_int; \
-        push(vm, result);                                           \
+        EXPECT_TYPE(*PEEK(1), PR_ARRAY);                            \
+        EXPECT_TYPE(*PEEK(0), PR_ARRAY);                            \
+        expect_same_length(                                         \
+            vm, word_as_array(*PEEK(1)), word_as_array(*PEEK(0)));  \
+        PyriteArray* result                                         \
+            = make_array(vm, word_as_array(*PEEK(0))->length);      \
+        PyriteArray const* a = word_as_array(*PEEK(1));             \
+        PyriteArray const* b = word_as_array(*PEEK(0));             \
+        vm->vector->KERNEL(                                         \
+            result->elements, a->elements, b->elements, a->length); \
+        vm->stack_pointer -= 2;                                     \
+        PUSH(word_make_array(result));                              \
     }
 
-#define arithop_double(OP)                                                   \
-    {                                                                        \
-        Word rhs = pop(vm);                                                  \
-        Word lhs = pop(vm);                                                  \
-        assert(lhs.type == PR_DOUBLE && rhs.type == PR_DOUBLE);              \
-        Word result;                                                         \
-        result.type = PR_DOUBLE;                                             \
-        result.value.as_double = lhs.value.as_double OP rhs.value.as_double; \
-        push(vm, result);                                                    \
+// field counts are only known at run time, so like array lengths the
+// field index is checked even for verified programs, and so is the type a
+// load finds there.
+static Word* object_field(VirtualMachine* vm, Word object, int64_t index)
+{
+    Word* fields = word_as_ptr(object);
+    if (index < 0
+        || (uint64_t)index >= heap_header(fields)->size / sizeof(Word))
+        runtime_error(vm, "field index out of range");
+
+    return &fields[index];
+}
+
+#define LOAD_FIELD(TYPE)                                               \
+    {                                                                  \
+        Word* object = TOP();                                          \
+        EXPECT_TYPE(*object, PR_PTR);                                  \
+        Word field                                                     \
+            = *object_field(vm, *object, instruction->operand.as_int); \
+        if (word_type(field) != TYPE)                                  \
+            runtime_error(vm, "field type mismatch");                  \
+        *object = field;                                               \
     }
 
-#define ARITHOP(TYPE, OP) arithop_##TYPE(OP)
+static int32_t operand_size(PyriteInstruction instruction)
+{
+    switch (instruction) {
+    case INS_IPUSH:
+    case INS_IPUSH_IADD:
+    case INS_IPUSH_ISUB:
+    case INS_IPUSH_IMUL:
+    case INS_IPUSH_IDIV:
+        return sizeof(int64_t);
+    case INS_DPUSH:
+    case INS_DPUSH_DADD:
+    case INS_DPUSH_DSUB:
+    case INS_DPUSH_DMUL:
+    case INS_DPUSH_DDIV:
+        return sizeof(double_t);
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+    case INS_CALL:
+    case INS_RET:
+    case INS_ARG:
+    case INS_ICONST:
+    case INS_DCONST:
+    case INS_SCONST:
+    case INS_VCONST:
+    case INS_ALLOC:
+    case INS_STORE:
+    case INS_ILOAD:
+    case INS_DLOAD:
+    case INS_PLOAD:
+    case INS_VLOAD:
+        return sizeof(int32_t);
+    case INS_HALT:
+    case INS_POP:
+    case INS_PRINT:
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
+    case INS_DADD:
+    case INS_DSUB:
+    case INS_DMUL:
+    case INS_DDIV:
+    case INS_IADD_PRINT:
+    case INS_ISUB_PRINT:
+    case INS_IMUL_PRINT:
+    case INS_IDIV_PRINT:
+    case INS_DADD_PRINT:
+    case INS_DSUB_PRINT:
+    case INS_DMUL_PRINT:
+    case INS_DDIV_PRINT:
+    case INS_DUP:
+    case INS_VADD:
+    case INS_VSUB:
+    case INS_VMUL:
+    case INS_VSCALE:
+    case INS_VFMA:
+    case INS_VSUM:
+    case INS_VDOT:
+    case INS_VLEN:
+        return 0;
+    }
 
-void vm_init(VirtualMachine* vm, uint8_t* program, uint32_t program_length)
+    return -1;
+}
+
+char const* instruction_name(PyriteInstruction instruction)
+{
+    switch (instruction) {
+    case INS_HALT:
+        return "halt";
+    case INS_IPUSH:
+        return "ipush";
+    case INS_DPUSH:
+        return "dpush";
+    case INS_POP:
+        return "pop";
+    case INS_PRINT:
+        return "print";
+    case INS_IADD:
+        return "iadd";
+    case INS_ISUB:
+        return "isub";
+    case INS_IMUL:
+        return "imul";
+    case INS_IDIV:
+        return "idiv";
+    case INS_DADD:
+        return "dadd";
+    case INS_DSUB:
+        return "dsub";
+    case INS_DMUL:
+        return "dmul";
+    case INS_DDIV:
+        return "ddiv";
+    case INS_IPUSH_IADD:
+        return "ipush_iadd";
+    case INS_IPUSH_ISUB:
+        return "ipush_isub";
+    case INS_IPUSH_IMUL:
+        return "ipush_imul";
+    case INS_IPUSH_IDIV:
+        return "ipush_idiv";
+    case INS_DPUSH_DADD:
+        return "dpush_dadd";
+    case INS_DPUSH_DSUB:
+        return "dpush_dsub";
+    case INS_DPUSH_DMUL:
+        return "dpush_dmul";
+    case INS_DPUSH_DDIV:
+        return "dpush_ddiv";
+    case INS_IADD_PRINT:
+        return "iadd_print";
+    case INS_ISUB_PRINT:
+        return "isub_print";
+    case INS_IMUL_PRINT:
+        return "imul_print";
+    case INS_IDIV_PRINT:
+        return "idiv_print";
+    case INS_DADD_PRINT:
+        return "dadd_print";
+    case INS_DSUB_PRINT:
+        return "dsub_print";
+    case INS_DMUL_PRINT:
+        return "dmul_print";
+    case INS_DDIV_PRINT:
+        return "ddiv_print";
+    case INS_JMP:
+        return "jmp";
+    case INS_IJEQ:
+        return "ijeq";
+    case INS_IJNE:
+        return "ijne";
+    case INS_IJLT:
+        return "ijlt";
+    case INS_IJLE:
+        return "ijle";
+    case INS_IJGT:
+        return "ijgt";
+    case INS_IJGE:
+        return "ijge";
+    case INS_DJEQ:
+        return "djeq";
+    case INS_DJNE:
+        return "djne";
+    case INS_DJLT:
+        return "djlt";
+    case INS_DJLE:
+        return "djle";
+    case INS_DJGT:
+        return "djgt";
+    case INS_DJGE:
+        return "djge";
+    case INS_CALL:
+        return "call";
+    case INS_RET:
+        return "ret";
+    case INS_ARG:
+        return "arg";
+    case INS_DUP:
+        return "dup";
+    case INS_ICONST:
+        return "iconst";
+    case INS_DCONST:
+        return "dconst";
+    case INS_SCONST:
+        return "sconst";
+    case INS_VCONST:
+        return "vconst";
+    case INS_VADD:
+        return "vadd";
+    case INS_VSUB:
+        return "vsub";
+    case INS_VMUL:
+        return "vmul";
+    case INS_VSCALE:
+        return "vscale";
+    case INS_VFMA:
+        return "vfma";
+    case INS_VSUM:
+        return "vsum";
+    case INS_VDOT:
+        return "vdot";
+    case INS_VLEN:
+        return "vlen";
+    case INS_ALLOC:
+        return "alloc";
+    case INS_STORE:
+        return "store";
+    case INS_ILOAD:
+        return "iload";
+    case INS_DLOAD:
+        return "dload";
+    case INS_PLOAD:
+        return "pload";
+    case INS_VLOAD:
+        return "vload";
+    }
+
+    return "invalid";
+}
+
+// turns the variable length byte stream into fixed size records so the
+// dispatch loop never has to reassemble an operand. a halt record is always
+// appended, so running off the end of the program simply halts.
+static bool is_jump(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+    case INS_CALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int32_t constant_type(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_ICONST:
+        return PR_INT;
+    case INS_DCONST:
+        return PR_DOUBLE;
+    case INS_SCONST:
+        return PR_STRING;
+    case INS_VCONST:
+        return PR_ARRAY;
+    default:
+        return -1;
+    }
+}
+
+// the offset of the operand of the instruction at offset, and through end
+// where the next instruction starts. invalid and truncated instructions
+// are reported here.
+static int32_t locate_operand(VirtualMachine* vm, int32_t offset, int32_t* end)
+{
+    int32_t size = operand_size(vm->program[offset]);
+    if (size < 0) {
+        fprintf(stderr, "ERROR: invalid instruction 0x%02x at offset %d\n",
+            vm->program[offset], offset);
+        exit(1);
+    }
+
+    int32_t operand = vm->aligned_operands
+        ? pyrite_operand_offset(offset, size)
+        : offset + 1;
+
+    if (operand + size > vm->program_length) {
+        fprintf(stderr,
+            "ERROR: truncated operand for instruction at offset %d\n", offset);
+        exit(1);
+    }
+
+    *end = operand + size;
+    return operand;
+}
+
+// code_length comes from the file's metadata when it has any, otherwise the
+// program is walked once just to count its instructions.
+static void vm_decode(VirtualMachine* vm, int32_t code_length)
+{
+    if (code_length <= 0) {
+        code_length = 0;
+        for (int32_t offset = 0; offset < vm->program_length; code_length++)
+            locate_operand(vm, offset, &offset);
+    }
+
+    // every instruction takes at least a byte, whatever the metadata says.
+    if (code_length > vm->program_length) {
+        fprintf(stderr, "ERROR: the program does not hold %d instructions\n",
+            code_length);
+        exit(1);
+    }
+
+    vm->code = malloc(sizeof(*vm->code) * (code_length + 1));
+    if (!vm->code) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // maps byte offsets to instruction indices, -1 in the middle of an
+    // instruction. jumping to the very end lands on the trailing halt.
+    int32_t* indices = malloc(sizeof(int32_t) * (vm->program_length + 1));
+    if (!indices) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t offset = 0; offset <= vm->program_length; offset++)
+        indices[offset] = -1;
+
+    int32_t offset = 0;
+    int32_t i = 0;
+    for (; i < code_length && offset < vm->program_length; i++) {
+        DecodedInstruction* instruction = &vm->code[i];
+        instruction->opcode = vm->program[offset];
+        instruction->operand.as_int = 0;
+        indices[offset] = i;
+
+        int32_t end;
+        int32_t operand = locate_operand(vm, offset, &end);
+        if (end - operand == sizeof(int32_t)) {
+            int32_t value;
+            memcpy(&value, vm->program + operand, sizeof(int32_t));
+            instruction->operand.as_int = value;
+        } else {
+            memcpy(&instruction->operand, vm->program + operand, end - operand);
+        }
+
+        offset = end;
+    }
+
+    if (i != code_length || offset != vm->program_length) {
+        fprintf(stderr, "ERROR: the program does not hold %d instructions\n",
+            code_length);
+        exit(1);
+    }
+
+    indices[vm->program_length] = code_length;
+
+    for (int32_t i = 0; i < code_length; i++) {
+        DecodedInstruction* instruction = &vm->code[i];
+        int32_t type = constant_type(instruction->opcode);
+        if (type >= 0) {
+            int64_t index = instruction->operand.as_int;
+            if (index < 0 || index >= vm->constant_count
+                || vm->constant_types[index] != type) {
+                fprintf(stderr,
+                    "ERROR: invalid constant %ld for instruction %d\n", index,
+                    i);
+                exit(1);
+            }
+        }
+
+        // ret and arg index the stack with their counts, even when the
+        // program runs checked.
+        if ((instruction->opcode == INS_RET || instruction->opcode == INS_ARG)
+            && (instruction->operand.as_int < 0
+                || instruction->operand.as_int > INT32_MAX)) {
+            fprintf(stderr, "ERROR: invalid count %ld for instruction %d\n",
+                instruction->operand.as_int, i);
+            exit(1);
+        }
+
+        if (!is_jump(instruction->opcode))
+            continue;
+
+        int64_t target = instruction->operand.as_int;
+        if (target < 0 || target > vm->program_length
+            || indices[target] < 0) {
+            fprintf(stderr,
+                "ERROR: invalid jump target %ld for instruction %d\n",
+                target, i);
+            exit(1);
+        }
+
+        instruction->operand.as_int = indices[target];
+    }
+
+    free(indices);
+
+    vm->code[code_length].opcode = INS_HALT;
+    vm->code[code_length].operand.as_int = 0;
+    vm->code_length = code_length + 1;
+}
+
+static void push_inputs(
+    VirtualMachine* vm, Word const* inputs, int32_t input_count)
+{
+    if (input_count > STACK_LIMIT) {
+        fprintf(stderr, "ERROR: too many inputs, at most %d fit the stack\n",
+            STACK_LIMIT);
+        exit(1);
+    }
+
+    vm_reserve_stack(vm, input_count);
+    for (int32_t i = 0; i < input_count; i++)
+        vm->stack[i] = inputs[i];
+
+    vm->stack_pointer = input_count - 1;
+}
+
+static void reset_state(VirtualMachine* vm)
 {
-    vm->program = program;
-    vm->program_length = program_length;
     vm->program_counter = -1;
+    vm->halted = false;
 
+    vm->stack = NULL;
+    vm->stack_cap = 0;
     vm->stack_pointer = -1;
     vm->base_pointer = -1;
+
+    vm->output.buffer = NULL;
+    vm->output.length = 0;
+    vm->output.cap = 0;
+    vm->output.fd = STDOUT_FILENO;
+
+    vm->error_jump = NULL;
+    vm->error = NULL;
+
+    vm_heap_init(&vm->heap);
+
+#ifdef PYRITE_PROFILE
+    vm->profile = NULL;
+#endif
+}
+
+void vm_init(VirtualMachine* vm, uint8_t* program, uint32_t program_length)
+{
+    vm_init_with_inputs(vm, program, program_length, NULL, 0);
+}
+
+// the caller picks the encoding through vm->aligned_operands and passes
+// what the file's metadata records, all zero when it has none.
+static void init_program(VirtualMachine* vm, uint8_t* program,
+    uint32_t program_length, PyriteMetadata const* metadata,
+    Word const* inputs, int32_t input_count)
+{
+    vm->program = program;
+    vm->program_length = program_length;
+
+    vm->jit_code = NULL;
+    vm->jit_code_size = 0;
+
+    vm->mapping = NULL;
+    vm->mapping_size = 0;
+    vm->path = NULL;
+
+    vm->shared = false;
+    vm->vector = vm_vector_kernels();
+    reset_state(vm);
+
+    vm_decode(vm, metadata->instruction_count);
+
+    // the recorded depth is only a hint, the stack still grows past it.
+    int64_t depth = metadata->max_stack_depth > 0 ? metadata->max_stack_depth
+                                                   : STACK_INITIAL_CAP;
+    depth += input_count;
+    vm_reserve_stack(vm, depth < STACK_LIMIT ? depth : STACK_LIMIT);
+    push_inputs(vm, inputs, input_count);
+
+    vm->input_count = input_count;
+    vm->input_types = malloc(sizeof(PyriteValueType) * (input_count + 1));
+    if (!vm->input_types) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t i = 0; i < input_count; i++)
+        vm->input_types[i] = word_type(inputs[i]);
+
+    if (!vm_verify(vm))
+        exit(1);
+
+    // the unchecked interpreter never grows the stack, whatever the file
+    // says it only trusts the verifier.
+    if (vm->verified)
+        vm_reserve_stack(vm, vm->max_stack_depth);
+
+#ifdef PYRITE_PROFILE
+    vm->profile = vm_profile_make(vm->code_length);
+#endif
+}
+
+static void clear_constants(VirtualMachine* vm)
+{
+    vm->constants = NULL;
+    vm->constant_types = NULL;
+    vm->constant_count = 0;
+    vm->literals = NULL;
+    vm->pool = NULL;
+    vm->pool_size = 0;
+}
+
+// programs built in memory are v1 code without a constant pool, only files
+// carry one.
+void vm_init_with_inputs(VirtualMachine* vm, uint8_t* program,
+    uint32_t program_length, Word const* inputs, int32_t input_count)
+{
+    clear_constants(vm);
+    vm->aligned_operands = false;
+
+    init_program(vm, program, program_length, &(PyriteMetadata) { 0 }, inputs,
+        input_count);
+}
+
+void vm_clone(VirtualMachine* vm, VirtualMachine const* source,
+    Word const* inputs, int32_t input_count)
+{
+    vm->program = source->program;
+    vm->program_length = source->program_length;
+    vm->aligned_operands = source->aligned_operands;
+    vm->code = source->code;
+    vm->code_length = source->code_length;
+
+    vm->constants = source->constants;
+    vm->constant_types = source->constant_types;
+    vm->constant_count = source->constant_count;
+    vm->literals = source->literals;
+    vm->pool = source->pool;
+    vm->pool_size = source->pool_size;
+    vm->vector = source->vector;
+
+    vm->max_stack_depth = source->max_stack_depth;
+    vm->max_frame_depth = source->max_frame_depth;
+    vm->verified = source->verified;
+    vm->jit_code = source->jit_code;
+    vm->jit_code_size = source->jit_code_size;
+
+    vm->mapping = NULL;
+    vm->mapping_size = 0;
+    vm->path = NULL;
+
+    vm->input_types = source->input_types;
+    vm->input_count = source->input_count;
+
+    vm->shared = true;
+    reset_state(vm);
+
+    // room for what source was sized for, with this clone's inputs in place
+    // of source's.
+    vm_reserve_stack(
+        vm, (int64_t)source->stack_cap - source->input_count + input_count);
+    push_inputs(vm, inputs, input_count);
+
+    // the verifier's conclusions only hold for the input types it saw.
+    bool same_inputs = input_count == source->input_count;
+    for (int32_t i = 0; same_inputs && i < input_count; i++)
+        same_inputs = word_type(inputs[i]) == source->input_types[i];
+
+    if (!same_inputs) {
+        vm->verified = false;
+        vm->jit_code = NULL;
+        vm->jit_code_size = 0;
+    }
+
+#ifdef PYRITE_PROFILE
+    vm->profile = vm_profile_make(vm->code_length);
+#endif
+}
+
+// a constant pool is "POOL", the entry count as an int32, count 8 byte
+// values, count type bytes and then the literals up to its end: NUL
+// terminated strings, and arrays, which are an int64 length followed by
+// that many doubles at an 8 byte aligned offset in the pool. it is used in
+// place, only the literal pointers are resolved.
+#define POOL_HEADER_SIZE (4 + sizeof(int32_t))
+
+static void corrupt_pool(char const* file)
+{
+    fprintf(stderr, "ERROR: the constant pool of '%s' is corrupt\n", file);
+    exit(1);
+}
+
+static void map_constant_pool(
+    VirtualMachine* vm, char const* file, uint8_t* pool, size_t size)
+{
+    int32_t count = -1;
+    if (size >= POOL_HEADER_SIZE && memcmp(pool, "POOL", 4) == 0)
+        memcpy(&count, pool + 4, sizeof(int32_t));
+
+    size_t literals
+        = POOL_HEADER_SIZE + (size_t)count * (sizeof(PyriteValue) + 1);
+    if (count < 0 || literals > size)
+        corrupt_pool(file);
+
+    vm->constants = (PyriteValue const*)(pool + POOL_HEADER_SIZE);
+    vm->constant_types = pool + POOL_HEADER_SIZE + count * sizeof(PyriteValue);
+    vm->constant_count = count;
+    vm->pool = pool;
+    vm->pool_size = size;
+
+    vm->literals = malloc(sizeof(void*) * (count + 1));
+    if (!vm->literals) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t i = 0; i < count; i++) {
+        vm->literals[i] = NULL;
+        if (vm->constant_types[i] != PR_STRING
+            && vm->constant_types[i] != PR_ARRAY)
+            continue;
+
+        int64_t offset = vm->constants[i].as_int;
+        if (offset < 0 || (size_t)offset >= size - literals)
+            corrupt_pool(file);
+
+        uint8_t* literal = pool + literals + offset;
+        size_t room = size - literals - offset;
+
+        if (vm->constant_types[i] == PR_STRING) {
+            if (!memchr(literal, '\0', room))
+                corrupt_pool(file);
+        } else {
+            int64_t length = -1;
+            if ((literals + offset) % PYRITE_ALIGNMENT == 0
+                && room >= sizeof(int64_t))
+                memcpy(&length, literal, sizeof(int64_t));
+
+            if (length < 0
+                || (uint64_t)length
+                    > (room - sizeof(int64_t)) / sizeof(double_t))
+                corrupt_pool(file);
+        }
+
+        vm->literals[i] = literal;
+    }
+}
+
+// a v1 constant pool starts at the first 8 byte aligned offset after the
+// code and runs to the end of the file. files that end with the code have
+// an empty pool.
+static void load_v1(VirtualMachine* vm, char const* file, uint8_t* mapping,
+    size_t size, uint8_t** program, int32_t* program_length)
+{
+    size_t header_size = 6 + sizeof(int32_t);
+
+    if (memcmp(mapping, "PYRITE", 6) != 0) {
+        fprintf(
+            stderr, "ERROR: the file '%s' is not a valid pyrite file\n", file);
+        exit(1);
+    }
+
+    memcpy(program_length, mapping + 6, sizeof(int32_t));
+
+    if (*program_length < 0 || (size_t)*program_length > size - header_size) {
+        fprintf(stderr, "ERROR: the file '%s' is truncated\n", file);
+        exit(1);
+    }
+
+    *program = mapping + header_size;
+    vm->aligned_operands = false;
+
+    size_t code_end = header_size + *program_length;
+    size_t pool = (code_end + PYRITE_ALIGNMENT - 1) & -(size_t)PYRITE_ALIGNMENT;
+    if (pool + POOL_HEADER_SIZE <= size
+        && memcmp(mapping + pool, "POOL", 4) == 0)
+        map_constant_pool(vm, file, mapping + pool, size - pool);
+}
+
+// only the header and the section table are read to find the sections, the
+// checksum is the one pass over the whole file.
+static void load_v2(VirtualMachine* vm, char const* file, uint8_t* mapping,
+    size_t size, uint8_t** program, int32_t* program_length,
+    PyriteMetadata* metadata)
+{
+    PyriteFileHeader header;
+    memcpy(&header, mapping, sizeof(header));
+
+    if (header.version != PYRITE_VERSION) {
+        fprintf(stderr,
+            "ERROR: the file '%s' is pyrite version %u, only versions 1 and %d "
+            "are supported\n",
+            file, header.version, PYRITE_VERSION);
+        exit(1);
+    }
+
+    size_t table_end
+        = sizeof(header) + (size_t)header.section_count * sizeof(PyriteSection);
+    if (table_end > size) {
+        fprintf(stderr, "ERROR: the file '%s' is truncated\n", file);
+        exit(1);
+    }
+
+    uint64_t checksum = pyrite_checksum(
+        PYRITE_CHECKSUM_INIT, mapping + table_end, size - table_end);
+    if (checksum != header.checksum) {
+        fprintf(stderr, "ERROR: the checksum of '%s' does not match\n", file);
+        exit(1);
+    }
+
+    PyriteSection const* sections
+        = (PyriteSection const*)(mapping + sizeof(header));
+    *program = NULL;
+    vm->aligned_operands = true;
+
+    for (uint32_t i = 0; i < header.section_count; i++) {
+        PyriteSection section = sections[i];
+        if (section.offset % PYRITE_ALIGNMENT != 0 || section.offset > size
+            || section.size > size - section.offset) {
+            fprintf(stderr, "ERROR: section %u of '%s' is out of bounds\n", i,
+                file);
+            exit(1);
+        }
+
+        uint8_t* bytes = mapping + section.offset;
+        switch (section.kind) {
+        case SECTION_CODE:
+            if (section.size > INT32_MAX) {
+                fprintf(stderr, "ERROR: the code of '%s' is too large\n", file);
+                exit(1);
+            }
+
+            *program = bytes;
+            *program_length = section.size;
+            break;
+        case SECTION_CONSTANTS:
+            map_constant_pool(vm, file, bytes, section.size);
+            break;
+        case SECTION_METADATA:
+            memcpy(metadata, bytes,
+                section.size < sizeof(*metadata) ? section.size
+                                                 : sizeof(*metadata));
+            break;
+        default:
+            // sections added by newer versions are none of our business.
+            break;
+        }
+    }
+
+    if (!*program) {
+        fprintf(stderr, "ERROR: the file '%s' has no code\n", file);
+        exit(1);
+    }
 }
 
 void vm_init_from_file(VirtualMachine* vm, char const* file)
 {
-    FILE* stream = fopen(file, "rb");
-    if (!stream) {
+    vm_init_from_file_with_inputs(vm, file, NULL, 0);
+}
+
+void vm_init_from_file_with_inputs(VirtualMachine* vm, char const* file,
+    Word const* inputs, int32_t input_count)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "ERROR: cannot open file '%s': %s\n", file,
             strerror(errno));
         exit(1);
     }
 
-    char header[6];
-    fread(header, 1, 6, stream);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "ERROR: cannot stat file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    size_t size = info.st_size;
 
-    if (strncmp(header, "PYRITE", 6) != 0) {
+    if (size < 6 + sizeof(int32_t)) {
         fprintf(
             stderr, "ERROR: the file '%s' is not a valid pyrite file\n", file);
         exit(1);
     }
 
+    // the program is decoded straight out of a read only mapping of the
+    // file, there is no intermediate copy and no stdio buffering.
+    uint8_t* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "ERROR: cannot map file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    clear_constants(vm);
+
+    uint8_t* program;
     int32_t program_length = 0;
-    fread(&program_length, 1, sizeof(int32_t), stream);
+    PyriteMetadata metadata = { 0 };
 
-    if (program_length == 0) {
-        fprintf(stderr, "WARNING: input file is empty '%s'\n", file);
-        fclose(stream);
-        return;
+    if (size >= sizeof(PyriteFileHeader)
+        && memcmp(mapping, PYRITE_MAGIC, sizeof(PYRITE_MAGIC)) == 0) {
+        load_v2(vm, file, mapping, size, &program, &program_length, &metadata);
+    } else {
+        load_v1(vm, file, mapping, size, &program, &program_length);
     }
 
-    uint8_t* program = malloc(1 * program_length);
-    fread(program, 1, program_length, stream);
-    fclose(stream);
+    if (program_length == 0)
+        fprintf(stderr, "WARNING: input file is empty '%s'\n", file);
 
-    vm_init(vm, program, program_length);
+    init_program(
+        vm, program, program_length, &metadata, inputs, input_count);
+    vm->mapping = mapping;
+    vm->mapping_size = size;
+    vm->path = realpath(file, NULL);
 }
 
 void vm_free(VirtualMachine* vm)
 {
-    free(vm->program);
+    vm_flush_output(vm);
+    free(vm->output.buffer);
+    free(vm->stack);
+    vm_heap_free(&vm->heap);
+
+#ifdef PYRITE_PROFILE
+    vm_profile_free(vm->profile);
+#endif
+
+    if (vm->shared)
+        return;
+
+    vm_jit_free(vm);
+    free(vm->code);
+    free(vm->input_types);
+    free(vm->literals);
+    free(vm->path);
+
+    if (vm->mapping) {
+        munmap(vm->mapping, vm->mapping_size);
+    } else {
+        free(vm->program);
+    }
 }
 
+// Opcode handlers are written once against TARGET/DISPATCH so the switch
+// loop and the threaded variant share their semantics. With
+// PYRITE_THREADED_DISPATCH every handler ends in its own indirect jump through
+// a table of label addresses (GCC labels-as-values), which gives the branch
+// predictor one site per opcode instead of a single shared switch jump.
+#ifdef PYRITE_THREADED_DISPATCH
+#    ifndef __GNUC__
+#        error "PYRITE_THREADED_DISPATCH requires GCC labels-as-values"
+#    endif
+#    define TARGET(INSTRUCTION) target_##INSTRUCTION
+#    define DISPATCH()                           \
+        do {                                     \
+            CHARGE_FUEL();                       \
+            goto* dispatch_table[NEXT_OPCODE()]; \
+        } while (0)
+#else
+#    define TARGET(INSTRUCTION) case INSTRUCTION
+#    define DISPATCH() continue
+#endif
+
+// PYRITE_PROFILE hooks every dispatch. without it the hook expands to
+// nothing, so production builds pay nothing for the profiler.
+#ifdef PYRITE_PROFILE
+#    define PROFILE_INSTRUCTION()                                       \
+        vm_profile_instruction(                                         \
+            vm->profile, vm->program_counter, instruction->opcode)
+#else
+#    define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+#define NEXT_OPCODE() \
+    (instruction = fetch(vm), PROFILE_INSTRUCTION(), instruction->opcode)
+
+#define VM_LOOP_NAME vm_execute_checked
+#define VM_LOOP_CHECKED 1
+#define VM_LOOP_FUEL 0
+#include "pyrite_loop.h"
+
+#define VM_LOOP_NAME vm_execute_unchecked
+#define VM_LOOP_CHECKED 0
+#define VM_LOOP_FUEL 0
+#include "pyrite_loop.h"
+
+// the budgeted loops are separate instantiations, so vm_execute never pays
+// for counting instructions.
+#define VM_LOOP_NAME vm_execute_checked_for
+#define VM_LOOP_CHECKED 1
+#define VM_LOOP_FUEL 1
+#include "pyrite_loop.h"
+
+#define VM_LOOP_NAME vm_execute_unchecked_for
+#define VM_LOOP_CHECKED 0
+#define VM_LOOP_FUEL 1
+#include "pyrite_loop.h"
+
 void vm_execute(VirtualMachine* vm)
 {
-    bool halt = false;
-    while (vm->program_counter < vm->program_length && !halt) {
-        switch (fetch(vm)) {
-        case INS_HALT:
-            halt = true;
-            break;
-        case INS_IPUSH:
-            push(vm, fetch_word(vm, PR_INT));
-            break;
-        case INS_DPUSH:
-            push(vm, fetch_word(vm, PR_DOUBLE));
-            break;
-        case INS_POP:
-            pop(vm);
-            break;
-        case INS_PRINT:
-            print_word(pop(vm));
-            break;
-        case INS_IADD:
-            ARITHOP(int, +);
-            break;
-        case INS_ISUB:
-            ARITHOP(int, -);
-            break;
-        case INS_IMUL:
-            ARITHOP(int, *);
-            break;
-        case INS_IDIV:
-            ARITHOP(int, /);
-            break;
-        case INS_DADD:
-            ARITHOP(double, +);
-            break;
-        case INS_DSUB:
-            ARITHOP(double, -);
-            break;
-        case INS_DMUL:
-            ARITHOP(double, *);
-            break;
-        case INS_DDIV:
-            ARITHOP(double, /);
-            break;
-        }
+    if (vm->halted)
+        return;
+
+    // the native code can only start from the top, a vm paused by
+    // vm_execute_for finishes in the interpreter.
+    if (vm->jit_code && vm->program_counter < 0) {
+        vm_jit_execute(vm);
+    } else if (vm->verified) {
+        vm_execute_unchecked(vm);
+    } else {
+        vm_execute_checked(vm);
     }
+
+    vm_flush_output(vm);
+
+    // clones are batch jobs, the batch reports them all together.
+#ifdef PYRITE_PROFILE
+    if (!vm->shared)
+        vm_profile_report(vm);
+#endif
+}
+
+bool vm_execute_for(VirtualMachine* vm, int64_t budget)
+{
+    if (vm->halted)
+        return true;
+
+    // native code cannot stop half way, budgeted runs always interpret.
+    if (vm->verified) {
+        vm_execute_unchecked_for(vm, budget);
+    } else {
+        vm_execute_checked_for(vm, budget);
+    }
+
+    if (!vm->halted)
+        return false;
+
+    vm_flush_output(vm);
+
+    // clones are batch jobs, the batch reports them all together.
+#ifdef PYRITE_PROFILE
+    if (!vm->shared)
+        vm_profile_report(vm);
+#endif
+    return true;
 }
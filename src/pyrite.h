@@ -1,9 +1,18 @@
 #pragma once
 
 #include <math.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-#define STACK_CAP 2048
+// the operand stack is allocated on its own. it starts out with room for
+// the deepest the program gets, as recorded in its file or found by the
+// verifier, or STACK_INITIAL_CAP slots when neither is known, and the
+// checked interpreter doubles it whenever it fills, up to STACK_LIMIT.
+#define STACK_INITIAL_CAP 16
+#define STACK_LIMIT (1 << 20)
 
 typedef enum {
     INS_HALT,
@@ -19,38 +28,818 @@ typedef enum {
     INS_DSUB,
     INS_DMUL,
     INS_DDIV,
+
+    // superinstructions, only ever emitted by the assembler. the push forms
+    // apply their immediate to the top of the stack, the print forms print
+    // the result instead of pushing it.
+    INS_IPUSH_IADD,
+    INS_IPUSH_ISUB,
+    INS_IPUSH_IMUL,
+    INS_IPUSH_IDIV,
+    INS_DPUSH_DADD,
+    INS_DPUSH_DSUB,
+    INS_DPUSH_DMUL,
+    INS_DPUSH_DDIV,
+    INS_IADD_PRINT,
+    INS_ISUB_PRINT,
+    INS_IMUL_PRINT,
+    INS_IDIV_PRINT,
+    INS_DADD_PRINT,
+    INS_DSUB_PRINT,
+    INS_DMUL_PRINT,
+    INS_DDIV_PRINT,
+
+    // control flow. jump targets are absolute byte offsets into the code
+    // section, the compare and branch forms pop rhs then lhs and jump when
+    // `lhs <op> rhs` holds. call pushes the return address and the caller's
+    // base pointer, ret n pops them back and drops n arguments, arg n pushes
+    // the n-th argument counting back from the last one pushed.
+    INS_JMP,
+    INS_IJEQ,
+    INS_IJNE,
+    INS_IJLT,
+    INS_IJLE,
+    INS_IJGT,
+    INS_IJGE,
+    INS_DJEQ,
+    INS_DJNE,
+    INS_DJLT,
+    INS_DJLE,
+    INS_DJGT,
+    INS_DJGE,
+    INS_CALL,
+    INS_RET,
+    INS_ARG,
+    INS_DUP,
+
+    // constant pool loads. the operand is an index into the pool that follows
+    // the code in the file, checked against the entry's type at load time.
+    INS_ICONST,
+    INS_DCONST,
+    INS_SCONST,
+
+    // packed double arrays. vconst pushes an array from the constant pool,
+    // the element-wise forms pop rhs then lhs and push a new array of the
+    // same length, vscale multiplies every element by the double on top,
+    // vfma pops c, b and a and computes a * b + c with a single rounding.
+    // vsum and vdot reduce to a double, vlen pushes the length as an int.
+    INS_VCONST,
+    INS_VADD,
+    INS_VSUB,
+    INS_VMUL,
+    INS_VSCALE,
+    INS_VFMA,
+    INS_VSUM,
+    INS_VDOT,
+    INS_VLEN,
+
+    // heap objects. alloc n pushes a pointer to a new object of n fields,
+    // all int 0. store n pops a value and an object and writes field n, the
+    // loads replace the object on top with its field n, which has to hold
+    // the type the load names.
+    INS_ALLOC,
+    INS_STORE,
+    INS_ILOAD,
+    INS_DLOAD,
+    INS_PLOAD,
+    INS_VLOAD,
 } PyriteInstruction;
 
+// how many words an instruction pops and pushes, shared by the verifier and
+// the assembler's depth analysis. returns false for call, ret and arg, whose
+// effect depends on the function they belong to, and for bytes that are no
+// instruction at all.
+static inline bool pyrite_stack_effect(
+    uint8_t opcode, int32_t* pops, int32_t* pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+
+    switch (opcode) {
+    case INS_HALT:
+    case INS_JMP:
+        return true;
+    case INS_IPUSH:
+    case INS_DPUSH:
+    case INS_ICONST:
+    case INS_DCONST:
+    case INS_SCONST:
+    case INS_VCONST:
+    case INS_ALLOC:
+        *pushes = 1;
+        return true;
+    case INS_POP:
+    case INS_PRINT:
+        *pops = 1;
+        return true;
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
+    case INS_DADD:
+    case INS_DSUB:
+    case INS_DMUL:
+    case INS_DDIV:
+    case INS_VADD:
+    case INS_VSUB:
+    case INS_VMUL:
+    case INS_VSCALE:
+    case INS_VDOT:
+        *pops = 2;
+        *pushes = 1;
+        return true;
+    case INS_IPUSH_IADD:
+    case INS_IPUSH_ISUB:
+    case INS_IPUSH_IMUL:
+    case INS_IPUSH_IDIV:
+    case INS_DPUSH_DADD:
+    case INS_DPUSH_DSUB:
+    case INS_DPUSH_DMUL:
+    case INS_DPUSH_DDIV:
+    case INS_VSUM:
+    case INS_VLEN:
+    case INS_ILOAD:
+    case INS_DLOAD:
+    case INS_PLOAD:
+    case INS_VLOAD:
+        *pops = 1;
+        *pushes = 1;
+        return true;
+    case INS_IADD_PRINT:
+    case INS_ISUB_PRINT:
+    case INS_IMUL_PRINT:
+    case INS_IDIV_PRINT:
+    case INS_DADD_PRINT:
+    case INS_DSUB_PRINT:
+    case INS_DMUL_PRINT:
+    case INS_DDIV_PRINT:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+    case INS_STORE:
+        *pops = 2;
+        return true;
+    case INS_DUP:
+        *pops = 1;
+        *pushes = 2;
+        return true;
+    case INS_VFMA:
+        *pops = 3;
+        *pushes = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// a .pyrite v2 file is a header, a table of sections and the sections
+// themselves, every one at an 8 byte aligned offset. within the code an
+// operand sits at the next multiple of its own size after its opcode, so it
+// can be loaded in place, and the bytes skipped are zero. the checksum is
+// fnv-1a over everything after the section table. v1 files are "PYRITE",
+// the code length and unaligned code, followed by an optional constant
+// pool. all fields are little endian.
+#define PYRITE_MAGIC "\x7fPYRITE"
+#define PYRITE_VERSION 2
+#define PYRITE_ALIGNMENT 8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t checksum;
+} PyriteFileHeader;
+
+typedef enum {
+    SECTION_CODE,
+    SECTION_CONSTANTS, // "POOL", an int32 count, values, types, literals.
+    SECTION_METADATA, // a PyriteMetadata, possibly a shorter one.
+} PyriteSectionKind;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+} PyriteSection;
+
+// fields are only ever added at the end. a reader takes the ones that fit
+// in the section and treats the rest as zero, which means unknown.
+// max_stack_depth leaves out the inputs a run starts with.
+typedef struct {
+    uint32_t instruction_count;
+    uint32_t module_count;
+    uint32_t max_stack_depth;
+} PyriteMetadata;
+
+static inline uint64_t pyrite_checksum(
+    uint64_t hash, uint8_t const* bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+
+    return hash;
+}
+
+#define PYRITE_CHECKSUM_INIT UINT64_C(14695981039346656037)
+
+// where the operand of the instruction at offset starts in v2 code.
+static inline int32_t pyrite_operand_offset(int32_t offset, int32_t size)
+{
+    return size == 0 ? offset + 1 : (offset + size) & -size;
+}
+
 typedef enum {
     PR_INT,
     PR_DOUBLE,
     PR_PTR,
+    PR_STRING,
+    PR_ARRAY,
 } PyriteValueType;
 
+// the payload of a PR_ARRAY word. arrays from the constant pool are used in
+// place in the mapping, 8 byte aligned, the ones the vector instructions
+// make live on the vm's heap.
+typedef struct {
+    int64_t length;
+    double_t elements[];
+} PyriteArray;
+
 typedef union {
     int64_t as_int;
     double_t as_double;
     void* as_ptr;
 } PyriteValue;
 
+// a stack slot. by default a value sits next to its type tag, which pads to
+// 16 bytes. with PYRITE_NAN_BOXING a slot is a single 64-bit word: doubles
+// are stored as they are (every NaN is canonicalised to one quiet NaN), while
+// ints, pointers, strings and arrays live in the payload of negative quiet
+// NaNs that no double can produce. boxed ints are 48-bit two's complement,
+// so arithmetic wraps at 48 bits instead of 64. always go through the word_*
+// accessors below so both layouts stay interchangeable.
+#ifdef PYRITE_NAN_BOXING
+typedef struct {
+    uint64_t bits;
+} Word;
+
+#    define WORD_CANONICAL_NAN UINT64_C(0x7ff8000000000000)
+#    define WORD_TAG_MASK UINT64_C(0xffff000000000000)
+#    define WORD_TAG_ARRAY UINT64_C(0xfffb000000000000)
+#    define WORD_TAG_STRING UINT64_C(0xfffc000000000000)
+#    define WORD_TAG_INT UINT64_C(0xfffd000000000000)
+#    define WORD_TAG_PTR UINT64_C(0xfffe000000000000)
+#    define WORD_PAYLOAD_MASK UINT64_C(0x0000ffffffffffff)
+
+static inline Word word_make_int(int64_t value)
+{
+    return (Word) {
+        .bits = WORD_TAG_INT | ((uint64_t)value & WORD_PAYLOAD_MASK)
+    };
+}
+
+static inline Word word_make_double(double_t value)
+{
+    Word word;
+    if (value != value) {
+        word.bits = WORD_CANONICAL_NAN;
+    } else {
+        memcpy(&word.bits, &value, sizeof(double_t));
+    }
+    return word;
+}
+
+static inline Word word_make_ptr(void* value)
+{
+    return (Word) {
+        .bits = WORD_TAG_PTR | ((uintptr_t)value & WORD_PAYLOAD_MASK)
+    };
+}
+
+static inline Word word_make_string(char const* value)
+{
+    return (Word) {
+        .bits = WORD_TAG_STRING | ((uintptr_t)value & WORD_PAYLOAD_MASK)
+    };
+}
+
+static inline Word word_make_array(PyriteArray const* value)
+{
+    return (Word) {
+        .bits = WORD_TAG_ARRAY | ((uintptr_t)value & WORD_PAYLOAD_MASK)
+    };
+}
+
+static inline PyriteValueType word_type(Word word)
+{
+    switch (word.bits & WORD_TAG_MASK) {
+    case WORD_TAG_INT:
+        return PR_INT;
+    case WORD_TAG_PTR:
+        return PR_PTR;
+    case WORD_TAG_STRING:
+        return PR_STRING;
+    case WORD_TAG_ARRAY:
+        return PR_ARRAY;
+    default:
+        return PR_DOUBLE;
+    }
+}
+
+static inline int64_t word_as_int(Word word)
+{
+    // shift the payload up against the sign bit and back to sign extend it.
+    return (int64_t)(word.bits << 16) >> 16;
+}
+
+static inline double_t word_as_double(Word word)
+{
+    double_t value;
+    memcpy(&value, &word.bits, sizeof(double_t));
+    return value;
+}
+
+static inline void* word_as_ptr(Word word)
+{
+    return (void*)(uintptr_t)(word.bits & WORD_PAYLOAD_MASK);
+}
+
+static inline char const* word_as_string(Word word)
+{
+    return (char const*)(uintptr_t)(word.bits & WORD_PAYLOAD_MASK);
+}
+
+static inline PyriteArray const* word_as_array(Word word)
+{
+    return (PyriteArray const*)(uintptr_t)(word.bits & WORD_PAYLOAD_MASK);
+}
+#else
 typedef struct {
     PyriteValue value;
     PyriteValueType type;
 } Word;
 
+static inline Word word_make_int(int64_t value)
+{
+    return (Word) { .value.as_int = value, .type = PR_INT };
+}
+
+static inline Word word_make_double(double_t value)
+{
+    return (Word) { .value.as_double = value, .type = PR_DOUBLE };
+}
+
+static inline Word word_make_ptr(void* value)
+{
+    return (Word) { .value.as_ptr = value, .type = PR_PTR };
+}
+
+static inline Word word_make_string(char const* value)
+{
+    return (Word) { .value.as_ptr = (void*)value, .type = PR_STRING };
+}
+
+static inline Word word_make_array(PyriteArray const* value)
+{
+    return (Word) { .value.as_ptr = (void*)value, .type = PR_ARRAY };
+}
+
+static inline PyriteValueType word_type(Word word)
+{
+    return word.type;
+}
+
+static inline int64_t word_as_int(Word word)
+{
+    return word.value.as_int;
+}
+
+static inline double_t word_as_double(Word word)
+{
+    return word.value.as_double;
+}
+
+static inline void* word_as_ptr(Word word)
+{
+    return word.value.as_ptr;
+}
+
+static inline char const* word_as_string(Word word)
+{
+    return word.value.as_ptr;
+}
+
+static inline PyriteArray const* word_as_array(Word word)
+{
+    return word.value.as_ptr;
+}
+#endif
+
+// a PR_PTR, PR_STRING or PR_ARRAY word of the same type as word, pointing
+// at pointer instead.
+static inline Word word_with_pointer(Word word, void const* pointer)
+{
+    switch (word_type(word)) {
+    case PR_PTR:
+        return word_make_ptr((void*)pointer);
+    case PR_STRING:
+        return word_make_string(pointer);
+    default:
+        return word_make_array(pointer);
+    }
+}
+
+// print output is collected here and written to fd in large chunks instead of
+// going through stdio once per print. with fd set to -1 nothing is ever
+// written, the buffer grows to hold everything the program printed.
+typedef struct {
+    char* buffer;
+    size_t length;
+    size_t cap;
+    int fd;
+} PyriteOutput;
+
+#ifdef PYRITE_PROFILE
+// per opcode counts and clock totals, opcode pair counts and how often each
+// instruction ran. the clock is the time stamp counter on x86-64 and
+// nanoseconds elsewhere.
+typedef struct {
+    uint64_t counts[256];
+    uint64_t clocks[256];
+    uint64_t pairs[256][256];
+
+    uint64_t* pc_hits;
+    int32_t code_length;
+
+    int32_t previous_opcode;
+    uint64_t previous_clock;
+} VmProfile;
+#endif
+
+// element-wise kernels over packed doubles. the avx2 ones are picked when
+// the cpu has avx2 and fma, plain loops otherwise. both accumulate the
+// reductions in the same 16 lanes and combine them in the same order, and
+// fma rounds once either way, so every kernel gives the same bits on every
+// machine.
+typedef struct {
+    void (*add)(double_t* out, double_t const* lhs, double_t const* rhs,
+        int64_t length);
+    void (*sub)(double_t* out, double_t const* lhs, double_t const* rhs,
+        int64_t length);
+    void (*mul)(double_t* out, double_t const* lhs, double_t const* rhs,
+        int64_t length);
+    void (*scale)(
+        double_t* out, double_t const* lhs, double_t factor, int64_t length);
+    void (*fma)(double_t* out, double_t const* a, double_t const* b,
+        double_t const* c, int64_t length);
+    double_t (*sum)(double_t const* values, int64_t length);
+    double_t (*dot)(double_t const* lhs, double_t const* rhs, int64_t length);
+} VectorKernels;
+
+// every heap object starts with a header, and PR_PTR and heap PR_ARRAY
+// words point just past it: at size bytes of fields for objects made by
+// alloc, at a PyriteArray for the arrays the vector instructions make. a
+// collection that copies an object turns the original into HEAP_FORWARDED,
+// with forward pointing at the copy's payload.
+typedef enum {
+    HEAP_OBJECT,
+    HEAP_ARRAY,
+    HEAP_FORWARDED,
+} HeapKind;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t remembered;
+    union {
+        uint64_t size;
+        void* forward;
+    };
+} HeapHeader;
+
+// the old generation is a list of these, filled in order so a collection
+// can scan what it copied by walking from where it started.
+typedef struct HeapBlock {
+    struct HeapBlock* next;
+    size_t used;
+    size_t cap;
+    _Alignas(16) uint8_t data[];
+} HeapBlock;
+
+// pause times are in nanoseconds. the histogram counts pauses by the
+// power of two microseconds below their length, the first bucket holds
+// everything under 2us and the last everything longer.
+typedef struct {
+    uint64_t minor_collections;
+    uint64_t major_collections;
+    uint64_t allocated_bytes;
+    uint64_t copied_bytes;
+    uint64_t pause_total;
+    uint64_t pause_max;
+    uint64_t pauses[32];
+} HeapStats;
+
+// a generational heap owned by one vm, so whichever thread runs the vm
+// allocates without any locking. objects are bump allocated in the
+// nursery, and when it fills a minor collection copies the live ones into
+// the old generation. the roots are the words on the stack plus the
+// remembered set, the old objects a store gave a nursery pointer. once
+// the old generation outgrows major_threshold a major collection copies
+// everything live into fresh blocks. the nursery is only allocated on the
+// first allocation, programs that never allocate pay nothing for it.
+typedef struct {
+    uint8_t* nursery;
+    uint8_t* nursery_top;
+    uint8_t* nursery_end;
+
+    HeapBlock* old_first;
+    HeapBlock* old_last;
+    size_t old_bytes;
+    size_t major_threshold;
+
+    // blocks a major collection emptied, kept for the old generation to
+    // grow back into without touching fresh memory.
+    HeapBlock* spare_blocks;
+
+    // the old block a restored snapshot mapped, which goes back with
+    // munmap rather than free.
+    HeapBlock* mapped_block;
+    size_t mapped_size;
+
+    HeapHeader** remembered;
+    int32_t remembered_count;
+    int32_t remembered_cap;
+
+    HeapStats stats;
+} VmHeap;
+
+static inline HeapHeader* heap_header(void const* payload)
+{
+    return (HeapHeader*)payload - 1;
+}
+
+static inline bool heap_in_nursery(VmHeap const* heap, void const* payload)
+{
+    return (uintptr_t)payload >= (uintptr_t)heap->nursery
+        && (uintptr_t)payload < (uintptr_t)heap->nursery_top;
+}
+
+// an old block copied into a HeapImage and where its data starts in the
+// image's.
+typedef struct {
+    HeapBlock const* block;
+    size_t offset;
+} HeapImageSource;
+
+// the live heap laid out as a single old generation block, ready to be
+// mapped at address. pointers between the objects in it already point
+// where the objects sit once it is mapped there. relocations lists the
+// offset into block of every pointer field, with bit 0 set for those into
+// the constant pool, so a mapping anywhere else can be fixed up without
+// reading the whole image.
+typedef struct {
+    HeapBlock* block;
+    size_t size;
+    uintptr_t address;
+
+    uint64_t* relocations;
+    int64_t relocation_count;
+    int64_t relocation_cap;
+
+    // the old blocks the objects were copied from, sorted by address.
+    HeapImageSource* sources;
+    int32_t source_count;
+} HeapImage;
+
+// fixed size form of an instruction, produced once at load time so the
+// interpreter never decodes operands byte by byte.
+typedef struct {
+    PyriteInstruction opcode;
+    PyriteValue operand;
+} DecodedInstruction;
+
 typedef struct {
     uint8_t* program;
     int32_t program_length;
-    int32_t program_counter;
+    bool aligned_operands; // v2 code, see pyrite_operand_offset.
+
+    DecodedInstruction* code;
+    int32_t code_length;
+    int32_t program_counter; // index into code.
+    bool halted;
 
-    Word stack[STACK_CAP];
+    Word* stack;
+    int32_t stack_cap;
     int32_t stack_pointer;
     int32_t base_pointer;
 
-    char** string_literals;
+    PyriteOutput output;
+
+    // when set, a runtime error stores its message in error and jumps here
+    // instead of ending the process, so one batch job can fail on its own.
+    jmp_buf* error_jump;
+    char const* error;
+
+#ifdef PYRITE_PROFILE
+    VmProfile* profile;
+#endif
+
+    // filled in by vm_verify. max_frame_depth is the most a call adds to
+    // the stack, its frame included.
+    int32_t max_stack_depth;
+    int32_t max_frame_depth;
+    bool verified;
+
+    // native code from vm_jit_compile, executed by vm_execute when present.
+    void* jit_code;
+    size_t jit_code_size;
+
+    // set when program points into a read only mapping of the input file
+    // rather than a buffer the vm owns. path is that file's absolute path.
+    void* mapping;
+    size_t mapping_size;
+    char* path;
+
+    // types of the inputs the stack started out with, the program was
+    // verified and compiled against exactly these.
+    PyriteValueType* input_types;
+    int32_t input_count;
+
+    // set on vms made by vm_clone. they borrow program, code, jit code and
+    // input types from the vm they were cloned from, which has to outlive
+    // them, and own only their stack, output and heap.
+    bool shared;
+
+    // the constant pool, read straight out of the mapping. every entry is
+    // 8 bytes, an int, a double or, for strings and arrays, an offset into
+    // the bytes that follow, and literals resolves those offsets once.
+    // entries of other types have a NULL literal. arrays outside of the
+    // pool's bytes are on the heap.
+    PyriteValue const* constants;
+    uint8_t const* constant_types;
+    int32_t constant_count;
+    void const** literals;
+    uint8_t const* pool;
+    size_t pool_size;
+
+    VmHeap heap;
+    VectorKernels const* vector;
 } VirtualMachine;
 
 void vm_init(VirtualMachine* vm, uint8_t* program, uint32_t program_length);
 void vm_init_from_file(VirtualMachine* vm, const char* file);
+
+// the _with_inputs forms start the program with inputs already pushed, in
+// order, so the last input is on top of the stack.
+void vm_init_with_inputs(VirtualMachine* vm, uint8_t* program,
+    uint32_t program_length, Word const* inputs, int32_t input_count);
+void vm_init_from_file_with_inputs(VirtualMachine* vm, const char* file,
+    Word const* inputs, int32_t input_count);
+
+// a fresh vm running the program already loaded into source, without decoding
+// or verifying it again. inputs whose types differ from the ones source was
+// verified with are fine, that clone just runs on the checked interpreter.
+void vm_clone(VirtualMachine* vm, VirtualMachine const* source,
+    Word const* inputs, int32_t input_count);
+
 void vm_free(VirtualMachine* vm);
 void vm_execute(VirtualMachine* vm);
+
+// makes room for at least slots words on the stack.
+void vm_reserve_stack(VirtualMachine* vm, int64_t slots);
+
+// writes everything needed to carry on from where vm stands to file: a
+// reference to the program file, the registers, the stack and the live
+// heap, which a full collection compacts first. only vms loaded from a
+// file can be snapshotted. vm_restore loads the program again and maps the
+// heap copy-on-write, so it costs about as much as vm_init_from_file
+// whatever the heap holds. the result runs on like the snapshotted vm.
+void vm_snapshot(VirtualMachine* vm, char const* file);
+void vm_restore(VirtualMachine* vm, char const* file);
+
+// runs at most budget instructions and returns whether the program halted.
+// otherwise the vm is left exactly where it stopped and the next call
+// carries on from there. budgeted runs never use the jit.
+bool vm_execute_for(VirtualMachine* vm, int64_t budget);
+
+// one run of a batch. output receives everything the run printed.
+typedef struct {
+    Word* inputs;
+    int32_t input_count;
+
+    char* output;
+    size_t output_length;
+    bool done;
+} VmJob;
+
+// runs every job against the program loaded into vm on thread_count threads
+// and writes their output to vm's output in job order. a runtime error ends
+// only its own job, it is reported on stderr and the output the job printed
+// before it is kept.
+void vm_run_batch(
+    VirtualMachine* vm, VmJob* jobs, int32_t job_count, int32_t thread_count);
+
+// like vm_run_batch, but the threads take turns over the live jobs, running
+// each for slice instructions at a time so a long job cannot hold a thread
+// to itself. with fuel_limit above zero a job is stopped, and reported on
+// stderr, once it has run that many instructions.
+void vm_run_batch_sliced(VirtualMachine* vm, VmJob* jobs, int32_t job_count,
+    int32_t thread_count, int64_t slice, int64_t fuel_limit);
+
+// checks the decoded program once at load time: stack depth and the operand
+// types at every instruction. malformed programs are reported on stderr and
+// rejected, well formed ones are marked verified and run without any per
+// instruction checks. a program with calls the verifier cannot follow is not
+// rejected, it stays unverified and runs checked.
+bool vm_verify(VirtualMachine* vm);
+
+// translates a verified program into x86-64 code. returns false when the
+// program or the host is not supported, vm_execute then keeps interpreting.
+bool vm_jit_compile(VirtualMachine* vm);
+void vm_jit_execute(VirtualMachine* vm);
+void vm_jit_free(VirtualMachine* vm);
+
+// the kernels for this cpu. setting PYRITE_SCALAR_VECTORS in the environment
+// forces the plain loops.
+VectorKernels const* vm_vector_kernels(void);
+
+void vm_heap_init(VmHeap* heap);
+void vm_heap_free(VmHeap* heap);
+
+// the payload of a new object of size bytes, which the caller fills in.
+// this may run a collection, which moves every heap object the stack
+// refers to, so pointers into the heap held anywhere else go stale.
+void* vm_heap_alloc(VirtualMachine* vm, HeapKind kind, size_t size);
+
+// adds an old object to the remembered set, see vm_heap_write_barrier.
+void vm_heap_remember(VmHeap* heap, HeapHeader* header);
+
+// store calls this after writing value into a field of the object at
+// fields, so that old objects pointing into the nursery are roots.
+static inline void vm_heap_write_barrier(
+    VmHeap* heap, void const* fields, Word value)
+{
+    PyriteValueType type = word_type(value);
+    if (type != PR_PTR && type != PR_ARRAY)
+        return;
+
+    if (heap_in_nursery(heap, fields)
+        || !heap_in_nursery(heap, word_as_array(value)))
+        return;
+
+    HeapHeader* header = heap_header(fields);
+    if (!header->remembered)
+        vm_heap_remember(heap, header);
+}
+
+void vm_heap_merge_stats(HeapStats* total, HeapStats const* stats);
+
+// collects the whole heap and copies what is live into image, see
+// HeapImage. vm_heap_image_word rewrites a word from the stack the way the
+// pointers in the image were.
+void vm_heap_image(VirtualMachine* vm, HeapImage* image);
+Word vm_heap_image_word(HeapImage const* image, Word word);
+void vm_heap_image_free(HeapImage* image);
+
+// makes a mapped image, mapping_size bytes at block, the heap's old
+// generation. the heap has to be empty.
+void vm_heap_adopt(VmHeap* heap, HeapBlock* block, size_t mapping_size);
+
+// summarises the collections and their pauses on stderr, run_seconds is
+// how long the program ran in total.
+void vm_heap_report(HeapStats const* stats, double run_seconds);
+
+#ifdef PYRITE_PROFILE
+VmProfile* vm_profile_make(int32_t code_length);
+void vm_profile_free(VmProfile* profile);
+void vm_profile_instruction(
+    VmProfile* profile, int32_t pc, PyriteInstruction opcode);
+
+// adds the counts and clocks of from to into, both of the same program.
+void vm_profile_merge(VmProfile* into, VmProfile const* from);
+
+// writes the profile as json to $PYRITE_PROFILE_OUTPUT, or
+// pyrite-profile.json when that is not set.
+void vm_profile_report(VirtualMachine* vm);
+#endif
+
+// formats like printf's "%ld\n" and "%lf\n", byte for byte, into the vm's
+// output buffer. vm_execute flushes it when the program halts.
+void vm_print_word(VirtualMachine* vm, Word word);
+void vm_write_output(VirtualMachine* vm, char const* bytes, size_t length);
+void vm_flush_output(VirtualMachine* vm);
+char const* instruction_name(PyriteInstruction instruction);
+
+// fails the integer division at the current instruction, a zero divisor or
+// INT64_MIN / -1, the way the interpreter does. the jit calls it too.
+void vm_division_error(VirtualMachine* vm, int64_t divisor);
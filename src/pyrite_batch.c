@@ -0,0 +1,436 @@
+#include "pyrite.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// time sliced batches keep at most this many jobs alive at once, every live
+// job holds a vm with its own stack and heap, so admitting all of them up
+// front would not scale.
+#define SCHEDULER_WINDOW 1024
+
+// every worker owns a contiguous range of job indices, packed into one word
+// as (top << 32) | bottom so it can be split with a single compare and swap.
+// the owner takes jobs from the top, which keeps the jobs in flight close to
+// the one the writer is waiting for, and a worker that runs dry steals the
+// upper half of somebody else's range.
+typedef struct {
+    _Atomic uint64_t range;
+    pthread_t thread;
+    int32_t index;
+    struct Batch* batch;
+} BatchWorker;
+
+typedef struct Batch {
+    VirtualMachine* vm;
+    VmJob* jobs;
+    int32_t job_count;
+
+    BatchWorker* workers;
+    int32_t worker_count;
+
+    // the writer sleeps until next_output is done, guarded by lock.
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+    int32_t next_output;
+
+    // time slicing, also guarded by lock. runnable jobs wait in a ring and
+    // go back to its end after every slice.
+    pthread_cond_t runnable;
+    int32_t queue[SCHEDULER_WINDOW];
+    int32_t queue_head;
+    int32_t queue_length;
+    int32_t next_job; // first job not admitted yet.
+    int32_t live; // admitted jobs that have not finished.
+
+    VirtualMachine** vms;
+    int64_t* fuel_used;
+    int64_t slice;
+    int64_t fuel_limit;
+} Batch;
+
+static uint64_t range_make(uint32_t top, uint32_t bottom)
+{
+    return (uint64_t)top << 32 | bottom;
+}
+
+static uint32_t range_top(uint64_t range)
+{
+    return range >> 32;
+}
+
+static uint32_t range_bottom(uint64_t range)
+{
+    return (uint32_t)range;
+}
+
+static bool take_job(BatchWorker* worker, int32_t* job)
+{
+    uint64_t range = atomic_load(&worker->range);
+
+    for (;;) {
+        uint32_t top = range_top(range);
+        uint32_t bottom = range_bottom(range);
+        if (top >= bottom)
+            return false;
+
+        if (atomic_compare_exchange_weak(
+                &worker->range, &range, range_make(top + 1, bottom))) {
+            *job = top;
+            return true;
+        }
+    }
+}
+
+// only ever called with the thief's own range empty, so nobody else can be
+// taking from it while it is replaced.
+static bool steal_jobs(BatchWorker* thief)
+{
+    Batch* batch = thief->batch;
+
+    for (int32_t i = 1; i < batch->worker_count; i++) {
+        BatchWorker* victim
+            = &batch->workers[(thief->index + i) % batch->worker_count];
+        uint64_t range = atomic_load(&victim->range);
+
+        for (;;) {
+            uint32_t top = range_top(range);
+            uint32_t bottom = range_bottom(range);
+            if (top >= bottom)
+                break;
+
+            uint32_t split = bottom - (bottom - top + 1) / 2;
+            if (atomic_compare_exchange_weak(
+                    &victim->range, &range, range_make(top, split))) {
+                atomic_store(&thief->range, range_make(split, bottom));
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// hands the captured output of a finished job to the writer, and adds its
+// collections, and its profile in profiling builds, to the batch vm's.
+static void finish_job(Batch* batch, VirtualMachine* vm, int32_t index)
+{
+    VmJob* job = &batch->jobs[index];
+
+    char* output = vm->output.buffer;
+    size_t output_length = vm->output.length;
+    HeapStats stats = vm->heap.stats;
+
+    vm->output.buffer = NULL;
+    vm->output.length = 0;
+#ifdef PYRITE_PROFILE
+    VmProfile* profile = vm->profile;
+    vm->profile = NULL;
+#endif
+    vm_free(vm);
+
+    pthread_mutex_lock(&batch->lock);
+    vm_heap_merge_stats(&batch->vm->heap.stats, &stats);
+#ifdef PYRITE_PROFILE
+    vm_profile_merge(batch->vm->profile, profile);
+#endif
+    job->output = output;
+    job->output_length = output_length;
+    job->done = true;
+    if (index == batch->next_output)
+        pthread_cond_signal(&batch->job_done);
+    pthread_mutex_unlock(&batch->lock);
+
+#ifdef PYRITE_PROFILE
+    vm_profile_free(profile);
+#endif
+}
+
+static void start_job(Batch* batch, VirtualMachine* vm, int32_t index)
+{
+    VmJob* job = &batch->jobs[index];
+    vm_clone(vm, batch->vm, job->inputs, job->input_count);
+    vm->output.fd = -1;
+}
+
+// a runtime error ends only the job it happened in. whatever the job printed
+// before it is still written out, in its place among the others.
+static void report_error(VirtualMachine* vm, int32_t index)
+{
+    fprintf(stderr, "ERROR: job %d: %s at instruction %d\n", index + 1,
+        vm->error, vm->program_counter);
+}
+
+static void run_job(Batch* batch, VirtualMachine* vm, int32_t index)
+{
+    jmp_buf error_jump;
+
+    start_job(batch, vm, index);
+    vm->error_jump = &error_jump;
+    if (setjmp(error_jump) == 0)
+        vm_execute(vm);
+    else
+        report_error(vm, index);
+
+    finish_job(batch, vm, index);
+}
+
+static void* run_worker(void* argument)
+{
+    BatchWorker* worker = argument;
+
+    // every job runs on a fresh clone in the same slot, its stack and heap
+    // are allocated and released by vm_clone and vm_free.
+    VirtualMachine vm;
+
+    int32_t job;
+    for (;;) {
+        if (take_job(worker, &job)) {
+            run_job(worker->batch, &vm, job);
+        } else if (!steal_jobs(worker)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void queue_push(Batch* batch, int32_t index)
+{
+    int32_t tail = (batch->queue_head + batch->queue_length) % SCHEDULER_WINDOW;
+    batch->queue[tail] = index;
+    batch->queue_length += 1;
+}
+
+static int32_t queue_pop(Batch* batch)
+{
+    int32_t index = batch->queue[batch->queue_head];
+    batch->queue_head = (batch->queue_head + 1) % SCHEDULER_WINDOW;
+    batch->queue_length -= 1;
+    return index;
+}
+
+// a job that hits a runtime error counts as halted.
+static bool execute_slice(VirtualMachine* vm, int32_t index, int64_t slice)
+{
+    jmp_buf error_jump;
+    bool halted = true;
+
+    vm->error_jump = &error_jump;
+    if (setjmp(error_jump) == 0)
+        halted = vm_execute_for(vm, slice);
+    else
+        report_error(vm, index);
+
+    vm->error_jump = NULL;
+    return halted;
+}
+
+// runs one slice of the job and reports whether it is finished, either
+// because it halted or because it used up its fuel.
+static bool run_slice(Batch* batch, int32_t index)
+{
+    VirtualMachine* vm = batch->vms[index];
+    if (!vm) {
+        vm = malloc(sizeof(*vm));
+        if (!vm) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        start_job(batch, vm, index);
+        batch->vms[index] = vm;
+    }
+
+    int64_t slice = batch->slice;
+    if (batch->fuel_limit > 0
+        && batch->fuel_limit - batch->fuel_used[index] < slice)
+        slice = batch->fuel_limit - batch->fuel_used[index];
+
+    bool halted = execute_slice(vm, index, slice);
+    batch->fuel_used[index] += slice;
+
+    if (!halted && batch->fuel_limit > 0
+        && batch->fuel_used[index] >= batch->fuel_limit) {
+        fprintf(stderr, "ERROR: job %d ran out of fuel after %ld instructions\n",
+            index + 1, batch->fuel_used[index]);
+        halted = true;
+    }
+
+    if (!halted)
+        return false;
+
+    finish_job(batch, vm, index);
+    free(vm);
+    batch->vms[index] = NULL;
+    return true;
+}
+
+static void* run_sliced_worker(void* argument)
+{
+    BatchWorker* worker = argument;
+    Batch* batch = worker->batch;
+
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (batch->live < SCHEDULER_WINDOW
+            && batch->next_job < batch->job_count) {
+            queue_push(batch, batch->next_job++);
+            batch->live += 1;
+        }
+
+        if (batch->queue_length == 0) {
+            if (batch->live == 0)
+                break;
+
+            pthread_cond_wait(&batch->runnable, &batch->lock);
+            continue;
+        }
+
+        int32_t index = queue_pop(batch);
+        pthread_mutex_unlock(&batch->lock);
+
+        bool finished = run_slice(batch, index);
+
+        pthread_mutex_lock(&batch->lock);
+        if (finished) {
+            batch->live -= 1;
+            pthread_cond_broadcast(&batch->runnable);
+        } else {
+            queue_push(batch, index);
+            pthread_cond_signal(&batch->runnable);
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    // wake whoever is still waiting so it sees there is nothing left.
+    pthread_cond_broadcast(&batch->runnable);
+    return NULL;
+}
+
+static void run_batch(Batch* batch, void* (*worker_main)(void*))
+{
+    VmJob* jobs = batch->jobs;
+    int32_t job_count = batch->job_count;
+    int32_t thread_count = batch->worker_count;
+
+    batch->workers = malloc(sizeof(BatchWorker) * thread_count);
+    if (!batch->workers) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->job_done, NULL);
+    pthread_cond_init(&batch->runnable, NULL);
+
+    for (int32_t i = 0; i < job_count; i++) {
+        jobs[i].output = NULL;
+        jobs[i].output_length = 0;
+        jobs[i].done = false;
+    }
+
+    for (int32_t i = 0; i < thread_count; i++) {
+        BatchWorker* worker = &batch->workers[i];
+        worker->index = i;
+        worker->batch = batch;
+        atomic_init(&worker->range,
+            range_make((int64_t)job_count * i / thread_count,
+                (int64_t)job_count * (i + 1) / thread_count));
+    }
+
+    for (int32_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&batch->workers[i].thread, NULL, worker_main,
+                &batch->workers[i])
+            != 0) {
+            fprintf(stderr, "ERROR: cannot start batch worker\n");
+            exit(1);
+        }
+    }
+
+    // write out each job as soon as it and every job before it are done.
+    for (int32_t i = 0; i < job_count; i++) {
+        pthread_mutex_lock(&batch->lock);
+        batch->next_output = i;
+        while (!jobs[i].done)
+            pthread_cond_wait(&batch->job_done, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+
+        if (jobs[i].output_length > 0)
+            vm_write_output(batch->vm, jobs[i].output, jobs[i].output_length);
+        free(jobs[i].output);
+        jobs[i].output = NULL;
+    }
+
+    for (int32_t i = 0; i < thread_count; i++)
+        pthread_join(batch->workers[i].thread, NULL);
+
+    vm_flush_output(batch->vm);
+#ifdef PYRITE_PROFILE
+    vm_profile_report(batch->vm);
+#endif
+
+    pthread_cond_destroy(&batch->runnable);
+    pthread_cond_destroy(&batch->job_done);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->workers);
+}
+
+static int32_t clamp_threads(int32_t thread_count, int32_t job_count)
+{
+    if (thread_count > job_count)
+        thread_count = job_count;
+
+    return thread_count < 1 ? 1 : thread_count;
+}
+
+void vm_run_batch(
+    VirtualMachine* vm, VmJob* jobs, int32_t job_count, int32_t thread_count)
+{
+    Batch* batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    batch->vm = vm;
+    batch->jobs = jobs;
+    batch->job_count = job_count;
+    batch->worker_count = clamp_threads(thread_count, job_count);
+
+    run_batch(batch, run_worker);
+    free(batch);
+}
+
+void vm_run_batch_sliced(VirtualMachine* vm, VmJob* jobs, int32_t job_count,
+    int32_t thread_count, int64_t slice, int64_t fuel_limit)
+{
+    Batch* batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    batch->vm = vm;
+    batch->jobs = jobs;
+    batch->job_count = job_count;
+    batch->worker_count = clamp_threads(thread_count, job_count);
+
+    batch->vms = calloc(job_count + 1, sizeof(VirtualMachine*));
+    batch->fuel_used = calloc(job_count + 1, sizeof(int64_t));
+    if (!batch->vms || !batch->fuel_used) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    batch->slice = slice > 0 ? slice : 1;
+    batch->fuel_limit = fuel_limit;
+
+    run_batch(batch, run_sliced_worker);
+
+    free(batch->fuel_used);
+    free(batch->vms);
+    free(batch);
+}
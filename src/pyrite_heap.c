@@ -0,0 +1,526 @@
+#include "pyrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// the nursery fits in a typical l2 cache, so allocation and the minor
+// collections that empty it stay out of main memory.
+#define NURSERY_SIZE (1024 * 1024)
+
+// objects this big go straight to the old generation, copying them out of
+// the nursery would cost more than it saves.
+#define LARGE_OBJECT_SIZE (NURSERY_SIZE / 8)
+
+#define OLD_BLOCK_SIZE (1024 * 1024)
+
+// a major collection runs once the old generation is this big, or twice
+// what survived the last one if that is more.
+#define MAJOR_THRESHOLD_MIN (8 * 1024 * 1024)
+
+// headers and payloads are 16 byte aligned, so every word in an object is.
+static size_t object_size(size_t payload_size)
+{
+    return sizeof(HeapHeader) + ((payload_size + 15) & ~(size_t)15);
+}
+
+static void* allocate(size_t size)
+{
+    void* memory = malloc(size);
+    if (!memory) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return memory;
+}
+
+void vm_heap_init(VmHeap* heap)
+{
+    memset(heap, 0, sizeof(*heap));
+    heap->major_threshold = MAJOR_THRESHOLD_MIN;
+}
+
+static void release_block(VmHeap* heap, HeapBlock* block)
+{
+    if (block == heap->mapped_block) {
+        munmap(block, heap->mapped_size);
+        heap->mapped_block = NULL;
+    } else {
+        free(block);
+    }
+}
+
+static void free_blocks(VmHeap* heap, HeapBlock* block)
+{
+    while (block) {
+        HeapBlock* next = block->next;
+        release_block(heap, block);
+        block = next;
+    }
+}
+
+void vm_heap_free(VmHeap* heap)
+{
+    free(heap->nursery);
+    free_blocks(heap, heap->old_first);
+    free_blocks(heap, heap->spare_blocks);
+    free(heap->remembered);
+}
+
+// bump allocates total bytes in the last old block, or in a new one when
+// they do not fit. blocks are only ever appended, in allocation order.
+static HeapHeader* old_alloc(VmHeap* heap, size_t total)
+{
+    HeapBlock* block = heap->old_last;
+    if (!block || block->cap - block->used < total) {
+        if (heap->spare_blocks && total <= OLD_BLOCK_SIZE) {
+            block = heap->spare_blocks;
+            heap->spare_blocks = block->next;
+        } else {
+            size_t cap = total > OLD_BLOCK_SIZE ? total : OLD_BLOCK_SIZE;
+            block = allocate(sizeof(HeapBlock) + cap);
+            block->cap = cap;
+        }
+
+        block->next = NULL;
+        block->used = 0;
+
+        if (heap->old_last) {
+            heap->old_last->next = block;
+        } else {
+            heap->old_first = block;
+        }
+        heap->old_last = block;
+    }
+
+    HeapHeader* header = (HeapHeader*)(block->data + block->used);
+    block->used += total;
+    heap->old_bytes += total;
+    return header;
+}
+
+void vm_heap_remember(VmHeap* heap, HeapHeader* header)
+{
+    if (heap->remembered_count == heap->remembered_cap) {
+        heap->remembered_cap
+            = heap->remembered_cap ? heap->remembered_cap * 2 : 64;
+        heap->remembered = realloc(heap->remembered,
+            sizeof(HeapHeader*) * heap->remembered_cap);
+        if (!heap->remembered) {
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    header->remembered = 1;
+    heap->remembered[heap->remembered_count++] = header;
+}
+
+typedef struct {
+    VmHeap* heap;
+    VirtualMachine* vm;
+    bool major;
+} Collection;
+
+// a minor collection only moves what is in the nursery, a major one every
+// heap object, which is anything that is not an array in the constant
+// pool.
+static bool moves(Collection* collection, void const* payload)
+{
+    if (!collection->major)
+        return heap_in_nursery(collection->heap, payload);
+
+    uint8_t const* pool = collection->vm->pool;
+    return (uintptr_t)payload < (uintptr_t)pool
+        || (uintptr_t)payload
+        >= (uintptr_t)(pool + collection->vm->pool_size);
+}
+
+// copies the object into the old generation the first time it is reached
+// and returns where it lives now.
+static void* evacuate(VmHeap* heap, void const* payload)
+{
+    HeapHeader* header = heap_header(payload);
+    if (header->kind == HEAP_FORWARDED)
+        return header->forward;
+
+    size_t total = object_size(header->size);
+    HeapHeader* copy = old_alloc(heap, total);
+    memcpy(copy, header, total);
+    copy->remembered = 0;
+
+    header->kind = HEAP_FORWARDED;
+    header->forward = copy + 1;
+    heap->stats.copied_bytes += total;
+    return copy + 1;
+}
+
+static void visit(Collection* collection, Word* word)
+{
+    PyriteValueType type = word_type(*word);
+    if (type != PR_PTR && type != PR_ARRAY)
+        return;
+
+    void const* payload = word_as_array(*word);
+    if (!moves(collection, payload))
+        return;
+
+    void* moved = evacuate(collection->heap, payload);
+    *word = type == PR_PTR ? word_make_ptr(moved) : word_make_array(moved);
+}
+
+static void visit_fields(Collection* collection, HeapHeader* header)
+{
+    if (header->kind != HEAP_OBJECT)
+        return;
+
+    Word* fields = (Word*)(header + 1);
+    for (size_t i = 0; i < header->size / sizeof(Word); i++)
+        visit(collection, &fields[i]);
+}
+
+static void visit_stack(Collection* collection)
+{
+    VirtualMachine* vm = collection->vm;
+    for (int32_t i = 0; i <= vm->stack_pointer; i++)
+        visit(collection, &vm->stack[i]);
+}
+
+// the objects copied so far are the unscanned part of the old generation
+// from block at offset on. scanning them copies what they point to in
+// turn, after them, until everything reachable has been copied.
+static void scan_copies(
+    Collection* collection, HeapBlock* block, size_t offset)
+{
+    for (; block; block = block->next, offset = 0) {
+        while (offset < block->used) {
+            HeapHeader* header = (HeapHeader*)(block->data + offset);
+            visit_fields(collection, header);
+            offset += object_size(header->size);
+        }
+    }
+}
+
+static void collect_minor(VirtualMachine* vm)
+{
+    VmHeap* heap = &vm->heap;
+    Collection collection = { .heap = heap, .vm = vm, .major = false };
+
+    HeapBlock* start = heap->old_last;
+    size_t offset = start ? start->used : 0;
+
+    visit_stack(&collection);
+    for (int32_t i = 0; i < heap->remembered_count; i++) {
+        heap->remembered[i]->remembered = 0;
+        visit_fields(&collection, heap->remembered[i]);
+    }
+    heap->remembered_count = 0;
+
+    scan_copies(&collection, start ? start : heap->old_first, offset);
+
+    heap->nursery_top = heap->nursery;
+    heap->stats.minor_collections++;
+}
+
+// runs right after a minor collection, so the nursery is empty and every
+// live object is old.
+static void collect_major(VirtualMachine* vm)
+{
+    VmHeap* heap = &vm->heap;
+    Collection collection = { .heap = heap, .vm = vm, .major = true };
+
+    HeapBlock* from = heap->old_first;
+    heap->old_first = NULL;
+    heap->old_last = NULL;
+    heap->old_bytes = 0;
+
+    visit_stack(&collection);
+    scan_copies(&collection, heap->old_first, 0);
+
+    heap->major_threshold = heap->old_bytes * 2 > MAJOR_THRESHOLD_MIN
+        ? heap->old_bytes * 2
+        : MAJOR_THRESHOLD_MIN;
+    heap->stats.major_collections++;
+
+    // keep as many regular blocks as it takes to reach the next major
+    // collection, large objects' blocks and the rest go back to malloc.
+    size_t spare = (heap->major_threshold - heap->old_bytes) / OLD_BLOCK_SIZE;
+    while (from) {
+        HeapBlock* next = from->next;
+        if (spare > 0 && from != heap->mapped_block
+            && from->cap == OLD_BLOCK_SIZE) {
+            from->next = heap->spare_blocks;
+            heap->spare_blocks = from;
+            spare--;
+        } else {
+            release_block(heap, from);
+        }
+        from = next;
+    }
+}
+
+static uint64_t now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// one pause: a minor collection, followed by a major one when full is set,
+// the old generation has grown past its threshold or reserve more would
+// take it there.
+static void collect(VirtualMachine* vm, size_t reserve, bool full)
+{
+    VmHeap* heap = &vm->heap;
+    uint64_t start = now();
+
+    collect_minor(vm);
+    if (full || heap->old_bytes + reserve > heap->major_threshold)
+        collect_major(vm);
+
+    uint64_t pause = now() - start;
+    HeapStats* stats = &heap->stats;
+    stats->pause_total += pause;
+    if (pause > stats->pause_max)
+        stats->pause_max = pause;
+    uint64_t micros = pause / 1000;
+    int32_t bucket = micros < 2 ? 0 : 63 - __builtin_clzll(micros);
+    stats->pauses[bucket < 32 ? bucket : 31]++;
+}
+
+void* vm_heap_alloc(VirtualMachine* vm, HeapKind kind, size_t size)
+{
+    VmHeap* heap = &vm->heap;
+    size_t total = object_size(size);
+    heap->stats.allocated_bytes += total;
+
+    HeapHeader* header;
+    if (total > LARGE_OBJECT_SIZE) {
+        if (heap->old_bytes + total > heap->major_threshold)
+            collect(vm, total, false);
+
+        header = old_alloc(heap, total);
+    } else {
+        if (!heap->nursery) {
+            heap->nursery = allocate(NURSERY_SIZE);
+            heap->nursery_top = heap->nursery;
+            heap->nursery_end = heap->nursery + NURSERY_SIZE;
+        } else if ((size_t)(heap->nursery_end - heap->nursery_top) < total) {
+            collect(vm, 0, false);
+        }
+
+        header = (HeapHeader*)heap->nursery_top;
+        heap->nursery_top += total;
+    }
+
+    header->kind = kind;
+    header->remembered = 0;
+    header->size = size;
+    return header + 1;
+}
+
+void vm_heap_merge_stats(HeapStats* total, HeapStats const* stats)
+{
+    total->minor_collections += stats->minor_collections;
+    total->major_collections += stats->major_collections;
+    total->allocated_bytes += stats->allocated_bytes;
+    total->copied_bytes += stats->copied_bytes;
+    total->pause_total += stats->pause_total;
+    if (stats->pause_max > total->pause_max)
+        total->pause_max = stats->pause_max;
+
+    for (int32_t i = 0; i < 32; i++)
+        total->pauses[i] += stats->pauses[i];
+}
+
+void vm_heap_report(HeapStats const* stats, double run_seconds)
+{
+    uint64_t collections = stats->minor_collections;
+    double mib = 1024.0 * 1024.0;
+
+    fprintf(stderr,
+        "gc: %lu minor and %lu major collections, %.1f MiB allocated, "
+        "%.1f MiB copied\n",
+        stats->minor_collections, stats->major_collections,
+        stats->allocated_bytes / mib, stats->copied_bytes / mib);
+
+    if (collections == 0)
+        return;
+
+    double total_ms = stats->pause_total / 1e6;
+    fprintf(stderr,
+        "gc: paused %.3f ms in total, %.3f ms on average, %.3f ms at most\n",
+        total_ms, total_ms / collections, stats->pause_max / 1e6);
+
+    if (run_seconds > 0)
+        fprintf(stderr, "gc: %.2f%% of the %.3f ms run\n",
+            100.0 * total_ms / (run_seconds * 1e3), run_seconds * 1e3);
+
+    if (stats->pauses[0] > 0)
+        fprintf(stderr, "gc: %lu pauses under 2 us\n", stats->pauses[0]);
+
+    for (int32_t i = 1; i < 32; i++) {
+        if (stats->pauses[i] > 0)
+            fprintf(stderr, "gc: %lu pauses of %lu to %lu us\n",
+                stats->pauses[i], UINT64_C(1) << i, UINT64_C(1) << (i + 1));
+    }
+}
+
+static int compare_sources(void const* lhs, void const* rhs)
+{
+    uintptr_t left = (uintptr_t)((HeapImageSource const*)lhs)->block;
+    uintptr_t right = (uintptr_t)((HeapImageSource const*)rhs)->block;
+    return (left > right) - (left < right);
+}
+
+static void add_relocation(HeapImage* image, uint64_t relocation)
+{
+    if (image->relocation_count == image->relocation_cap) {
+        image->relocation_cap
+            = image->relocation_cap ? image->relocation_cap * 2 : 64;
+        image->relocations = realloc(image->relocations,
+            sizeof(uint64_t) * image->relocation_cap);
+        if (!image->relocations) {
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    image->relocations[image->relocation_count++] = relocation;
+}
+
+void vm_heap_image(VirtualMachine* vm, HeapImage* image)
+{
+    VmHeap* heap = &vm->heap;
+    memset(image, 0, sizeof(*image));
+
+    // after a full collection the old generation holds only live objects,
+    // back to back.
+    if (heap->nursery || heap->old_first)
+        collect(vm, 0, true);
+
+    if (heap->old_bytes == 0)
+        return;
+
+    image->size = sizeof(HeapBlock) + heap->old_bytes;
+    image->block = allocate(image->size);
+    image->block->next = NULL;
+    image->block->used = heap->old_bytes;
+    image->block->cap = heap->old_bytes;
+
+    // a range the kernel would hand out here is almost certainly free in
+    // the process that restores the image too, mmap addresses being
+    // randomised, and mapping it there needs no heap relocations at all. a
+    // page to either side keeps it clear of every mapping of this process,
+    // so no pointer into one of them can be mistaken for one into it.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t reserved = image->size + 2 * page;
+    uint8_t* range = mmap(
+        NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (range != MAP_FAILED) {
+        image->address = (uintptr_t)(range + page);
+        munmap(range, reserved);
+    }
+
+    for (HeapBlock* block = heap->old_first; block; block = block->next)
+        image->source_count++;
+
+    image->sources = allocate(sizeof(HeapImageSource) * image->source_count);
+
+    size_t offset = 0;
+    int32_t index = 0;
+    for (HeapBlock* block = heap->old_first; block; block = block->next) {
+        image->sources[index++] = (HeapImageSource) { block, offset };
+        memcpy(image->block->data + offset, block->data, block->used);
+        offset += block->used;
+    }
+
+    qsort(image->sources, image->source_count, sizeof(HeapImageSource),
+        compare_sources);
+
+    uint8_t const* pool = vm->pool;
+    for (offset = 0; offset < heap->old_bytes;) {
+        HeapHeader* header = (HeapHeader*)(image->block->data + offset);
+        offset += object_size(header->size);
+        if (header->kind != HEAP_OBJECT)
+            continue;
+
+        Word* fields = (Word*)(header + 1);
+        for (size_t i = 0; i < header->size / sizeof(Word); i++) {
+            PyriteValueType type = word_type(fields[i]);
+            if (type != PR_PTR && type != PR_STRING && type != PR_ARRAY)
+                continue;
+
+            uint8_t const* target = (uint8_t const*)word_as_array(fields[i]);
+            uint64_t relocation
+                = (uint8_t*)&fields[i] - (uint8_t*)image->block;
+
+            Word moved = vm_heap_image_word(image, fields[i]);
+            if (word_as_array(moved) != word_as_array(fields[i])) {
+                fields[i] = moved;
+                add_relocation(image, relocation);
+            } else if (target >= pool && target < pool + vm->pool_size) {
+                add_relocation(image, relocation | 1);
+            } else {
+                fprintf(stderr,
+                    "ERROR: a heap object points outside of the heap\n");
+                exit(1);
+            }
+        }
+    }
+}
+
+Word vm_heap_image_word(HeapImage const* image, Word word)
+{
+    PyriteValueType type = word_type(word);
+    if (image->source_count == 0 || (type != PR_PTR && type != PR_ARRAY))
+        return word;
+
+    // payloads of empty objects end where the next header starts, so the
+    // lookup goes by the header.
+    uintptr_t header = (uintptr_t)heap_header(word_as_array(word));
+
+    int32_t low = 0;
+    int32_t high = image->source_count;
+    while (high - low > 1) {
+        int32_t middle = low + (high - low) / 2;
+        if ((uintptr_t)image->sources[middle].block <= header) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    HeapImageSource const* source = &image->sources[low];
+    uintptr_t data = (uintptr_t)source->block->data;
+    if (header < data || header >= data + source->block->used)
+        return word;
+
+    uintptr_t moved = image->address + offsetof(HeapBlock, data)
+        + source->offset + (header - data) + sizeof(HeapHeader);
+    return word_with_pointer(word, (void const*)moved);
+}
+
+void vm_heap_image_free(HeapImage* image)
+{
+    free(image->block);
+    free(image->relocations);
+    free(image->sources);
+}
+
+void vm_heap_adopt(VmHeap* heap, HeapBlock* block, size_t mapping_size)
+{
+    heap->old_first = block;
+    heap->old_last = block;
+    heap->old_bytes = block->used;
+    heap->major_threshold = block->used * 2 > MAJOR_THRESHOLD_MIN
+        ? block->used * 2
+        : MAJOR_THRESHOLD_MIN;
+
+    heap->mapped_block = block;
+    heap->mapped_size = mapping_size;
+}
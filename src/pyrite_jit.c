@@ -0,0 +1,1029 @@
+#include "pyrite.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#    include <sys/mman.h>
+
+// a template jit: every instruction of the verified program is translated
+// into a fixed x86-64 sequence. because the program is verified, the stack
+// depth and the type of every slot are known while compiling, so the native
+// code keeps raw 8-byte values in a scratch array (r12) with no tags at all,
+// and the top two slots are cached in registers between instructions.
+//
+// register use inside compiled code:
+//     rbx        the VirtualMachine
+//     r12        base of the native operand stack
+//     r10, r11   cached int slots, picked by the parity of the slot depth
+//     xmm2, xmm3 cached double slots, picked the same way
+//     rax, rcx, rdx, xmm1 scratch
+// everything cached is spilled before calling back into C.
+//
+// the program is compiled one basic block at a time. at block boundaries
+// nothing is cached, so every jump lands on code that expects the whole
+// stack in memory, and the verifier guarantees the slot types agree.
+
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+} Register;
+
+typedef enum {
+    XMM0 = 0,
+    XMM1 = 1,
+    XMM2 = 2,
+    XMM3 = 3,
+} XmmRegister;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+    size_t cap;
+} CodeBuffer;
+
+// stack shape on entry to a jump target, filled by the first edge into it.
+typedef struct {
+    int32_t depth; // -1 until the first edge reaches the target.
+    PyriteValueType* types;
+} JitState;
+
+// a rel32 displacement to fill in once the target has been compiled.
+typedef struct {
+    size_t displacement;
+    int32_t target;
+} JitFixup;
+
+typedef struct {
+    VirtualMachine* vm;
+    CodeBuffer code;
+    int32_t pc; // of the instruction being compiled.
+
+    // compile time view of the operand stack.
+    PyriteValueType* types; // max_stack_depth of them.
+    int32_t depth;
+    int32_t cached; // how many of the top slots currently live in registers.
+
+    size_t* offsets; // native offset of each instruction, -1 when not compiled.
+    bool* is_target;
+    JitState* states;
+    int32_t* worklist;
+    int32_t worklist_length;
+    JitFixup* fixups;
+    int32_t fixups_length;
+} Jit;
+
+static void emit_byte(Jit* jit, uint8_t byte)
+{
+    CodeBuffer* code = &jit->code;
+    if (code->length >= code->cap) {
+        code->cap = code->cap ? code->cap * 2 : 4096;
+        code->bytes = realloc(code->bytes, code->cap);
+        if (!code->bytes) {
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    code->bytes[code->length++] = byte;
+}
+
+static void emit_u32(Jit* jit, uint32_t value)
+{
+    for (int32_t i = 0; i < 4; i++)
+        emit_byte(jit, value >> (i * 8));
+}
+
+static void emit_u64(Jit* jit, uint64_t value)
+{
+    for (int32_t i = 0; i < 8; i++)
+        emit_byte(jit, value >> (i * 8));
+}
+
+static void patch_u32(Jit* jit, size_t offset, uint32_t value)
+{
+    memcpy(jit->code.bytes + offset, &value, sizeof(value));
+}
+
+static uint8_t rex(bool wide, int32_t reg, int32_t rm)
+{
+    return 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0)
+        | ((rm & 8) ? 0x01 : 0);
+}
+
+static uint8_t modrm_direct(int32_t reg, int32_t rm)
+{
+    return 0xc0 | ((reg & 7) << 3) | (rm & 7);
+}
+
+// <op> reg, rm for the classic two operand integer instructions.
+static void emit_rr(Jit* jit, uint8_t opcode, Register reg, Register rm)
+{
+    emit_byte(jit, rex(true, reg, rm));
+    emit_byte(jit, opcode);
+    emit_byte(jit, modrm_direct(reg, rm));
+}
+
+static void emit_mov_rr(Jit* jit, Register dst, Register src)
+{
+    emit_rr(jit, 0x89, src, dst);
+}
+
+static void emit_mov_imm(Jit* jit, Register dst, uint64_t value)
+{
+    emit_byte(jit, rex(true, 0, dst));
+    emit_byte(jit, 0xb8 + (dst & 7));
+    emit_u64(jit, value);
+}
+
+// [r12 + slot * 8] addressing, r12 as a base always needs a sib byte.
+static void emit_slot_operand(Jit* jit, int32_t reg, int32_t slot)
+{
+    emit_byte(jit, 0x80 | ((reg & 7) << 3) | 0x04);
+    emit_byte(jit, 0x24);
+    emit_u32(jit, slot * sizeof(uint64_t));
+}
+
+static void emit_load_slot(Jit* jit, Register dst, int32_t slot)
+{
+    emit_byte(jit, rex(true, dst, R12));
+    emit_byte(jit, 0x8b);
+    emit_slot_operand(jit, dst, slot);
+}
+
+static void emit_store_slot(Jit* jit, int32_t slot, Register src)
+{
+    emit_byte(jit, rex(true, src, R12));
+    emit_byte(jit, 0x89);
+    emit_slot_operand(jit, src, slot);
+}
+
+static void emit_movsd_load_slot(Jit* jit, XmmRegister dst, int32_t slot)
+{
+    emit_byte(jit, 0xf2);
+    emit_byte(jit, rex(false, dst, R12));
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, 0x10);
+    emit_slot_operand(jit, dst, slot);
+}
+
+static void emit_movsd_store_slot(Jit* jit, int32_t slot, XmmRegister src)
+{
+    emit_byte(jit, 0xf2);
+    emit_byte(jit, rex(false, src, R12));
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, 0x11);
+    emit_slot_operand(jit, src, slot);
+}
+
+// addsd/subsd/mulsd/divsd/movsd between two xmm registers.
+static void emit_sse_rr(Jit* jit, uint8_t opcode, XmmRegister dst,
+    XmmRegister src)
+{
+    emit_byte(jit, 0xf2);
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, opcode);
+    emit_byte(jit, modrm_direct(dst, src));
+}
+
+static void emit_movq_xmm_r64(Jit* jit, XmmRegister dst, Register src)
+{
+    emit_byte(jit, 0x66);
+    emit_byte(jit, rex(true, dst, src));
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, 0x6e);
+    emit_byte(jit, modrm_direct(dst, src));
+}
+
+static void emit_call(Jit* jit, void* function)
+{
+    emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t)function);
+    emit_byte(jit, 0xff); // call rax
+    emit_byte(jit, 0xd0);
+}
+
+static void jit_division_error(VirtualMachine* vm, int32_t pc, int64_t divisor)
+{
+    vm->program_counter = pc;
+    vm_division_error(vm, divisor);
+}
+
+// a jcc rel8 whose displacement is filled in by patch_rel8.
+static size_t emit_jcc8(Jit* jit, uint8_t condition)
+{
+    emit_byte(jit, condition);
+    emit_byte(jit, 0);
+    return jit->code.length - 1;
+}
+
+static void patch_rel8(Jit* jit, size_t displacement)
+{
+    jit->code.bytes[displacement] = jit->code.length - (displacement + 1);
+}
+
+// rax = lhs / rhs. a zero divisor or INT64_MIN / -1 would trap, those call
+// out to report the error like the interpreter and never come back.
+static void emit_idiv(Jit* jit, Register lhs, Register divisor)
+{
+    emit_rr(jit, 0x85, divisor, divisor); // test
+    size_t zero = emit_jcc8(jit, 0x74); // je
+    emit_byte(jit, rex(true, 0, divisor)); // cmp divisor, -1
+    emit_byte(jit, 0x83);
+    emit_byte(jit, modrm_direct(7, divisor));
+    emit_byte(jit, 0xff);
+    size_t not_minus_one = emit_jcc8(jit, 0x75); // jne
+    emit_mov_imm(jit, RAX, (uint64_t)INT64_MIN);
+    emit_rr(jit, 0x39, RAX, lhs); // cmp
+    size_t no_overflow = emit_jcc8(jit, 0x75); // jne
+
+    patch_rel8(jit, zero);
+    emit_mov_rr(jit, RDI, RBX);
+    emit_byte(jit, 0xbe); // mov esi, pc
+    emit_u32(jit, jit->pc);
+    emit_mov_rr(jit, RDX, divisor);
+    emit_call(jit, (void*)jit_division_error);
+
+    patch_rel8(jit, not_minus_one);
+    patch_rel8(jit, no_overflow);
+    emit_mov_rr(jit, RAX, lhs);
+
+    emit_byte(jit, 0x48); // cqo
+    emit_byte(jit, 0x99);
+    emit_byte(jit, rex(true, 0, divisor));
+    emit_byte(jit, 0xf7);
+    emit_byte(jit, modrm_direct(7, divisor));
+}
+
+// boxed ints are 48 bits wide, keep the native values in step with them.
+static void emit_int_wrap(Jit* jit, Register reg)
+{
+#    ifdef PYRITE_NAN_BOXING
+    for (int32_t i = 0; i < 2; i++) {
+        emit_byte(jit, rex(true, 0, reg));
+        emit_byte(jit, 0xc1);
+        emit_byte(jit, modrm_direct(i == 0 ? 4 : 7, reg)); // shl, then sar
+        emit_byte(jit, 16);
+    }
+#    else
+    (void)jit;
+    (void)reg;
+#    endif
+}
+
+static Register int_register(int32_t slot)
+{
+    return slot % 2 == 0 ? R10 : R11;
+}
+
+static XmmRegister double_register(int32_t slot)
+{
+    return slot % 2 == 0 ? XMM2 : XMM3;
+}
+
+static void spill_slot(Jit* jit, int32_t slot)
+{
+    if (jit->types[slot] == PR_DOUBLE) {
+        emit_movsd_store_slot(jit, slot, double_register(slot));
+    } else {
+        emit_store_slot(jit, slot, int_register(slot));
+    }
+}
+
+static void fill_slot(Jit* jit, int32_t slot)
+{
+    if (jit->types[slot] == PR_DOUBLE) {
+        emit_movsd_load_slot(jit, double_register(slot), slot);
+    } else {
+        emit_load_slot(jit, int_register(slot), slot);
+    }
+}
+
+static void spill_all(Jit* jit)
+{
+    for (int32_t slot = jit->depth - jit->cached; slot < jit->depth; slot++)
+        spill_slot(jit, slot);
+
+    jit->cached = 0;
+}
+
+// makes sure the top `count` slots (at most two) live in registers.
+static void cache_top(Jit* jit, int32_t count)
+{
+    for (int32_t slot = jit->depth - count;
+        slot < jit->depth - jit->cached; slot++)
+        fill_slot(jit, slot);
+
+    if (jit->cached < count)
+        jit->cached = count;
+}
+
+static void compile_push(Jit* jit, PyriteValueType type, PyriteValue operand)
+{
+    if (jit->cached == 2) {
+        spill_slot(jit, jit->depth - 2);
+        jit->cached = 1;
+    }
+
+    int32_t slot = jit->depth++;
+    jit->types[slot] = type;
+    jit->cached += 1;
+
+    if (type == PR_DOUBLE) {
+        emit_mov_imm(jit, RAX, operand.as_int);
+        emit_movq_xmm_r64(jit, double_register(slot), RAX);
+    } else {
+        emit_mov_imm(jit, int_register(slot),
+            word_as_int(word_make_int(operand.as_int)));
+    }
+}
+
+static void compile_pop(Jit* jit)
+{
+    jit->depth -= 1;
+    if (jit->cached > 0)
+        jit->cached -= 1;
+}
+
+static void compile_int_op(Jit* jit, PyriteInstruction opcode, Register lhs,
+    Register rhs)
+{
+    switch (opcode) {
+    case INS_IADD:
+        emit_rr(jit, 0x01, rhs, lhs);
+        break;
+    case INS_ISUB:
+        emit_rr(jit, 0x29, rhs, lhs);
+        break;
+    case INS_IMUL:
+        emit_byte(jit, rex(true, lhs, rhs));
+        emit_byte(jit, 0x0f);
+        emit_byte(jit, 0xaf);
+        emit_byte(jit, modrm_direct(lhs, rhs));
+        break;
+    default: // INS_IDIV
+        emit_idiv(jit, lhs, rhs);
+        emit_mov_rr(jit, lhs, RAX);
+        break;
+    }
+
+    emit_int_wrap(jit, lhs);
+}
+
+static uint8_t sse_opcode(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_DADD:
+        return 0x58;
+    case INS_DSUB:
+        return 0x5c;
+    case INS_DMUL:
+        return 0x59;
+    default: // INS_DDIV
+        return 0x5e;
+    }
+}
+
+static void compile_binary(Jit* jit, PyriteInstruction opcode)
+{
+    cache_top(jit, 2);
+
+    int32_t lhs = jit->depth - 2;
+    int32_t rhs = jit->depth - 1;
+
+    if (jit->types[lhs] == PR_DOUBLE) {
+        emit_sse_rr(jit, sse_opcode(opcode), double_register(lhs),
+            double_register(rhs));
+    } else {
+        compile_int_op(jit, opcode, int_register(lhs), int_register(rhs));
+    }
+
+    jit->depth -= 1;
+    jit->cached = 1;
+}
+
+static void compile_immediate(Jit* jit, PyriteInstruction opcode,
+    PyriteValue operand)
+{
+    cache_top(jit, 1);
+
+    int32_t slot = jit->depth - 1;
+
+    if (jit->types[slot] == PR_DOUBLE) {
+        emit_mov_imm(jit, RAX, operand.as_int);
+        emit_movq_xmm_r64(jit, XMM1, RAX);
+        emit_sse_rr(jit, sse_opcode(opcode), double_register(slot), XMM1);
+    } else {
+        emit_mov_imm(jit, RCX, operand.as_int);
+        compile_int_op(jit, opcode, int_register(slot), RCX);
+    }
+}
+
+static void compile_dup(Jit* jit)
+{
+    cache_top(jit, 1);
+
+    int32_t source = jit->depth - 1;
+    PyriteValueType type = jit->types[source];
+
+    if (jit->cached == 2) {
+        spill_slot(jit, jit->depth - 2);
+        jit->cached = 1;
+    }
+
+    int32_t slot = jit->depth++;
+    jit->types[slot] = type;
+    jit->cached += 1;
+
+    if (type == PR_DOUBLE) {
+        emit_sse_rr(jit, 0x10, double_register(slot), double_register(source));
+    } else {
+        emit_mov_rr(jit, int_register(slot), int_register(source));
+    }
+}
+
+// queues target with the current stack shape if it has not been seen yet.
+static void record_edge(Jit* jit, int32_t target)
+{
+    JitState* state = &jit->states[target];
+    if (state->depth >= 0)
+        return;
+
+    state->depth = jit->depth;
+    state->types = malloc(sizeof(PyriteValueType) * (jit->depth + 1));
+    if (!state->types) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(state->types, jit->types, sizeof(PyriteValueType) * jit->depth);
+    jit->worklist[jit->worklist_length++] = target;
+}
+
+// emits the rel32 of a jump to target, patched later if it is not compiled.
+static void emit_target(Jit* jit, int32_t target)
+{
+    size_t displacement = jit->code.length;
+    emit_u32(jit, 0);
+
+    if (jit->offsets[target] != (size_t)-1) {
+        patch_u32(jit, displacement,
+            jit->offsets[target] - (displacement + 4));
+    } else {
+        jit->fixups[jit->fixups_length++] = (JitFixup) {
+            .displacement = displacement,
+            .target = target,
+        };
+    }
+}
+
+static void compile_jump(Jit* jit, int32_t target)
+{
+    spill_all(jit);
+    record_edge(jit, target);
+
+    emit_byte(jit, 0xe9); // jmp rel32
+    emit_target(jit, target);
+}
+
+static void emit_jcc(Jit* jit, uint8_t condition, int32_t target)
+{
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, condition);
+    emit_target(jit, target);
+}
+
+static uint8_t int_condition(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_IJEQ:
+        return 0x84; // je
+    case INS_IJNE:
+        return 0x85; // jne
+    case INS_IJLT:
+        return 0x8c; // jl
+    case INS_IJLE:
+        return 0x8e; // jle
+    case INS_IJGT:
+        return 0x8f; // jg
+    default: // INS_IJGE
+        return 0x8d; // jge
+    }
+}
+
+// ucomisd a, b
+static void emit_ucomisd(Jit* jit, XmmRegister a, XmmRegister b)
+{
+    emit_byte(jit, 0x66);
+    emit_byte(jit, 0x0f);
+    emit_byte(jit, 0x2e);
+    emit_byte(jit, modrm_direct(a, b));
+}
+
+static void compile_branch(Jit* jit, PyriteInstruction opcode, int32_t target)
+{
+    cache_top(jit, 2);
+
+    int32_t lhs = jit->depth - 2;
+    int32_t rhs = jit->depth - 1;
+    PyriteValueType type = jit->types[lhs];
+
+    // both operands were cached, so popping them leaves nothing in
+    // registers and the rest of the stack already sits in memory.
+    jit->depth -= 2;
+    jit->cached = 0;
+    record_edge(jit, target);
+
+    if (type != PR_DOUBLE) {
+        emit_rr(jit, 0x39, int_register(rhs), int_register(lhs)); // cmp
+        emit_jcc(jit, int_condition(opcode), target);
+        return;
+    }
+
+    // an unordered comparison sets zf, pf and cf, so every condition but
+    // `!=` has to come out false when either side is NaN.
+    XmmRegister a = double_register(lhs);
+    XmmRegister b = double_register(rhs);
+
+    switch (opcode) {
+    case INS_DJEQ:
+        emit_ucomisd(jit, a, b);
+        emit_byte(jit, 0x7a); // jp over the je
+        emit_byte(jit, 6);
+        emit_jcc(jit, 0x84, target);
+        break;
+    case INS_DJNE:
+        emit_ucomisd(jit, a, b);
+        emit_jcc(jit, 0x85, target); // jne
+        emit_jcc(jit, 0x8a, target); // jp
+        break;
+    case INS_DJLT:
+        emit_ucomisd(jit, b, a);
+        emit_jcc(jit, 0x87, target); // ja
+        break;
+    case INS_DJLE:
+        emit_ucomisd(jit, b, a);
+        emit_jcc(jit, 0x83, target); // jae
+        break;
+    case INS_DJGT:
+        emit_ucomisd(jit, a, b);
+        emit_jcc(jit, 0x87, target); // ja
+        break;
+    default: // INS_DJGE
+        emit_ucomisd(jit, a, b);
+        emit_jcc(jit, 0x83, target); // jae
+        break;
+    }
+}
+
+static void jit_print_int(VirtualMachine* vm, int64_t value)
+{
+    vm_print_word(vm, word_make_int(value));
+}
+
+static void jit_print_double(VirtualMachine* vm, double_t value)
+{
+    vm_print_word(vm, word_make_double(value));
+}
+
+static void compile_print(Jit* jit)
+{
+    int32_t slot = jit->depth - 1;
+    PyriteValueType type = jit->types[slot];
+
+    if (jit->cached > 0) {
+        if (type == PR_DOUBLE) {
+            emit_sse_rr(jit, 0x10, XMM0, double_register(slot));
+        } else {
+            emit_mov_rr(jit, RSI, int_register(slot));
+        }
+    } else if (type == PR_DOUBLE) {
+        emit_movsd_load_slot(jit, XMM0, slot);
+    } else {
+        emit_load_slot(jit, RSI, slot);
+    }
+
+    compile_pop(jit);
+    spill_all(jit);
+
+    emit_mov_rr(jit, RDI, RBX);
+    emit_call(jit, type == PR_DOUBLE ? (void*)jit_print_double
+                                     : (void*)jit_print_int);
+}
+
+// hands the native stack back to the interpreter's representation, so the
+// vm looks exactly as if vm_execute had run the program.
+static void jit_halt(VirtualMachine* vm, uint64_t const* stack,
+    uint8_t const* types, int32_t depth, int32_t pc)
+{
+    for (int32_t i = 0; i < depth; i++) {
+        PyriteValue value = { .as_int = (int64_t)stack[i] };
+        vm->stack[i] = types[i] == PR_DOUBLE ? word_make_double(value.as_double)
+                                             : word_make_int(value.as_int);
+    }
+
+    vm->stack_pointer = depth - 1;
+    vm->program_counter = pc;
+    vm->halted = true;
+}
+
+static void compile_epilogue(Jit* jit)
+{
+    emit_byte(jit, 0x41); // pop r13
+    emit_byte(jit, 0x5d);
+    emit_byte(jit, 0x41); // pop r12
+    emit_byte(jit, 0x5c);
+    emit_byte(jit, 0x5b); // pop rbx
+    emit_byte(jit, 0xc3); // ret
+}
+
+static void compile_halt(Jit* jit, int32_t pc)
+{
+    spill_all(jit);
+
+    // lea rdx, [rip + types], the table is placed right after the ret.
+    emit_byte(jit, 0x48);
+    emit_byte(jit, 0x8d);
+    emit_byte(jit, 0x15);
+    size_t displacement = jit->code.length;
+    emit_u32(jit, 0);
+
+    emit_byte(jit, 0xb9); // mov ecx, depth
+    emit_u32(jit, jit->depth);
+    emit_byte(jit, 0x41); // mov r8d, pc
+    emit_byte(jit, 0xb8);
+    emit_u32(jit, pc);
+    emit_mov_rr(jit, RDI, RBX);
+    emit_mov_rr(jit, RSI, R12);
+    emit_call(jit, (void*)jit_halt);
+    compile_epilogue(jit);
+
+    patch_u32(jit, displacement, jit->code.length - (displacement + 4));
+    for (int32_t i = 0; i < jit->depth; i++)
+        emit_byte(jit, jit->types[i]);
+}
+
+static void compile_prologue(Jit* jit)
+{
+    // three pushes on top of the return address keep rsp 16 byte aligned
+    // for the calls into C.
+    emit_byte(jit, 0x53); // push rbx
+    emit_byte(jit, 0x41); // push r12
+    emit_byte(jit, 0x54);
+    emit_byte(jit, 0x41); // push r13
+    emit_byte(jit, 0x55);
+    emit_mov_rr(jit, RBX, RDI);
+    emit_mov_rr(jit, R12, RSI);
+}
+
+static bool compile_instruction(Jit* jit, int32_t pc)
+{
+    DecodedInstruction instruction = jit->vm->code[pc];
+    jit->pc = pc;
+
+    switch (instruction.opcode) {
+    case INS_HALT:
+        compile_halt(jit, pc);
+        return true;
+    case INS_IPUSH:
+        compile_push(jit, PR_INT, instruction.operand);
+        return true;
+    case INS_DPUSH:
+        compile_push(jit, PR_DOUBLE, instruction.operand);
+        return true;
+    case INS_POP:
+        compile_pop(jit);
+        return true;
+    case INS_PRINT:
+        compile_print(jit);
+        return true;
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
+    case INS_DADD:
+    case INS_DSUB:
+    case INS_DMUL:
+    case INS_DDIV:
+        compile_binary(jit, instruction.opcode);
+        return true;
+    case INS_IPUSH_IADD:
+        compile_immediate(jit, INS_IADD, instruction.operand);
+        return true;
+    case INS_IPUSH_ISUB:
+        compile_immediate(jit, INS_ISUB, instruction.operand);
+        return true;
+    case INS_IPUSH_IMUL:
+        compile_immediate(jit, INS_IMUL, instruction.operand);
+        return true;
+    case INS_IPUSH_IDIV:
+        compile_immediate(jit, INS_IDIV, instruction.operand);
+        return true;
+    case INS_DPUSH_DADD:
+        compile_immediate(jit, INS_DADD, instruction.operand);
+        return true;
+    case INS_DPUSH_DSUB:
+        compile_immediate(jit, INS_DSUB, instruction.operand);
+        return true;
+    case INS_DPUSH_DMUL:
+        compile_immediate(jit, INS_DMUL, instruction.operand);
+        return true;
+    case INS_DPUSH_DDIV:
+        compile_immediate(jit, INS_DDIV, instruction.operand);
+        return true;
+    case INS_IADD_PRINT:
+        compile_binary(jit, INS_IADD);
+        compile_print(jit);
+        return true;
+    case INS_ISUB_PRINT:
+        compile_binary(jit, INS_ISUB);
+        compile_print(jit);
+        return true;
+    case INS_IMUL_PRINT:
+        compile_binary(jit, INS_IMUL);
+        compile_print(jit);
+        return true;
+    case INS_IDIV_PRINT:
+        compile_binary(jit, INS_IDIV);
+        compile_print(jit);
+        return true;
+    case INS_DADD_PRINT:
+        compile_binary(jit, INS_DADD);
+        compile_print(jit);
+        return true;
+    case INS_DSUB_PRINT:
+        compile_binary(jit, INS_DSUB);
+        compile_print(jit);
+        return true;
+    case INS_DMUL_PRINT:
+        compile_binary(jit, INS_DMUL);
+        compile_print(jit);
+        return true;
+    case INS_DDIV_PRINT:
+        compile_binary(jit, INS_DDIV);
+        compile_print(jit);
+        return true;
+    case INS_JMP:
+        compile_jump(jit, instruction.operand.as_int);
+        return true;
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+        compile_branch(jit, instruction.opcode, instruction.operand.as_int);
+        return true;
+    case INS_DUP:
+        compile_dup(jit);
+        return true;
+    case INS_ICONST:
+        compile_push(
+            jit, PR_INT, jit->vm->constants[instruction.operand.as_int]);
+        return true;
+    case INS_DCONST:
+        compile_push(
+            jit, PR_DOUBLE, jit->vm->constants[instruction.operand.as_int]);
+        return true;
+    case INS_SCONST:
+    case INS_VCONST:
+    case INS_VADD:
+    case INS_VSUB:
+    case INS_VMUL:
+    case INS_VSCALE:
+    case INS_VFMA:
+    case INS_VSUM:
+    case INS_VDOT:
+    case INS_VLEN:
+    case INS_ALLOC:
+    case INS_STORE:
+    case INS_ILOAD:
+    case INS_DLOAD:
+    case INS_PLOAD:
+    case INS_VLOAD:
+        // the native code only knows ints and doubles.
+        break;
+    case INS_CALL:
+    case INS_RET:
+    case INS_ARG:
+        // the native code has no call frames.
+        break;
+    }
+
+    return false;
+}
+
+static bool is_branch(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// compiles the block starting at start and falls through into any block
+// that directly follows it and has not been compiled yet.
+static bool compile_block(Jit* jit, int32_t start)
+{
+    VirtualMachine* vm = jit->vm;
+    JitState* state = &jit->states[start];
+
+    jit->depth = state->depth;
+    jit->cached = 0;
+    memcpy(jit->types, state->types, sizeof(PyriteValueType) * state->depth);
+
+    for (int32_t pc = start; pc < vm->code_length; pc++) {
+        if (pc != start && jit->is_target[pc]) {
+            if (jit->offsets[pc] != (size_t)-1) {
+                compile_jump(jit, pc);
+                return true;
+            }
+
+            spill_all(jit);
+        }
+
+        jit->offsets[pc] = jit->code.length;
+        if (!compile_instruction(jit, pc))
+            return false;
+
+        PyriteInstruction opcode = vm->code[pc].opcode;
+        if (opcode == INS_HALT || opcode == INS_JMP)
+            return true;
+    }
+
+    return true;
+}
+
+bool vm_jit_compile(VirtualMachine* vm)
+{
+    if (!vm->verified)
+        return false;
+
+    Jit* jit = calloc(1, sizeof(*jit));
+    if (!jit) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // a conditional double branch emits two jumps, and a block may end in
+    // one more to reach the block after it.
+    jit->vm = vm;
+    jit->offsets = malloc(sizeof(size_t) * vm->code_length);
+    jit->is_target = calloc(vm->code_length, sizeof(bool));
+    jit->states = malloc(sizeof(JitState) * vm->code_length);
+    jit->worklist = malloc(sizeof(int32_t) * vm->code_length);
+    jit->fixups = malloc(sizeof(JitFixup) * vm->code_length * 3);
+    jit->types = malloc(sizeof(PyriteValueType) * (vm->max_stack_depth + 1));
+    if (!jit->offsets || !jit->is_target || !jit->states || !jit->worklist
+        || !jit->fixups || !jit->types) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t pc = 0; pc < vm->code_length; pc++) {
+        jit->offsets[pc] = -1;
+        jit->states[pc].depth = -1;
+        jit->states[pc].types = NULL;
+        if (is_branch(vm->code[pc].opcode))
+            jit->is_target[vm->code[pc].operand.as_int] = true;
+    }
+
+    compile_prologue(jit);
+
+    // blocks are compiled in the order they are discovered, the verifier
+    // guarantees every one of them ends in a halt or a jump.
+    jit->depth = vm->input_count;
+    memcpy(jit->types, vm->input_types,
+        sizeof(PyriteValueType) * vm->input_count);
+    record_edge(jit, 0);
+
+    bool ok = true;
+    while (ok && jit->worklist_length > 0) {
+        int32_t start = jit->worklist[--jit->worklist_length];
+        if (jit->offsets[start] == (size_t)-1)
+            ok = compile_block(jit, start);
+    }
+
+    for (int32_t i = 0; ok && i < jit->fixups_length; i++) {
+        JitFixup fixup = jit->fixups[i];
+        patch_u32(jit, fixup.displacement,
+            jit->offsets[fixup.target] - (fixup.displacement + 4));
+    }
+
+    void* native = MAP_FAILED;
+    if (ok) {
+        native = mmap(NULL, jit->code.length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (native != MAP_FAILED) {
+        memcpy(native, jit->code.bytes, jit->code.length);
+        if (mprotect(native, jit->code.length, PROT_READ | PROT_EXEC) != 0) {
+            munmap(native, jit->code.length);
+            native = MAP_FAILED;
+        }
+    }
+
+    if (native != MAP_FAILED) {
+        vm->jit_code = native;
+        vm->jit_code_size = jit->code.length;
+    }
+
+    for (int32_t pc = 0; pc < vm->code_length; pc++)
+        free(jit->states[pc].types);
+
+    free(jit->types);
+    free(jit->fixups);
+    free(jit->worklist);
+    free(jit->states);
+    free(jit->is_target);
+    free(jit->offsets);
+    free(jit->code.bytes);
+    free(jit);
+    return native != MAP_FAILED;
+}
+
+void vm_jit_execute(VirtualMachine* vm)
+{
+    uint64_t* stack = malloc(sizeof(uint64_t) * (vm->max_stack_depth + 1));
+    if (!stack) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // the compiled code expects the inputs unboxed in the native stack.
+    for (int32_t i = 0; i <= vm->stack_pointer; i++) {
+        PyriteValue value;
+        if (word_type(vm->stack[i]) == PR_DOUBLE) {
+            value.as_double = word_as_double(vm->stack[i]);
+        } else {
+            value.as_int = word_as_int(vm->stack[i]);
+        }
+        stack[i] = value.as_int;
+    }
+
+    void (*entry)(VirtualMachine*, uint64_t*) = vm->jit_code;
+    entry(vm, stack);
+
+    free(stack);
+}
+
+void vm_jit_free(VirtualMachine* vm)
+{
+    if (vm->jit_code)
+        munmap(vm->jit_code, vm->jit_code_size);
+
+    vm->jit_code = NULL;
+    vm->jit_code_size = 0;
+}
+
+#else
+
+bool vm_jit_compile(VirtualMachine* vm)
+{
+    (void)vm;
+    return false;
+}
+
+void vm_jit_execute(VirtualMachine* vm)
+{
+    (void)vm;
+}
+
+void vm_jit_free(VirtualMachine* vm)
+{
+    (void)vm;
+}
+
+#endif
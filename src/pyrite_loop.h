@@ -0,0 +1,438 @@
+// the body of the interpreter loop, included by pyrite.c once per variant.
+// VM_LOOP_NAME names the function and VM_LOOP_CHECKED selects whether stack
+// bounds and operand types are checked at run time, which is only skipped
+// for programs that passed vm_verify. with VM_LOOP_FUEL the function takes
+// a budget and returns once that many instructions ran, leaving the vm
+// ready to pick up where it stopped. there is deliberately no include guard.
+
+#if VM_LOOP_CHECKED
+#    define PUSH(WORD) push(vm, WORD)
+#    define POP() pop(vm)
+#    define TOP() top(vm)
+#    define PEEK(DEPTH) peek(vm, DEPTH)
+#    define EXPECT_TYPE(WORD, TYPE) expect_type(vm, WORD, TYPE)
+#else
+#    define PUSH(WORD) (vm->stack[++vm->stack_pointer] = (WORD))
+#    define POP() (vm->stack[vm->stack_pointer--])
+#    define TOP() (&vm->stack[vm->stack_pointer])
+#    define PEEK(DEPTH) (&vm->stack[vm->stack_pointer - (DEPTH)])
+#    define EXPECT_TYPE(WORD, TYPE) ((void)0)
+#endif
+
+// the program counter always names the last instruction that ran, so
+// returning before the fetch is all it takes to pause.
+#if VM_LOOP_FUEL
+#    define CHARGE_FUEL()       \
+        do {                    \
+            if (fuel-- <= 0)    \
+                return;         \
+        } while (0)
+#else
+#    define CHARGE_FUEL() ((void)0)
+#endif
+
+#if VM_LOOP_FUEL
+static void VM_LOOP_NAME(VirtualMachine* vm, int64_t fuel)
+#else
+static void VM_LOOP_NAME(VirtualMachine* vm)
+#endif
+{
+    DecodedInstruction const* instruction;
+
+#ifdef PYRITE_THREADED_DISPATCH
+#    pragma GCC diagnostic push
+#    pragma GCC diagnostic ignored "-Woverride-init"
+    static void* const dispatch_table[256] = {
+        [0 ... 255] = &&target_invalid,
+        [INS_HALT] = &&TARGET(INS_HALT),
+        [INS_IPUSH] = &&TARGET(INS_IPUSH),
+        [INS_DPUSH] = &&TARGET(INS_DPUSH),
+        [INS_POP] = &&TARGET(INS_POP),
+        [INS_PRINT] = &&TARGET(INS_PRINT),
+        [INS_IADD] = &&TARGET(INS_IADD),
+        [INS_ISUB] = &&TARGET(INS_ISUB),
+        [INS_IMUL] = &&TARGET(INS_IMUL),
+        [INS_IDIV] = &&TARGET(INS_IDIV),
+        [INS_DADD] = &&TARGET(INS_DADD),
+        [INS_DSUB] = &&TARGET(INS_DSUB),
+        [INS_DMUL] = &&TARGET(INS_DMUL),
+        [INS_DDIV] = &&TARGET(INS_DDIV),
+        [INS_IPUSH_IADD] = &&TARGET(INS_IPUSH_IADD),
+        [INS_IPUSH_ISUB] = &&TARGET(INS_IPUSH_ISUB),
+        [INS_IPUSH_IMUL] = &&TARGET(INS_IPUSH_IMUL),
+        [INS_IPUSH_IDIV] = &&TARGET(INS_IPUSH_IDIV),
+        [INS_DPUSH_DADD] = &&TARGET(INS_DPUSH_DADD),
+        [INS_DPUSH_DSUB] = &&TARGET(INS_DPUSH_DSUB),
+        [INS_DPUSH_DMUL] = &&TARGET(INS_DPUSH_DMUL),
+        [INS_DPUSH_DDIV] = &&TARGET(INS_DPUSH_DDIV),
+        [INS_IADD_PRINT] = &&TARGET(INS_IADD_PRINT),
+        [INS_ISUB_PRINT] = &&TARGET(INS_ISUB_PRINT),
+        [INS_IMUL_PRINT] = &&TARGET(INS_IMUL_PRINT),
+        [INS_IDIV_PRINT] = &&TARGET(INS_IDIV_PRINT),
+        [INS_DADD_PRINT] = &&TARGET(INS_DADD_PRINT),
+        [INS_DSUB_PRINT] = &&TARGET(INS_DSUB_PRINT),
+        [INS_DMUL_PRINT] = &&TARGET(INS_DMUL_PRINT),
+        [INS_DDIV_PRINT] = &&TARGET(INS_DDIV_PRINT),
+        [INS_JMP] = &&TARGET(INS_JMP),
+        [INS_IJEQ] = &&TARGET(INS_IJEQ),
+        [INS_IJNE] = &&TARGET(INS_IJNE),
+        [INS_IJLT] = &&TARGET(INS_IJLT),
+        [INS_IJLE] = &&TARGET(INS_IJLE),
+        [INS_IJGT] = &&TARGET(INS_IJGT),
+        [INS_IJGE] = &&TARGET(INS_IJGE),
+        [INS_DJEQ] = &&TARGET(INS_DJEQ),
+        [INS_DJNE] = &&TARGET(INS_DJNE),
+        [INS_DJLT] = &&TARGET(INS_DJLT),
+        [INS_DJLE] = &&TARGET(INS_DJLE),
+        [INS_DJGT] = &&TARGET(INS_DJGT),
+        [INS_DJGE] = &&TARGET(INS_DJGE),
+        [INS_CALL] = &&TARGET(INS_CALL),
+        [INS_RET] = &&TARGET(INS_RET),
+        [INS_ARG] = &&TARGET(INS_ARG),
+        [INS_DUP] = &&TARGET(INS_DUP),
+        [INS_ICONST] = &&TARGET(INS_ICONST),
+        [INS_DCONST] = &&TARGET(INS_DCONST),
+        [INS_SCONST] = &&TARGET(INS_SCONST),
+        [INS_VCONST] = &&TARGET(INS_VCONST),
+        [INS_VADD] = &&TARGET(INS_VADD),
+        [INS_VSUB] = &&TARGET(INS_VSUB),
+        [INS_VMUL] = &&TARGET(INS_VMUL),
+        [INS_VSCALE] = &&TARGET(INS_VSCALE),
+        [INS_VFMA] = &&TARGET(INS_VFMA),
+        [INS_VSUM] = &&TARGET(INS_VSUM),
+        [INS_VDOT] = &&TARGET(INS_VDOT),
+        [INS_VLEN] = &&TARGET(INS_VLEN),
+        [INS_ALLOC] = &&TARGET(INS_ALLOC),
+        [INS_STORE] = &&TARGET(INS_STORE),
+        [INS_ILOAD] = &&TARGET(INS_ILOAD),
+        [INS_DLOAD] = &&TARGET(INS_DLOAD),
+        [INS_PLOAD] = &&TARGET(INS_PLOAD),
+        [INS_VLOAD] = &&TARGET(INS_VLOAD),
+    };
+#    pragma GCC diagnostic pop
+
+    DISPATCH();
+#else
+    for (;;) {
+        CHARGE_FUEL();
+        switch (NEXT_OPCODE()) {
+#endif
+    TARGET(INS_HALT):
+        vm->halted = true;
+        return;
+    TARGET(INS_IPUSH):
+        PUSH(word_make_int(instruction->operand.as_int));
+        DISPATCH();
+    TARGET(INS_DPUSH):
+        PUSH(word_make_double(instruction->operand.as_double));
+        DISPATCH();
+    TARGET(INS_POP):
+        (void)POP();
+        DISPATCH();
+    TARGET(INS_PRINT):
+        vm_print_word(vm, POP());
+        DISPATCH();
+    TARGET(INS_IADD):
+        ARITHOP(int, +);
+        DISPATCH();
+    TARGET(INS_ISUB):
+        ARITHOP(int, -);
+        DISPATCH();
+    TARGET(INS_IMUL):
+        ARITHOP(int, *);
+        DISPATCH();
+    TARGET(INS_IDIV):
+        DIVIDE();
+        DISPATCH();
+    TARGET(INS_DADD):
+        ARITHOP(double, +);
+        DISPATCH();
+    TARGET(INS_DSUB):
+        ARITHOP(double, -);
+        DISPATCH();
+    TARGET(INS_DMUL):
+        ARITHOP(double, *);
+        DISPATCH();
+    TARGET(INS_DDIV):
+        ARITHOP(double, /);
+        DISPATCH();
+    TARGET(INS_IPUSH_IADD):
+        ARITHOP_IMMEDIATE(int, +);
+        DISPATCH();
+    TARGET(INS_IPUSH_ISUB):
+        ARITHOP_IMMEDIATE(int, -);
+        DISPATCH();
+    TARGET(INS_IPUSH_IMUL):
+        ARITHOP_IMMEDIATE(int, *);
+        DISPATCH();
+    TARGET(INS_IPUSH_IDIV):
+        DIVIDE_IMMEDIATE();
+        DISPATCH();
+    TARGET(INS_DPUSH_DADD):
+        ARITHOP_IMMEDIATE(double, +);
+        DISPATCH();
+    TARGET(INS_DPUSH_DSUB):
+        ARITHOP_IMMEDIATE(double, -);
+        DISPATCH();
+    TARGET(INS_DPUSH_DMUL):
+        ARITHOP_IMMEDIATE(double, *);
+        DISPATCH();
+    TARGET(INS_DPUSH_DDIV):
+        ARITHOP_IMMEDIATE(double, /);
+        DISPATCH();
+    TARGET(INS_IADD_PRINT):
+        ARITHOP_PRINT(int, +);
+        DISPATCH();
+    TARGET(INS_ISUB_PRINT):
+        ARITHOP_PRINT(int, -);
+        DISPATCH();
+    TARGET(INS_IMUL_PRINT):
+        ARITHOP_PRINT(int, *);
+        DISPATCH();
+    TARGET(INS_IDIV_PRINT):
+        DIVIDE_PRINT();
+        DISPATCH();
+    TARGET(INS_DADD_PRINT):
+        ARITHOP_PRINT(double, +);
+        DISPATCH();
+    TARGET(INS_DSUB_PRINT):
+        ARITHOP_PRINT(double, -);
+        DISPATCH();
+    TARGET(INS_DMUL_PRINT):
+        ARITHOP_PRINT(double, *);
+        DISPATCH();
+    TARGET(INS_DDIV_PRINT):
+        ARITHOP_PRINT(double, /);
+        DISPATCH();
+    TARGET(INS_JMP):
+        JUMP(instruction->operand.as_int);
+        DISPATCH();
+    TARGET(INS_IJEQ):
+        BRANCH(int, ==);
+        DISPATCH();
+    TARGET(INS_IJNE):
+        BRANCH(int, !=);
+        DISPATCH();
+    TARGET(INS_IJLT):
+        BRANCH(int, <);
+        DISPATCH();
+    TARGET(INS_IJLE):
+        BRANCH(int, <=);
+        DISPATCH();
+    TARGET(INS_IJGT):
+        BRANCH(int, >);
+        DISPATCH();
+    TARGET(INS_IJGE):
+        BRANCH(int, >=);
+        DISPATCH();
+    TARGET(INS_DJEQ):
+        BRANCH(double, ==);
+        DISPATCH();
+    TARGET(INS_DJNE):
+        BRANCH(double, !=);
+        DISPATCH();
+    TARGET(INS_DJLT):
+        BRANCH(double, <);
+        DISPATCH();
+    TARGET(INS_DJLE):
+        BRANCH(double, <=);
+        DISPATCH();
+    TARGET(INS_DJGT):
+        BRANCH(double, >);
+        DISPATCH();
+    TARGET(INS_DJGE):
+        BRANCH(double, >=);
+        DISPATCH();
+    TARGET(INS_CALL):
+        // a frame is the return index and the caller's base pointer, pushed
+        // on top of the arguments. base_pointer points at the saved one.
+#if !VM_LOOP_CHECKED
+        if (vm->stack_pointer + vm->max_frame_depth >= vm->stack_cap)
+            reserve_frame(vm);
+#endif
+        PUSH(word_make_int(vm->program_counter + 1));
+        PUSH(word_make_int(vm->base_pointer));
+        vm->base_pointer = vm->stack_pointer;
+        JUMP(instruction->operand.as_int);
+        DISPATCH();
+    TARGET(INS_RET): {
+#if VM_LOOP_CHECKED
+        if (instruction->operand.as_int < 0)
+            runtime_error(vm, "negative argument count");
+        if (vm->base_pointer < 0)
+            runtime_error(vm, "ret outside of a call");
+        if (vm->stack_pointer <= vm->base_pointer)
+            runtime_error(vm, "ret without a return value");
+#endif
+        Word result = POP();
+        vm->stack_pointer = vm->base_pointer;
+
+        Word saved_base = POP();
+        Word return_index = POP();
+        EXPECT_TYPE(saved_base, PR_INT);
+        EXPECT_TYPE(return_index, PR_INT);
+#if VM_LOOP_CHECKED
+        if (word_as_int(saved_base) < -1
+            || word_as_int(saved_base) >= vm->base_pointer
+            || word_as_int(return_index) < 0
+            || word_as_int(return_index) >= vm->code_length)
+            runtime_error(vm, "corrupted call frame");
+        if (instruction->operand.as_int > vm->stack_pointer + 1)
+            runtime_error(vm, "stack underflow");
+#endif
+        vm->base_pointer = word_as_int(saved_base);
+        vm->stack_pointer -= instruction->operand.as_int;
+        PUSH(result);
+        JUMP(word_as_int(return_index));
+        DISPATCH();
+    }
+    TARGET(INS_ARG): {
+        int64_t slot = vm->base_pointer - 2 - instruction->operand.as_int;
+#if VM_LOOP_CHECKED
+        if (vm->base_pointer < 0)
+            runtime_error(vm, "arg outside of a call");
+        if (slot < 0 || slot > vm->stack_pointer)
+            runtime_error(vm, "argument out of range");
+#endif
+        PUSH(vm->stack[slot]);
+        DISPATCH();
+    }
+    TARGET(INS_DUP): {
+        Word word = *TOP();
+        PUSH(word);
+        DISPATCH();
+    }
+    TARGET(INS_ICONST):
+        PUSH(word_make_int(vm->constants[instruction->operand.as_int].as_int));
+        DISPATCH();
+    TARGET(INS_DCONST):
+        PUSH(word_make_double(
+            vm->constants[instruction->operand.as_int].as_double));
+        DISPATCH();
+    TARGET(INS_SCONST):
+        PUSH(word_make_string(vm->literals[instruction->operand.as_int]));
+        DISPATCH();
+    TARGET(INS_VCONST):
+        PUSH(word_make_array(vm->literals[instruction->operand.as_int]));
+        DISPATCH();
+    TARGET(INS_VADD):
+        VECTOR_BINARY(add);
+        DISPATCH();
+    TARGET(INS_VSUB):
+        VECTOR_BINARY(sub);
+        DISPATCH();
+    TARGET(INS_VMUL):
+        VECTOR_BINARY(mul);
+        DISPATCH();
+    TARGET(INS_VSCALE): {
+        EXPECT_TYPE(*PEEK(1), PR_ARRAY);
+        EXPECT_TYPE(*PEEK(0), PR_DOUBLE);
+        PyriteArray* result
+            = make_array(vm, word_as_array(*PEEK(1))->length);
+        PyriteArray const* a = word_as_array(*PEEK(1));
+        vm->vector->scale(result->elements, a->elements,
+            word_as_double(*PEEK(0)), a->length);
+        vm->stack_pointer -= 2;
+        PUSH(word_make_array(result));
+        DISPATCH();
+    }
+    TARGET(INS_VFMA): {
+        EXPECT_TYPE(*PEEK(2), PR_ARRAY);
+        EXPECT_TYPE(*PEEK(1), PR_ARRAY);
+        EXPECT_TYPE(*PEEK(0), PR_ARRAY);
+        expect_same_length(
+            vm, word_as_array(*PEEK(2)), word_as_array(*PEEK(1)));
+        expect_same_length(
+            vm, word_as_array(*PEEK(2)), word_as_array(*PEEK(0)));
+        PyriteArray* result
+            = make_array(vm, word_as_array(*PEEK(2))->length);
+        PyriteArray const* x = word_as_array(*PEEK(2));
+        PyriteArray const* y = word_as_array(*PEEK(1));
+        PyriteArray const* z = word_as_array(*PEEK(0));
+        vm->vector->fma(
+            result->elements, x->elements, y->elements, z->elements, x->length);
+        vm->stack_pointer -= 3;
+        PUSH(word_make_array(result));
+        DISPATCH();
+    }
+    TARGET(INS_VSUM): {
+        Word values = POP();
+        EXPECT_TYPE(values, PR_ARRAY);
+        PyriteArray const* a = word_as_array(values);
+        PUSH(word_make_double(vm->vector->sum(a->elements, a->length)));
+        DISPATCH();
+    }
+    TARGET(INS_VDOT): {
+        Word rhs = POP();
+        Word lhs = POP();
+        EXPECT_TYPE(lhs, PR_ARRAY);
+        EXPECT_TYPE(rhs, PR_ARRAY);
+        PyriteArray const* a = word_as_array(lhs);
+        PyriteArray const* b = word_as_array(rhs);
+        expect_same_length(vm, a, b);
+        PUSH(word_make_double(
+            vm->vector->dot(a->elements, b->elements, a->length)));
+        DISPATCH();
+    }
+    TARGET(INS_VLEN): {
+        Word values = POP();
+        EXPECT_TYPE(values, PR_ARRAY);
+        PUSH(word_make_int(word_as_array(values)->length));
+        DISPATCH();
+    }
+    TARGET(INS_ALLOC): {
+        int64_t count = instruction->operand.as_int;
+#if VM_LOOP_CHECKED
+        if (count < 0)
+            runtime_error(vm, "negative field count");
+#endif
+        Word* fields = vm_heap_alloc(vm, HEAP_OBJECT, sizeof(Word) * count);
+        for (int64_t i = 0; i < count; i++)
+            fields[i] = word_make_int(0);
+        PUSH(word_make_ptr(fields));
+        DISPATCH();
+    }
+    TARGET(INS_STORE): {
+        Word value = POP();
+        Word object = POP();
+        EXPECT_TYPE(object, PR_PTR);
+        Word* field = object_field(vm, object, instruction->operand.as_int);
+        *field = value;
+        vm_heap_write_barrier(&vm->heap, word_as_ptr(object), value);
+        DISPATCH();
+    }
+    TARGET(INS_ILOAD):
+        LOAD_FIELD(PR_INT);
+        DISPATCH();
+    TARGET(INS_DLOAD):
+        LOAD_FIELD(PR_DOUBLE);
+        DISPATCH();
+    TARGET(INS_PLOAD):
+        LOAD_FIELD(PR_PTR);
+        DISPATCH();
+    TARGET(INS_VLOAD):
+        LOAD_FIELD(PR_ARRAY);
+        DISPATCH();
+#ifdef PYRITE_THREADED_DISPATCH
+    target_invalid:
+#else
+    default:
+#endif
+        fprintf(stderr, "ERROR: invalid instruction 0x%02x at %d\n",
+            instruction->opcode, vm->program_counter);
+        exit(1);
+#ifndef PYRITE_THREADED_DISPATCH
+        }
+    }
+#endif
+}
+
+#undef PUSH
+#undef POP
+#undef TOP
+#undef PEEK
+#undef EXPECT_TYPE
+#undef CHARGE_FUEL
+#undef VM_LOOP_NAME
+#undef VM_LOOP_CHECKED
+#undef VM_LOOP_FUEL
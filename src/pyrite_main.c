@@ -1,13 +1,238 @@
+#include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pyrite.h"
 
-int main()
+static char* read_file(char const* file)
 {
+    FILE* stream = fopen(file, "rb");
+    if (!stream) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+
+    char* text = malloc(size + 1);
+    if (!text) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fread(text, 1, size, stream) != (size_t)size) {
+        fprintf(stderr, "ERROR: cannot read file '%s'\n", file);
+        exit(1);
+    }
+
+    text[size] = '\0';
+    fclose(stream);
+    return text;
+}
+
+static double seconds_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// a jobs file has one job per line, each a whitespace separated list of int
+// and double literals that are pushed before the program starts.
+static VmJob* read_jobs(char const* file, int32_t* job_count)
+{
+    char* text = read_file(file);
+
+    int32_t count = 0;
+    for (char* c = text; *c; c++)
+        count += *c == '\n';
+    if (*text && text[strlen(text) - 1] != '\n')
+        count += 1;
+
+    VmJob* jobs = calloc(count > 0 ? count : 1, sizeof(VmJob));
+    if (!jobs) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int32_t line = 0;
+    for (char* cursor = text; *cursor; line++) {
+        char* end = strchr(cursor, '\n');
+        if (!end)
+            end = cursor + strlen(cursor);
+
+        // a literal and the space after it take at least two bytes.
+        Word* inputs = malloc(sizeof(Word) * ((end - cursor + 1) / 2 + 1));
+        if (!inputs) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        int32_t input_count = 0;
+
+        while (cursor < end) {
+            if (isspace((unsigned char)*cursor)) {
+                cursor++;
+                continue;
+            }
+
+            char* literal_end = cursor;
+            while (literal_end < end && !isspace((unsigned char)*literal_end))
+                literal_end++;
+
+            if (input_count >= STACK_LIMIT) {
+                fprintf(stderr, "%s:%d: ERROR: too many inputs\n", file,
+                    line + 1);
+                exit(1);
+            }
+
+            bool is_double = memchr(cursor, '.', literal_end - cursor)
+                || memchr(cursor, 'e', literal_end - cursor);
+
+            char* parsed;
+            inputs[input_count++] = is_double
+                ? word_make_double(strtod(cursor, &parsed))
+                : word_make_int(strtoll(cursor, &parsed, 10));
+
+            if (parsed != literal_end) {
+                fprintf(stderr, "%s:%d: ERROR: invalid input '%.*s'\n", file,
+                    line + 1, (int)(literal_end - cursor), cursor);
+                exit(1);
+            }
+
+            cursor = literal_end;
+        }
+
+        VmJob* job = &jobs[line];
+        job->input_count = input_count;
+        job->inputs = inputs;
+        cursor = *end ? end + 1 : end;
+    }
+
+    free(text);
+    *job_count = line;
+    return jobs;
+}
+
+int main(int argc, char** argv)
+{
+    char const* input = "output.pyrite";
+    char const* batch = NULL;
+    int32_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int64_t slice = 0;
+    int64_t fuel = 0;
+    bool jit = false;
+    bool gc_stats = false;
+    char const* snapshot = NULL;
+    int64_t snapshot_after = 0;
+    char const* restore = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) {
+            slice = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+            fuel = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-after") == 0 && i + 1 < argc) {
+            snapshot_after = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else {
+            input = argv[i];
+        }
+    }
+
+    if (batch && (snapshot || restore)) {
+        fprintf(stderr, "ERROR: batches cannot be snapshotted or restored\n");
+        exit(1);
+    }
+
+    VmJob* jobs = NULL;
+    int32_t job_count = 0;
+    if (batch)
+        jobs = read_jobs(batch, &job_count);
+
+    // the program is loaded, verified and compiled once, against the inputs
+    // of the first job. every job then runs on a clone of this vm.
     VirtualMachine vm;
-    vm_init_from_file(&vm, "output.pyrite");
-    vm_execute(&vm);
+    if (restore) {
+        vm_restore(&vm, restore);
+    } else if (job_count > 0) {
+        vm_init_from_file_with_inputs(
+            &vm, input, jobs[0].inputs, jobs[0].input_count);
+    } else {
+        vm_init_from_file(&vm, input);
+    }
+
+    // only the sliced scheduler can stop a job, so a fuel limit on a batch
+    // implies it.
+    if (batch && fuel > 0 && slice <= 0)
+        slice = 10000;
+
+    // native code only runs a program from the top to its end, so anything
+    // that pauses it or picks it up part way is interpreted.
+    char const* source = restore ? restore : input;
+    if (jit && (snapshot || restore || fuel > 0 || (batch && slice > 0))) {
+        fprintf(stderr,
+            "WARNING: cannot jit '%s' with --fuel, --slice, --snapshot or "
+            "--restore, interpreting it\n",
+            source);
+    } else if (jit && !vm_jit_compile(&vm)) {
+        fprintf(stderr, "WARNING: cannot jit '%s', interpreting it\n", source);
+    }
+
+    // --snapshot runs the program for --snapshot-after instructions, saves
+    // where it got to and stops. --restore carries on from there.
+    if (snapshot) {
+        if (vm_execute_for(&vm, snapshot_after))
+            fprintf(stderr, "WARNING: '%s' halted before the snapshot\n",
+                source);
+
+        vm_snapshot(&vm, snapshot);
+        vm_free(&vm);
+        return 0;
+    }
+
+    double start = seconds_now();
+    if (batch && slice > 0) {
+        vm_run_batch_sliced(&vm, jobs, job_count, threads, slice, fuel);
+    } else if (batch) {
+        vm_run_batch(&vm, jobs, job_count, threads);
+    } else if (fuel > 0) {
+        if (!vm_execute_for(&vm, fuel)) {
+            vm_flush_output(&vm);
+            fprintf(stderr,
+                "ERROR: '%s' ran out of fuel after %ld instructions\n", source,
+                fuel);
+            exit(1);
+        }
+    } else {
+        vm_execute(&vm);
+    }
+
+    // a batch reports the collections of all of its jobs together.
+    if (gc_stats)
+        vm_heap_report(&vm.heap.stats, seconds_now() - start);
+
     vm_free(&vm);
+
+    for (int32_t i = 0; i < job_count; i++)
+        free(jobs[i].inputs);
+    free(jobs);
 }
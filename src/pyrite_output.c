@@ -0,0 +1,242 @@
+#include "pyrite.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUTPUT_CAP (64 * 1024)
+
+// enough for any line the fast formatters produce: the sign, up to 33 integer
+// digits for doubles below 2^107, the point, 6 decimals and the newline.
+#define OUTPUT_LINE_MAX 64
+
+static void write_all(int fd, char const* bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("ERROR: cannot write output");
+            exit(1);
+        }
+
+        bytes += written;
+        length -= written;
+    }
+}
+
+void vm_flush_output(VirtualMachine* vm)
+{
+    PyriteOutput* output = &vm->output;
+    if (output->length == 0 || output->fd < 0)
+        return;
+
+    write_all(output->fd, output->buffer, output->length);
+    output->length = 0;
+}
+
+static char* reserve_output(VirtualMachine* vm, size_t length)
+{
+    PyriteOutput* output = &vm->output;
+
+    if (!output->buffer) {
+        output->buffer = malloc(OUTPUT_CAP);
+        if (!output->buffer) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        output->cap = OUTPUT_CAP;
+    }
+
+    if (output->length + length <= output->cap)
+        return output->buffer + output->length;
+
+    if (output->fd >= 0) {
+        vm_flush_output(vm);
+        return output->buffer;
+    }
+
+    // captured output is never written anywhere, the buffer just grows.
+    while (output->length + length > output->cap)
+        output->cap *= 2;
+
+    output->buffer = realloc(output->buffer, output->cap);
+    if (!output->buffer) {
+        perror("Memory reallocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return output->buffer + output->length;
+}
+
+// writes the digits of `value` right aligned so they end at `end`, returns
+// where they start.
+static char* format_digits(char* end, unsigned __int128 value)
+{
+    do {
+        *--end = '0' + (char)(value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    return end;
+}
+
+static int32_t format_int(char* out, int64_t value)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    char* start = format_digits(end, magnitude);
+    if (value < 0)
+        *--start = '-';
+
+    int32_t length = end - start;
+    memcpy(out, start, length);
+    out[length++] = '\n';
+    return length;
+}
+
+// "%lf\n" without printf. the double is m * 2^e exactly, so the value scaled
+// by 10^6 is an integer division that 128-bit arithmetic does exactly, and
+// rounding the remainder half to even gives the same digits glibc prints.
+// returns -1 for values it does not handle (nan, inf and huge magnitudes).
+static int32_t format_double(char* out, double_t value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    bool negative = bits >> 63;
+    int32_t exponent = (bits >> 52) & 0x7ff;
+    uint64_t mantissa = bits & ((UINT64_C(1) << 52) - 1);
+
+    if (exponent == 0x7ff)
+        return -1;
+
+    if (exponent == 0) {
+        exponent = -1074;
+    } else {
+        mantissa |= UINT64_C(1) << 52;
+        exponent -= 1075;
+    }
+
+    // mantissa * 10^6 is below 2^73, which bounds the shifts below.
+    unsigned __int128 scaled;
+    if (exponent >= 0) {
+        if (exponent > 54)
+            return -1;
+
+        scaled = ((unsigned __int128)mantissa << exponent) * 1000000;
+    } else if (-exponent >= 74) {
+        scaled = 0;
+    } else {
+        int32_t shift = -exponent;
+        unsigned __int128 exact = (unsigned __int128)mantissa * 1000000;
+        unsigned __int128 remainder
+            = exact & (((unsigned __int128)1 << shift) - 1);
+        unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+        scaled = exact >> shift;
+        if (remainder > half || (remainder == half && (scaled & 1)))
+            scaled += 1;
+    }
+
+    char digits[OUTPUT_LINE_MAX];
+    char* end = digits + sizeof(digits);
+
+    uint32_t fraction = scaled % 1000000;
+    for (int32_t i = 0; i < 6; i++) {
+        *--end = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    *--end = '.';
+
+    char* start = format_digits(end, scaled / 1000000);
+    if (negative)
+        *--start = '-';
+
+    int32_t length = digits + sizeof(digits) - start;
+    memcpy(out, start, length);
+    out[length++] = '\n';
+    return length;
+}
+
+void vm_write_output(VirtualMachine* vm, char const* bytes, size_t length)
+{
+    if (length > OUTPUT_CAP && vm->output.fd >= 0) {
+        vm_flush_output(vm);
+        write_all(vm->output.fd, bytes, length);
+        return;
+    }
+
+    memcpy(reserve_output(vm, length), bytes, length);
+    vm->output.length += length;
+}
+
+// nan, inf and huge magnitudes are rare enough to leave to printf.
+static void print_double_slow(VirtualMachine* vm, double_t value)
+{
+    int32_t length = snprintf(NULL, 0, "%lf\n", value);
+    char* text = malloc(length + 1);
+    if (!text) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(text, length + 1, "%lf\n", value);
+    vm_write_output(vm, text, length);
+    free(text);
+}
+
+// an array prints one element per line, the way doubles print.
+static void print_array(VirtualMachine* vm, PyriteArray const* array)
+{
+    for (int64_t i = 0; i < array->length; i++) {
+        char* out = reserve_output(vm, OUTPUT_LINE_MAX);
+        int32_t length = format_double(out, array->elements[i]);
+        if (length < 0) {
+            print_double_slow(vm, array->elements[i]);
+            continue;
+        }
+
+        vm->output.length += length;
+    }
+}
+
+void vm_print_word(VirtualMachine* vm, Word word)
+{
+    char* out = reserve_output(vm, OUTPUT_LINE_MAX);
+    int32_t length = -1;
+
+    switch (word_type(word)) {
+    case PR_INT:
+        length = format_int(out, word_as_int(word));
+        break;
+    case PR_DOUBLE:
+        length = format_double(out, word_as_double(word));
+        if (length < 0) {
+            print_double_slow(vm, word_as_double(word));
+            return;
+        }
+        break;
+    case PR_PTR:
+        length = snprintf(out, OUTPUT_LINE_MAX, "%p\n", word_as_ptr(word));
+        break;
+    case PR_STRING: {
+        // strings have no length limit, they go out as they are.
+        char const* text = word_as_string(word);
+        vm_write_output(vm, text, strlen(text));
+        vm_write_output(vm, "\n", 1);
+        return;
+    }
+    case PR_ARRAY:
+        print_array(vm, word_as_array(word));
+        return;
+    }
+
+    vm->output.length += length;
+}
@@ -0,0 +1,193 @@
+#include "pyrite.h"
+
+#ifdef PYRITE_PROFILE
+
+#    include <errno.h>
+#    include <stdio.h>
+#    include <stdlib.h>
+#    include <string.h>
+#    include <time.h>
+
+#    if defined(__x86_64__)
+#        include <x86intrin.h>
+#        define PROFILE_CLOCK_NAME "tsc"
+#    else
+#        define PROFILE_CLOCK_NAME "ns"
+#    endif
+
+#    define PROFILE_MAX_PAIRS 64
+#    define PROFILE_MAX_HOT_PCS 64
+
+static uint64_t profile_clock(void)
+{
+#    if defined(__x86_64__)
+    return __rdtsc();
+#    else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#    endif
+}
+
+VmProfile* vm_profile_make(int32_t code_length)
+{
+    VmProfile* profile = calloc(1, sizeof(*profile));
+    uint64_t* pc_hits = calloc(code_length, sizeof(*pc_hits));
+    if (!profile || !pc_hits) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    profile->pc_hits = pc_hits;
+    profile->code_length = code_length;
+    profile->previous_opcode = -1;
+    return profile;
+}
+
+void vm_profile_free(VmProfile* profile)
+{
+    if (!profile)
+        return;
+
+    free(profile->pc_hits);
+    free(profile);
+}
+
+// the clock between two dispatches is charged to the earlier instruction.
+void vm_profile_instruction(
+    VmProfile* profile, int32_t pc, PyriteInstruction opcode)
+{
+    uint64_t now = profile_clock();
+
+    if (profile->previous_opcode >= 0) {
+        profile->clocks[profile->previous_opcode]
+            += now - profile->previous_clock;
+        profile->pairs[profile->previous_opcode][opcode] += 1;
+    }
+
+    profile->counts[opcode] += 1;
+    profile->pc_hits[pc] += 1;
+    profile->previous_opcode = opcode;
+    profile->previous_clock = profile_clock();
+}
+
+void vm_profile_merge(VmProfile* into, VmProfile const* from)
+{
+    for (int32_t i = 0; i < 256; i++) {
+        into->counts[i] += from->counts[i];
+        into->clocks[i] += from->clocks[i];
+        for (int32_t j = 0; j < 256; j++)
+            into->pairs[i][j] += from->pairs[i][j];
+    }
+
+    for (int32_t pc = 0; pc < into->code_length; pc++)
+        into->pc_hits[pc] += from->pc_hits[pc];
+}
+
+typedef struct {
+    uint64_t count;
+    int32_t first;
+    int32_t second;
+} ProfileEntry;
+
+static int compare_entries(void const* lhs, void const* rhs)
+{
+    uint64_t a = ((ProfileEntry const*)lhs)->count;
+    uint64_t b = ((ProfileEntry const*)rhs)->count;
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+void vm_profile_report(VirtualMachine* vm)
+{
+    VmProfile* profile = vm->profile;
+    if (!profile)
+        return;
+
+    char const* path = getenv("PYRITE_PROFILE_OUTPUT");
+    if (!path)
+        path = "pyrite-profile.json";
+
+    FILE* stream = fopen(path, "w");
+    if (!stream) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", path,
+            strerror(errno));
+        return;
+    }
+
+    uint64_t total = 0;
+    for (int32_t i = 0; i < 256; i++)
+        total += profile->counts[i];
+
+    fprintf(stream, "{\n  \"clock\": \"%s\",\n  \"instructions\": %lu,\n",
+        PROFILE_CLOCK_NAME, total);
+
+    fprintf(stream, "  \"opcodes\": [");
+    bool first = true;
+    for (int32_t i = 0; i < 256; i++) {
+        if (!profile->counts[i])
+            continue;
+
+        fprintf(stream,
+            "%s\n    { \"name\": \"%s\", \"count\": %lu, \"clock\": %lu }",
+            first ? "" : ",", instruction_name(i), profile->counts[i],
+            profile->clocks[i]);
+        first = false;
+    }
+    fprintf(stream, "\n  ],\n");
+
+    size_t capacity = 256 * 256;
+    if ((size_t)profile->code_length > capacity)
+        capacity = profile->code_length;
+
+    ProfileEntry* entries = malloc(sizeof(*entries) * capacity);
+    if (!entries) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int32_t length = 0;
+    for (int32_t i = 0; i < 256; i++) {
+        for (int32_t j = 0; j < 256; j++) {
+            if (profile->pairs[i][j]) {
+                entries[length++] = (ProfileEntry) {
+                    .count = profile->pairs[i][j], .first = i, .second = j
+                };
+            }
+        }
+    }
+    qsort(entries, length, sizeof(*entries), compare_entries);
+
+    fprintf(stream, "  \"pairs\": [");
+    for (int32_t i = 0; i < length && i < PROFILE_MAX_PAIRS; i++) {
+        fprintf(stream,
+            "%s\n    { \"first\": \"%s\", \"second\": \"%s\", \"count\": %lu }",
+            i ? "," : "", instruction_name(entries[i].first),
+            instruction_name(entries[i].second), entries[i].count);
+    }
+    fprintf(stream, "\n  ],\n");
+
+    length = 0;
+    for (int32_t pc = 0; pc < profile->code_length; pc++) {
+        if (profile->pc_hits[pc]) {
+            entries[length++] = (ProfileEntry) {
+                .count = profile->pc_hits[pc], .first = pc, .second = 0
+            };
+        }
+    }
+    qsort(entries, length, sizeof(*entries), compare_entries);
+
+    fprintf(stream, "  \"hot_pcs\": [");
+    for (int32_t i = 0; i < length && i < PROFILE_MAX_HOT_PCS; i++) {
+        fprintf(stream,
+            "%s\n    { \"pc\": %d, \"opcode\": \"%s\", \"count\": %lu }",
+            i ? "," : "", entries[i].first,
+            instruction_name(vm->code[entries[i].first].opcode),
+            entries[i].count);
+    }
+    fprintf(stream, "\n  ]\n}\n");
+
+    free(entries);
+    fclose(stream);
+}
+
+#endif
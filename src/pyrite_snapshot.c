@@ -0,0 +1,397 @@
+#include "pyrite.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "\x7fPYSNAP"
+#define SNAPSHOT_VERSION 1
+
+// a snapshot is this header, the program's path, the input types, the
+// stack and the heap image's relocations, each at an 8 byte aligned offset,
+// followed by the heap image at a page aligned one so it can be mapped
+// straight out of the file. pointers on the stack are stored as they are
+// with the image mapped at heap_address and the program's constant pool at
+// pool_address. a snapshot only works with the build that wrote it and is
+// trusted the way a core file is, nothing but its layout is checked.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t word_size; // sizeof(Word), which PYRITE_NAN_BOXING changes.
+    uint64_t program_checksum;
+
+    int32_t program_counter;
+    int32_t stack_pointer;
+    int32_t base_pointer;
+    int32_t input_count;
+    uint32_t halted;
+    uint32_t path_length; // including the NUL.
+
+    uint64_t pool_address;
+    uint64_t heap_address;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint64_t relocation_count;
+} SnapshotHeader;
+
+static size_t align_up(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+typedef struct {
+    size_t types;
+    size_t stack;
+    size_t relocations;
+    size_t end; // of the relocations.
+} SnapshotLayout;
+
+static SnapshotLayout snapshot_layout(SnapshotHeader const* header)
+{
+    SnapshotLayout layout;
+    layout.types = align_up(sizeof(*header) + header->path_length, 8);
+    layout.stack = align_up(layout.types + header->input_count, 8);
+    layout.relocations
+        = layout.stack + (header->stack_pointer + 1) * sizeof(Word);
+    layout.end
+        = layout.relocations + header->relocation_count * sizeof(uint64_t);
+    return layout;
+}
+
+// what identifies the program a snapshot belongs to: the checksum of a v2
+// file, which its header already holds, or one over the whole v1 file.
+static uint64_t program_checksum(VirtualMachine const* vm)
+{
+    uint8_t const* mapping = vm->mapping;
+    if (vm->mapping_size >= sizeof(PyriteFileHeader)
+        && memcmp(mapping, PYRITE_MAGIC, sizeof(PYRITE_MAGIC)) == 0) {
+        PyriteFileHeader header;
+        memcpy(&header, mapping, sizeof(header));
+        return header.checksum;
+    }
+
+    return pyrite_checksum(PYRITE_CHECKSUM_INIT, mapping, vm->mapping_size);
+}
+
+static bool is_pointer(Word word)
+{
+    PyriteValueType type = word_type(word);
+    return type == PR_PTR || type == PR_STRING || type == PR_ARRAY;
+}
+
+static bool points_into(uintptr_t target, uintptr_t start, size_t size)
+{
+    return target >= start && target - start < size;
+}
+
+// payloads of empty objects end where the next object starts, so heap
+// pointers are told apart by their header.
+static bool in_heap(Word word, uintptr_t start, size_t size)
+{
+    PyriteValueType type = word_type(word);
+    return (type == PR_PTR || type == PR_ARRAY)
+        && points_into(
+            (uintptr_t)heap_header(word_as_array(word)), start, size);
+}
+
+static bool in_pool(Word word, uintptr_t start, size_t size)
+{
+    return points_into((uintptr_t)word_as_array(word), start, size);
+}
+
+static Word shift_word(Word word, intptr_t delta)
+{
+    return word_with_pointer(
+        word, (void const*)((uintptr_t)word_as_array(word) + delta));
+}
+
+static void pad_output(FILE* stream, size_t offset)
+{
+    for (long position = ftell(stream); position < (long)offset; position++)
+        fputc(0, stream);
+}
+
+void vm_snapshot(VirtualMachine* vm, char const* file)
+{
+    if (!vm->mapping || !vm->path) {
+        fprintf(stderr,
+            "ERROR: only programs loaded from a file can be snapshotted\n");
+        exit(1);
+    }
+
+    vm_flush_output(vm);
+
+    HeapImage image;
+    vm_heap_image(vm, &image);
+
+    int32_t stack_count = vm->stack_pointer + 1;
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .word_size = sizeof(Word),
+        .program_checksum = program_checksum(vm),
+        .program_counter = vm->program_counter,
+        .stack_pointer = vm->stack_pointer,
+        .base_pointer = vm->base_pointer,
+        .input_count = vm->input_count,
+        .halted = vm->halted,
+        .path_length = strlen(vm->path) + 1,
+        .pool_address = (uintptr_t)vm->pool,
+        .heap_address = image.address,
+        .heap_size = image.size,
+        .relocation_count = image.relocation_count,
+    };
+
+    SnapshotLayout layout = snapshot_layout(&header);
+    if (image.size > 0)
+        header.heap_offset = align_up(layout.end, sysconf(_SC_PAGESIZE));
+
+    FILE* stream = fopen(file, "wb");
+    if (!stream) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    fwrite(&header, sizeof(header), 1, stream);
+    fwrite(vm->path, 1, header.path_length, stream);
+    pad_output(stream, layout.types);
+    for (int32_t i = 0; i < vm->input_count; i++)
+        fputc(vm->input_types[i], stream);
+    pad_output(stream, layout.stack);
+
+    for (int32_t i = 0; i < stack_count; i++) {
+        Word word = vm_heap_image_word(&image, vm->stack[i]);
+        if (is_pointer(word) && !in_heap(word, image.address, image.size)
+            && !in_pool(word, (uintptr_t)vm->pool, vm->pool_size)) {
+            fprintf(stderr,
+                "ERROR: the stack points outside of the heap at %d\n", i);
+            exit(1);
+        }
+
+        fwrite(&word, sizeof(Word), 1, stream);
+    }
+
+    if (image.relocation_count > 0)
+        fwrite(image.relocations, sizeof(uint64_t), image.relocation_count,
+            stream);
+    if (image.size > 0) {
+        pad_output(stream, header.heap_offset);
+        fwrite(image.block, 1, image.size, stream);
+    }
+
+    if (ferror(stream) || fclose(stream) != 0) {
+        fprintf(stderr, "ERROR: cannot write snapshot '%s'\n", file);
+        exit(1);
+    }
+
+    vm_heap_image_free(&image);
+}
+
+static void corrupt_snapshot(char const* file)
+{
+    fprintf(stderr, "ERROR: the snapshot '%s' is corrupt\n", file);
+    exit(1);
+}
+
+static void read_at(
+    int fd, char const* file, void* buffer, size_t size, size_t offset)
+{
+    ssize_t length = pread(fd, buffer, size, offset);
+    if (length < 0 || (size_t)length != size)
+        corrupt_snapshot(file);
+}
+
+// the stand-ins for the inputs the program was verified against. only their
+// types matter, the restored stack replaces them before anything runs.
+static Word input_stand_in(uint8_t type)
+{
+    static PyriteArray const empty = { 0 };
+
+    switch (type) {
+    case PR_INT:
+        return word_make_int(0);
+    case PR_DOUBLE:
+        return word_make_double(0);
+    case PR_PTR:
+        return word_make_ptr(NULL);
+    case PR_STRING:
+        return word_make_string("");
+    default:
+        return word_make_array(&empty);
+    }
+}
+
+// maps the heap image copy-on-write and fixes up the pointers in it that
+// do not hold where it landed. these are only the ones into the constant
+// pool when it landed at heap_address, which leaves the pages without any
+// such pointers shared with the page cache until the program writes them.
+static void map_heap(VirtualMachine* vm, int fd, char const* file,
+    SnapshotHeader const* header, size_t file_size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (header->heap_offset % page != 0 || header->heap_offset > file_size
+        || header->heap_size > file_size - header->heap_offset
+        || header->heap_size < sizeof(HeapBlock))
+        corrupt_snapshot(file);
+
+    HeapBlock* block = mmap((void*)(uintptr_t)header->heap_address,
+        header->heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+        header->heap_offset);
+    if (block == MAP_FAILED) {
+        fprintf(stderr, "ERROR: cannot map snapshot '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    size_t used = header->heap_size - sizeof(HeapBlock);
+    if (block->next || block->used != used || block->cap != used)
+        corrupt_snapshot(file);
+
+    intptr_t heap_delta = (uintptr_t)block - header->heap_address;
+    intptr_t pool_delta = (uintptr_t)vm->pool - header->pool_address;
+
+    uint64_t* relocations
+        = malloc(sizeof(uint64_t) * (header->relocation_count + 1));
+    if (!relocations) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    read_at(fd, file, relocations,
+        sizeof(uint64_t) * header->relocation_count,
+        snapshot_layout(header).relocations);
+
+    for (uint64_t i = 0; i < header->relocation_count; i++) {
+        uint64_t offset = relocations[i] & ~(uint64_t)1;
+        if (offset < sizeof(HeapBlock) || offset % 8 != 0
+            || offset > header->heap_size - sizeof(Word))
+            corrupt_snapshot(file);
+
+        intptr_t delta = relocations[i] & 1 ? pool_delta : heap_delta;
+        if (delta == 0)
+            continue;
+
+        Word* field = (Word*)((uint8_t*)block + offset);
+        *field = shift_word(*field, delta);
+    }
+
+    free(relocations);
+    vm_heap_adopt(&vm->heap, block, header->heap_size);
+}
+
+void vm_restore(VirtualMachine* vm, char const* file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot open file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "ERROR: cannot stat file '%s': %s\n", file,
+            strerror(errno));
+        exit(1);
+    }
+
+    SnapshotHeader header;
+    if ((size_t)info.st_size < sizeof(header)
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+        || header.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "ERROR: the file '%s' is not a pyrite snapshot\n",
+            file);
+        exit(1);
+    }
+
+    if (header.word_size != sizeof(Word)) {
+        fprintf(stderr,
+            "ERROR: the snapshot '%s' was written by a build with %u byte "
+            "words, this one has %zu\n",
+            file, header.word_size, sizeof(Word));
+        exit(1);
+    }
+
+    if (header.path_length == 0 || header.input_count < 0
+        || header.input_count > STACK_LIMIT || header.stack_pointer < -1
+        || header.stack_pointer >= STACK_LIMIT || header.base_pointer < -1
+        || header.base_pointer > header.stack_pointer
+        || header.relocation_count > (uint64_t)info.st_size / sizeof(uint64_t))
+        corrupt_snapshot(file);
+
+    char* path = malloc(header.path_length);
+    uint8_t* types = malloc(header.input_count + 1);
+    Word* inputs = malloc(sizeof(Word) * (header.input_count + 1));
+    if (!path || !types || !inputs) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    SnapshotLayout layout = snapshot_layout(&header);
+    read_at(fd, file, path, header.path_length, sizeof(header));
+    read_at(fd, file, types, header.input_count, layout.types);
+    if (path[header.path_length - 1] != '\0')
+        corrupt_snapshot(file);
+
+    for (int32_t i = 0; i < header.input_count; i++)
+        inputs[i] = input_stand_in(types[i]);
+
+    // loading the program again decodes and verifies it exactly as it was
+    // when the snapshot was taken.
+    vm_init_from_file_with_inputs(vm, path, inputs, header.input_count);
+    free(inputs);
+    free(types);
+
+    if (program_checksum(vm) != header.program_checksum) {
+        fprintf(stderr,
+            "ERROR: '%s' changed since the snapshot '%s' was taken\n", path,
+            file);
+        exit(1);
+    }
+    free(path);
+
+    if (header.program_counter < -1
+        || header.program_counter >= vm->code_length)
+        corrupt_snapshot(file);
+
+    // the unchecked interpreter makes room for a frame only when it calls
+    // it, so a run paused inside one needs that room back.
+    int32_t stack_count = header.stack_pointer + 1;
+    int64_t slots = (int64_t)stack_count + vm->max_frame_depth;
+    if (slots < vm->max_stack_depth)
+        slots = vm->max_stack_depth;
+    vm_reserve_stack(vm, slots < STACK_LIMIT ? slots : STACK_LIMIT);
+    read_at(fd, file, vm->stack, sizeof(Word) * stack_count, layout.stack);
+
+    if (header.heap_size > 0)
+        map_heap(vm, fd, file, &header, info.st_size);
+    close(fd);
+
+    uintptr_t heap = (uintptr_t)vm->heap.mapped_block;
+    for (int32_t i = 0; i < stack_count; i++) {
+        Word word = vm->stack[i];
+        if (!is_pointer(word))
+            continue;
+
+        if (in_heap(word, header.heap_address, header.heap_size)) {
+            vm->stack[i] = shift_word(word, heap - header.heap_address);
+        } else if (in_pool(word, header.pool_address, vm->pool_size)) {
+            vm->stack[i] = shift_word(
+                word, (uintptr_t)vm->pool - header.pool_address);
+        } else {
+            corrupt_snapshot(file);
+        }
+    }
+
+    vm->program_counter = header.program_counter;
+    vm->stack_pointer = header.stack_pointer;
+    vm->base_pointer = header.base_pointer;
+    vm->halted = header.halted;
+}
@@ -0,0 +1,230 @@
+#include "pyrite.h"
+
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#    define PYRITE_AVX2 1
+#    include <immintrin.h>
+#endif
+
+// the reductions keep one partial result per element index modulo LANES,
+// which is four avx2 registers of four doubles.
+#define LANES 16
+
+static void add_scalar(
+    double_t* out, double_t const* lhs, double_t const* rhs, int64_t length)
+{
+    for (int64_t i = 0; i < length; i++)
+        out[i] = lhs[i] + rhs[i];
+}
+
+static void sub_scalar(
+    double_t* out, double_t const* lhs, double_t const* rhs, int64_t length)
+{
+    for (int64_t i = 0; i < length; i++)
+        out[i] = lhs[i] - rhs[i];
+}
+
+static void mul_scalar(
+    double_t* out, double_t const* lhs, double_t const* rhs, int64_t length)
+{
+    for (int64_t i = 0; i < length; i++)
+        out[i] = lhs[i] * rhs[i];
+}
+
+static void scale_scalar(
+    double_t* out, double_t const* lhs, double_t factor, int64_t length)
+{
+    for (int64_t i = 0; i < length; i++)
+        out[i] = lhs[i] * factor;
+}
+
+static void fma_scalar(double_t* out, double_t const* a, double_t const* b,
+    double_t const* c, int64_t length)
+{
+    for (int64_t i = 0; i < length; i++)
+        out[i] = fma(a[i], b[i], c[i]);
+}
+
+// lanes i, i + 4, i + 8 and i + 12 are what lane i of the four registers
+// add up to, and the four results are then added pairwise.
+static double_t reduce_lanes(double_t const* partial)
+{
+    double_t lanes[4];
+    for (int32_t i = 0; i < 4; i++)
+        lanes[i] = (partial[i] + partial[i + 4])
+            + (partial[i + 8] + partial[i + 12]);
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// adds values from start on to the lanes in partial. the tail of the avx2
+// sum goes through here too, starting from what its vector loop left.
+static double_t sum_lanes(
+    double_t* partial, double_t const* values, int64_t start, int64_t length)
+{
+    for (int64_t i = start; i < length; i++)
+        partial[i % LANES] += values[i];
+
+    return reduce_lanes(partial);
+}
+
+static double_t sum_scalar(double_t const* values, int64_t length)
+{
+    double_t partial[LANES] = { 0 };
+    return sum_lanes(partial, values, 0, length);
+}
+
+static double_t dot_scalar(
+    double_t const* lhs, double_t const* rhs, int64_t length)
+{
+    double_t partial[LANES] = { 0 };
+    for (int64_t i = 0; i < length; i++)
+        partial[i % LANES] = fma(lhs[i], rhs[i], partial[i % LANES]);
+
+    return reduce_lanes(partial);
+}
+
+static VectorKernels const scalar_kernels = {
+    .add = add_scalar,
+    .sub = sub_scalar,
+    .mul = mul_scalar,
+    .scale = scale_scalar,
+    .fma = fma_scalar,
+    .sum = sum_scalar,
+    .dot = dot_scalar,
+};
+
+#ifdef PYRITE_AVX2
+#    define AVX2 __attribute__((target("avx2,fma")))
+
+// arrays are only 8 byte aligned, so every access is an unaligned one. the
+// element-wise kernels leave the last length % 4 elements to the scalar
+// loops, which compute exactly the same thing.
+#    define ELEMENTWISE_AVX2(NAME, INTRINSIC, OP)                        \
+        AVX2 static void NAME##_avx2(double_t* out, double_t const* lhs, \
+            double_t const* rhs, int64_t length)                         \
+        {                                                                \
+            int64_t i = 0;                                               \
+            for (; i + 4 <= length; i += 4) {                            \
+                __m256d a = _mm256_loadu_pd(lhs + i);                    \
+                __m256d b = _mm256_loadu_pd(rhs + i);                    \
+                _mm256_storeu_pd(out + i, INTRINSIC(a, b));              \
+            }                                                            \
+            for (; i < length; i++)                                      \
+                out[i] = lhs[i] OP rhs[i];                               \
+        }
+
+ELEMENTWISE_AVX2(add, _mm256_add_pd, +)
+ELEMENTWISE_AVX2(sub, _mm256_sub_pd, -)
+ELEMENTWISE_AVX2(mul, _mm256_mul_pd, *)
+
+AVX2 static void scale_avx2(
+    double_t* out, double_t const* lhs, double_t factor, int64_t length)
+{
+    __m256d factors = _mm256_set1_pd(factor);
+
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4)
+        _mm256_storeu_pd(
+            out + i, _mm256_mul_pd(_mm256_loadu_pd(lhs + i), factors));
+    for (; i < length; i++)
+        out[i] = lhs[i] * factor;
+}
+
+AVX2 static void fma_avx2(double_t* out, double_t const* a, double_t const* b,
+    double_t const* c, int64_t length)
+{
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4)
+        _mm256_storeu_pd(out + i,
+            _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i),
+                _mm256_loadu_pd(c + i)));
+    for (; i < length; i++)
+        out[i] = fma(a[i], b[i], c[i]);
+}
+
+// four independent accumulators hide the latency of the adds. they are
+// named rather than an array, which gcc would keep in memory.
+AVX2 static double_t sum_avx2(double_t const* values, int64_t length)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd();
+    __m256d sum3 = _mm256_setzero_pd();
+
+    int64_t i = 0;
+    for (; i + LANES <= length; i += LANES) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+        sum2 = _mm256_add_pd(sum2, _mm256_loadu_pd(values + i + 8));
+        sum3 = _mm256_add_pd(sum3, _mm256_loadu_pd(values + i + 12));
+    }
+
+    double_t partial[LANES];
+    _mm256_storeu_pd(partial, sum0);
+    _mm256_storeu_pd(partial + 4, sum1);
+    _mm256_storeu_pd(partial + 8, sum2);
+    _mm256_storeu_pd(partial + 12, sum3);
+
+    return sum_lanes(partial, values, i, length);
+}
+
+#    define DOT_STEP(SUM, OFFSET)                                     \
+        SUM = _mm256_fmadd_pd(_mm256_loadu_pd(lhs + i + (OFFSET)), \
+            _mm256_loadu_pd(rhs + i + (OFFSET)), SUM)
+
+AVX2 static double_t dot_avx2(
+    double_t const* lhs, double_t const* rhs, int64_t length)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd();
+    __m256d sum3 = _mm256_setzero_pd();
+
+    int64_t i = 0;
+    for (; i + LANES <= length; i += LANES) {
+        DOT_STEP(sum0, 0);
+        DOT_STEP(sum1, 4);
+        DOT_STEP(sum2, 8);
+        DOT_STEP(sum3, 12);
+    }
+
+    double_t partial[LANES];
+    _mm256_storeu_pd(partial, sum0);
+    _mm256_storeu_pd(partial + 4, sum1);
+    _mm256_storeu_pd(partial + 8, sum2);
+    _mm256_storeu_pd(partial + 12, sum3);
+
+    // the tail is what dot_scalar does, but here fma is a single
+    // instruction rather than a call into libm.
+    for (; i < length; i++)
+        partial[i % LANES] = fma(lhs[i], rhs[i], partial[i % LANES]);
+
+    return reduce_lanes(partial);
+}
+
+static VectorKernels const avx2_kernels = {
+    .add = add_avx2,
+    .sub = sub_avx2,
+    .mul = mul_avx2,
+    .scale = scale_avx2,
+    .fma = fma_avx2,
+    .sum = sum_avx2,
+    .dot = dot_avx2,
+};
+#endif
+
+VectorKernels const* vm_vector_kernels(void)
+{
+    if (getenv("PYRITE_SCALAR_VECTORS"))
+        return &scalar_kernels;
+
+#ifdef PYRITE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &avx2_kernels;
+#endif
+
+    return &scalar_kernels;
+}
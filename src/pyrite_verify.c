@@ -0,0 +1,724 @@
+#include "pyrite.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the stack shape recorded at a jump target. every edge into the target has
+// to arrive with exactly this shape.
+typedef struct {
+    int32_t depth; // -1 until the first edge reaches the target.
+    PyriteValueType* types;
+} VerifyState;
+
+// the main program, entered at 0 with the inputs on the stack, or a
+// function, entered by call with nothing on a stack of its own. depths and
+// types inside a function are counted from its frame.
+typedef struct {
+    int32_t max_depth;
+
+    // functions only. context is the caller's stack at the first call, which
+    // arg reads from. every other call has to agree with it on the arg_count
+    // slots the function reads with arg or drops with ret.
+    PyriteValueType* context;
+    int32_t context_depth;
+    int32_t arg_count;
+    int32_t ret_count; // -1 until the first ret is verified.
+    PyriteValueType result;
+} VerifyUnit;
+
+typedef struct {
+    int32_t pc;
+    int32_t unit;
+    int32_t depth;
+    PyriteValueType* types;
+} VerifyCall;
+
+typedef struct {
+    VirtualMachine* vm;
+    int32_t pc;
+    bool quiet;
+
+    PyriteValueType* types;
+    int32_t types_cap;
+    int32_t depth;
+
+    bool* is_target;
+    VerifyState* states;
+    int32_t* worklist;
+    int32_t worklist_length;
+
+    // unit 0 is the main program. owners maps each block start to the unit
+    // it belongs to, -1 until reached, and unit_at each call target to its
+    // function. a block that calls a function not known to return yet waits
+    // in waiting, under that function, until a ret of it is verified.
+    VerifyUnit* units;
+    int32_t unit;
+    int32_t block_start;
+    int32_t* owners;
+    int32_t* unit_at;
+    int32_t* waiting;
+    bool waits;
+
+    VerifyCall* calls;
+    int32_t call_count;
+    int32_t call_cap;
+} Verifier;
+
+static char const* type_name(PyriteValueType type)
+{
+    switch (type) {
+    case PR_INT:
+        return "int";
+    case PR_DOUBLE:
+        return "double";
+    case PR_PTR:
+        return "pointer";
+    case PR_STRING:
+        return "string";
+    case PR_ARRAY:
+        return "array";
+    }
+
+    return "unknown";
+}
+
+static void verify_error(Verifier* verifier, char const* message)
+{
+    if (verifier->quiet)
+        return;
+
+    PyriteInstruction opcode = verifier->vm->code[verifier->pc].opcode;
+    fprintf(stderr, "ERROR: verification failed at instruction %d (%s): %s\n",
+        verifier->pc, instruction_name(opcode), message);
+}
+
+// makes room for depth slot types.
+static void reserve_types(Verifier* verifier, int32_t depth)
+{
+    if (depth <= verifier->types_cap)
+        return;
+
+    while (verifier->types_cap < depth)
+        verifier->types_cap
+            = verifier->types_cap ? verifier->types_cap * 2 : STACK_INITIAL_CAP;
+
+    verifier->types = realloc(
+        verifier->types, sizeof(PyriteValueType) * verifier->types_cap);
+    if (!verifier->types) {
+        perror("Memory reallocation failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool verify_push(Verifier* verifier, PyriteValueType type)
+{
+    if (verifier->depth >= STACK_LIMIT) {
+        verify_error(verifier, "stack overflow");
+        return false;
+    }
+
+    reserve_types(verifier, verifier->depth + 1);
+
+    verifier->types[verifier->depth++] = type;
+
+    VerifyUnit* unit = &verifier->units[verifier->unit];
+    if (verifier->depth > unit->max_depth)
+        unit->max_depth = verifier->depth;
+
+    return true;
+}
+
+static bool verify_pop_any(Verifier* verifier)
+{
+    if (verifier->depth == 0) {
+        verify_error(verifier, "stack underflow");
+        return false;
+    }
+
+    verifier->depth -= 1;
+    return true;
+}
+
+static bool verify_operand(
+    Verifier* verifier, PyriteValueType found, PyriteValueType type)
+{
+    if (found != type) {
+        char message[64];
+        snprintf(message, sizeof(message), "expected %s on the stack, found %s",
+            type_name(type), type_name(found));
+        verify_error(verifier, message);
+        return false;
+    }
+
+    return true;
+}
+
+// checks count operands, all of one type, from the top of the stack down.
+static bool verify_operands(Verifier* verifier, PyriteValueType const* operands,
+    int32_t count, PyriteValueType type)
+{
+    for (int32_t i = count - 1; i >= 0; i--) {
+        if (!verify_operand(verifier, operands[i], type))
+            return false;
+    }
+
+    return true;
+}
+
+static bool verify_edge(Verifier* verifier, int32_t target);
+
+static PyriteValueType* copy_types(Verifier* verifier)
+{
+    PyriteValueType* types
+        = malloc(sizeof(PyriteValueType) * (verifier->depth + 1));
+    if (!types) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (verifier->depth > 0)
+        memcpy(
+            types, verifier->types, sizeof(PyriteValueType) * verifier->depth);
+    return types;
+}
+
+static bool verify_call(Verifier* verifier, int32_t target)
+{
+    int32_t index = verifier->unit_at[target];
+    VerifyUnit* function = &verifier->units[index];
+
+    if (!function->context) {
+        function->context = copy_types(verifier);
+        function->context_depth = verifier->depth;
+
+        int32_t depth = verifier->depth;
+        int32_t unit = verifier->unit;
+        verifier->depth = 0;
+        verifier->unit = index;
+        bool ok = verify_edge(verifier, target);
+        verifier->depth = depth;
+        verifier->unit = unit;
+        if (!ok)
+            return false;
+    }
+
+    // the arguments are checked once every function has been walked and it
+    // is known how many of them each one touches.
+    if (verifier->call_count == verifier->call_cap) {
+        verifier->call_cap = verifier->call_cap ? verifier->call_cap * 2 : 16;
+        verifier->calls = realloc(
+            verifier->calls, sizeof(VerifyCall) * verifier->call_cap);
+        if (!verifier->calls) {
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    verifier->calls[verifier->call_count++] = (VerifyCall) {
+        .pc = verifier->pc,
+        .unit = index,
+        .depth = verifier->depth,
+        .types = copy_types(verifier),
+    };
+
+    if (function->ret_count < 0) {
+        verifier->waiting[verifier->block_start] = index;
+        verifier->waits = true;
+        return true;
+    }
+
+    if (verifier->depth < function->ret_count) {
+        verify_error(verifier, "stack underflow");
+        return false;
+    }
+
+    verifier->depth -= function->ret_count;
+    return verify_push(verifier, function->result);
+}
+
+static bool verify_ret(Verifier* verifier, int64_t count)
+{
+    if (verifier->unit == 0) {
+        verify_error(verifier, "ret outside of a call");
+        return false;
+    }
+
+    if (count < 0) {
+        verify_error(verifier, "negative argument count");
+        return false;
+    }
+
+    if (!verify_pop_any(verifier))
+        return false;
+
+    VerifyUnit* function = &verifier->units[verifier->unit];
+    PyriteValueType result = verifier->types[verifier->depth];
+
+    if (function->ret_count >= 0) {
+        if (function->ret_count != count || function->result != result) {
+            verify_error(verifier, "ret disagrees with an earlier ret");
+            return false;
+        }
+        return true;
+    }
+
+    function->ret_count = count;
+    function->result = result;
+    if (count > function->arg_count)
+        function->arg_count = count;
+
+    // the blocks waiting on this function can now go past their calls.
+    for (int32_t pc = 0; pc < verifier->vm->code_length; pc++) {
+        if (verifier->waiting[pc] == verifier->unit) {
+            verifier->waiting[pc] = 0;
+            verifier->worklist[verifier->worklist_length++] = pc;
+        }
+    }
+
+    return true;
+}
+
+static bool verify_arg(Verifier* verifier, int64_t index)
+{
+    if (verifier->unit == 0) {
+        verify_error(verifier, "arg outside of a call");
+        return false;
+    }
+
+    VerifyUnit* function = &verifier->units[verifier->unit];
+    if (index < 0 || index >= function->context_depth) {
+        verify_error(verifier, "argument out of range");
+        return false;
+    }
+
+    if (index + 1 > function->arg_count)
+        function->arg_count = index + 1;
+
+    return verify_push(
+        verifier, function->context[function->context_depth - 1 - index]);
+}
+
+// checks the operand types of an instruction with a fixed stack effect, and
+// fills in the types of what it pushes. operands holds the pops slots it
+// takes, deepest first.
+static bool verify_types(Verifier* verifier, PyriteInstruction opcode,
+    PyriteValueType const* operands, int32_t pops, PyriteValueType* results)
+{
+    switch (opcode) {
+    case INS_HALT:
+    case INS_JMP:
+    case INS_POP:
+    case INS_PRINT:
+        return true;
+    case INS_IPUSH:
+    case INS_ICONST:
+        results[0] = PR_INT;
+        return true;
+    case INS_DPUSH:
+    case INS_DCONST:
+        results[0] = PR_DOUBLE;
+        return true;
+    case INS_SCONST:
+        results[0] = PR_STRING;
+        return true;
+    case INS_VCONST:
+        results[0] = PR_ARRAY;
+        return true;
+    case INS_IADD:
+    case INS_ISUB:
+    case INS_IMUL:
+    case INS_IDIV:
+    case INS_IPUSH_IADD:
+    case INS_IPUSH_ISUB:
+    case INS_IPUSH_IMUL:
+    case INS_IPUSH_IDIV:
+        results[0] = PR_INT;
+        return verify_operands(verifier, operands, pops, PR_INT);
+    case INS_IADD_PRINT:
+    case INS_ISUB_PRINT:
+    case INS_IMUL_PRINT:
+    case INS_IDIV_PRINT:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+        return verify_operands(verifier, operands, pops, PR_INT);
+    case INS_DADD:
+    case INS_DSUB:
+    case INS_DMUL:
+    case INS_DDIV:
+    case INS_DPUSH_DADD:
+    case INS_DPUSH_DSUB:
+    case INS_DPUSH_DMUL:
+    case INS_DPUSH_DDIV:
+        results[0] = PR_DOUBLE;
+        return verify_operands(verifier, operands, pops, PR_DOUBLE);
+    case INS_DADD_PRINT:
+    case INS_DSUB_PRINT:
+    case INS_DMUL_PRINT:
+    case INS_DDIV_PRINT:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+        return verify_operands(verifier, operands, pops, PR_DOUBLE);
+    case INS_DUP:
+        results[0] = operands[0];
+        results[1] = operands[0];
+        return true;
+    case INS_VADD:
+    case INS_VSUB:
+    case INS_VMUL:
+        results[0] = PR_ARRAY;
+        return verify_operands(verifier, operands, pops, PR_ARRAY);
+    case INS_VFMA:
+        results[0] = PR_ARRAY;
+        return verify_operands(verifier, operands, pops, PR_ARRAY);
+    case INS_VSCALE:
+        results[0] = PR_ARRAY;
+        return verify_operand(verifier, operands[1], PR_DOUBLE)
+            && verify_operand(verifier, operands[0], PR_ARRAY);
+    case INS_VSUM:
+        results[0] = PR_DOUBLE;
+        return verify_operand(verifier, operands[0], PR_ARRAY);
+    case INS_VDOT:
+        results[0] = PR_DOUBLE;
+        return verify_operands(verifier, operands, pops, PR_ARRAY);
+    case INS_VLEN:
+        results[0] = PR_INT;
+        return verify_operand(verifier, operands[0], PR_ARRAY);
+    case INS_ALLOC:
+        if (verifier->vm->code[verifier->pc].operand.as_int < 0) {
+            verify_error(verifier, "negative field count");
+            return false;
+        }
+        results[0] = PR_PTR;
+        return true;
+    case INS_STORE:
+        return verify_operand(verifier, operands[0], PR_PTR);
+    case INS_ILOAD:
+        results[0] = PR_INT;
+        return verify_operand(verifier, operands[0], PR_PTR);
+    case INS_DLOAD:
+        results[0] = PR_DOUBLE;
+        return verify_operand(verifier, operands[0], PR_PTR);
+    case INS_PLOAD:
+        results[0] = PR_PTR;
+        return verify_operand(verifier, operands[0], PR_PTR);
+    case INS_VLOAD:
+        results[0] = PR_ARRAY;
+        return verify_operand(verifier, operands[0], PR_PTR);
+    case INS_CALL:
+    case INS_RET:
+    case INS_ARG:
+        break;
+    }
+
+    return false;
+}
+
+static bool verify_instruction(Verifier* verifier, PyriteInstruction opcode)
+{
+    int64_t operand = verifier->vm->code[verifier->pc].operand.as_int;
+
+    // how deep the stack gets is pyrite_stack_effect's, the same table the
+    // assembler sizes the stack with. only the frame instructions, whose
+    // effect depends on their function, are worked out here.
+    int32_t pops, pushes;
+    if (!pyrite_stack_effect(opcode, &pops, &pushes)) {
+        switch (opcode) {
+        case INS_CALL:
+            return verify_call(verifier, operand);
+        case INS_RET:
+            return verify_ret(verifier, operand);
+        case INS_ARG:
+            return verify_arg(verifier, operand);
+        default:
+            verify_error(verifier, "invalid instruction");
+            return false;
+        }
+    }
+
+    if (verifier->depth < pops) {
+        verify_error(verifier, "stack underflow");
+        return false;
+    }
+
+    PyriteValueType results[2];
+    if (!verify_types(verifier, opcode,
+            verifier->types + verifier->depth - pops, pops, results))
+        return false;
+
+    verifier->depth -= pops;
+    for (int32_t i = 0; i < pushes; i++) {
+        if (!verify_push(verifier, results[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_branch(PyriteInstruction opcode)
+{
+    switch (opcode) {
+    case INS_JMP:
+    case INS_IJEQ:
+    case INS_IJNE:
+    case INS_IJLT:
+    case INS_IJLE:
+    case INS_IJGT:
+    case INS_IJGE:
+    case INS_DJEQ:
+    case INS_DJNE:
+    case INS_DJLT:
+    case INS_DJLE:
+    case INS_DJGT:
+    case INS_DJGE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool uses_frames(VirtualMachine* vm)
+{
+    for (int32_t pc = 0; pc < vm->code_length; pc++) {
+        PyriteInstruction opcode = vm->code[pc].opcode;
+        if (opcode == INS_CALL || opcode == INS_RET || opcode == INS_ARG)
+            return true;
+    }
+
+    return false;
+}
+
+// records the current stack shape for the edge into target, queueing the
+// target the first time it is reached. a target belongs to the unit that
+// reaches it first, and no other unit may jump or fall into it.
+static bool verify_edge(Verifier* verifier, int32_t target)
+{
+    VerifyState* state = &verifier->states[target];
+
+    if (verifier->owners[target] < 0) {
+        verifier->owners[target] = verifier->unit;
+    } else if (verifier->owners[target] != verifier->unit) {
+        char message[64];
+        snprintf(message, sizeof(message),
+            "instruction %d is shared between functions", target);
+        verify_error(verifier, message);
+        return false;
+    }
+
+    if (state->depth < 0) {
+        state->depth = verifier->depth;
+        state->types = malloc(sizeof(PyriteValueType) * (verifier->depth + 1));
+        if (!state->types) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        if (verifier->depth > 0)
+            memcpy(state->types, verifier->types,
+                sizeof(PyriteValueType) * verifier->depth);
+        verifier->worklist[verifier->worklist_length++] = target;
+        return true;
+    }
+
+    if (state->depth != verifier->depth
+        || (verifier->depth > 0
+            && memcmp(state->types, verifier->types,
+                   sizeof(PyriteValueType) * verifier->depth)
+                != 0)) {
+        char message[64];
+        snprintf(message, sizeof(message),
+            "inconsistent stack at jump target %d", target);
+        verify_error(verifier, message);
+        return false;
+    }
+
+    return true;
+}
+
+// walks one basic block starting at start, which must have a recorded state.
+static bool verify_block(Verifier* verifier, int32_t start)
+{
+    VirtualMachine* vm = verifier->vm;
+    VerifyState* state = &verifier->states[start];
+
+    verifier->depth = state->depth;
+    verifier->unit = verifier->owners[start];
+    verifier->block_start = start;
+    verifier->waits = false;
+    reserve_types(verifier, state->depth);
+    if (state->depth > 0)
+        memcpy(verifier->types, state->types,
+            sizeof(PyriteValueType) * state->depth);
+
+    for (verifier->pc = start; verifier->pc < vm->code_length;
+        verifier->pc++) {
+        DecodedInstruction instruction = vm->code[verifier->pc];
+        if (!verify_instruction(verifier, instruction.opcode))
+            return false;
+
+        // the block is walked again from the start once the function it
+        // called has a verified ret.
+        if (verifier->waits)
+            return true;
+
+        if (instruction.opcode == INS_HALT || instruction.opcode == INS_RET)
+            return true;
+
+        if (is_branch(instruction.opcode)) {
+            if (!verify_edge(verifier, instruction.operand.as_int))
+                return false;
+
+            if (instruction.opcode == INS_JMP)
+                return true;
+        }
+
+        int32_t next = verifier->pc + 1;
+        if (next < vm->code_length && verifier->is_target[next])
+            return verify_edge(verifier, next);
+    }
+
+    return true;
+}
+
+// every call has to pass its function the arguments the first call did.
+static bool verify_calls(Verifier* verifier)
+{
+    for (int32_t i = 0; i < verifier->call_count; i++) {
+        VerifyCall* call = &verifier->calls[i];
+        VerifyUnit* function = &verifier->units[call->unit];
+        int32_t count = function->arg_count;
+
+        if (call->depth < count
+            || (count > 0
+                && memcmp(call->types + call->depth - count,
+                       function->context + function->context_depth - count,
+                       sizeof(PyriteValueType) * count)
+                    != 0)) {
+            verifier->pc = call->pc;
+            verify_error(verifier, "arguments differ from the first call");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool vm_verify(VirtualMachine* vm)
+{
+    vm->verified = false;
+    vm->max_stack_depth = 0;
+    vm->max_frame_depth = 0;
+
+    Verifier* verifier = calloc(1, sizeof(*verifier));
+    bool* is_target = calloc(vm->code_length, sizeof(bool));
+    VerifyState* states = malloc(sizeof(VerifyState) * vm->code_length);
+    int32_t* worklist = malloc(sizeof(int32_t) * vm->code_length);
+    int32_t* owners = malloc(sizeof(int32_t) * vm->code_length);
+    int32_t* unit_at = calloc(vm->code_length, sizeof(int32_t));
+    int32_t* waiting = calloc(vm->code_length, sizeof(int32_t));
+    if (!verifier || !is_target || !states || !worklist || !owners || !unit_at
+        || !waiting) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // programs with call frames ran unverified before the verifier followed
+    // them. one it cannot follow, say a function entered with arguments of
+    // different types, still runs, on the checked interpreter.
+    verifier->vm = vm;
+    verifier->quiet = uses_frames(vm);
+    verifier->is_target = is_target;
+    verifier->states = states;
+    verifier->worklist = worklist;
+    verifier->owners = owners;
+    verifier->unit_at = unit_at;
+    verifier->waiting = waiting;
+
+    int32_t unit_count = 1;
+    is_target[0] = true;
+    for (int32_t pc = 0; pc < vm->code_length; pc++) {
+        states[pc].depth = -1;
+        states[pc].types = NULL;
+        owners[pc] = -1;
+
+        int32_t target = vm->code[pc].operand.as_int;
+        if (is_branch(vm->code[pc].opcode))
+            is_target[target] = true;
+        if (vm->code[pc].opcode == INS_CALL) {
+            is_target[target] = true;
+            if (unit_at[target] == 0)
+                unit_at[target] = unit_count++;
+        }
+    }
+
+    verifier->units = calloc(unit_count, sizeof(VerifyUnit));
+    if (!verifier->units) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int32_t i = 0; i < unit_count; i++)
+        verifier->units[i].ret_count = -1;
+
+    // every jump target is entered with one fixed stack shape, so a single
+    // pass over each block is enough. blocks nothing jumps or falls into are
+    // unreachable and never looked at.
+    // the program starts with whatever inputs are already on the stack.
+    verifier->depth = vm->stack_pointer + 1;
+    verifier->units[0].max_depth = verifier->depth;
+    reserve_types(verifier, verifier->depth);
+    for (int32_t i = 0; i < verifier->depth; i++)
+        verifier->types[i] = word_type(vm->stack[i]);
+
+    verifier->pc = 0;
+    bool ok = verify_edge(verifier, 0);
+    while (ok && verifier->worklist_length > 0) {
+        int32_t start = worklist[--verifier->worklist_length];
+        ok = verify_block(verifier, start);
+    }
+
+    // the code after a call to a function that never returns is never
+    // reached, so blocks still waiting are fine.
+    if (ok)
+        ok = verify_calls(verifier);
+
+    if (ok) {
+        vm->verified = true;
+        vm->max_stack_depth = verifier->units[0].max_depth;
+
+        // a call needs room for its frame and whatever the function pushes.
+        for (int32_t i = 1; i < unit_count; i++) {
+            int32_t depth = 2 + verifier->units[i].max_depth;
+            if (verifier->units[i].context && depth > vm->max_frame_depth)
+                vm->max_frame_depth = depth;
+        }
+    }
+
+    for (int32_t pc = 0; pc < vm->code_length; pc++)
+        free(states[pc].types);
+    for (int32_t i = 0; i < unit_count; i++)
+        free(verifier->units[i].context);
+    for (int32_t i = 0; i < verifier->call_count; i++)
+        free(verifier->calls[i].types);
+
+    bool quiet = verifier->quiet;
+    free(verifier->calls);
+    free(verifier->units);
+    free(waiting);
+    free(unit_at);
+    free(owners);
+    free(worklist);
+    free(states);
+    free(is_target);
+    free(verifier->types);
+    free(verifier);
+    return ok || quiet;
+}
@@ -0,0 +1,130 @@
+#!/bin/sh
+# differential test for the interpreter variants and the jit. builds pyasm
+# and pyrite with the switch loop, computed-goto dispatch, nan boxing and
+# both, assembles every program in tests/programs and checks that each build
+# prints exactly what the plain switch build does, interpreted and with
+# --jit. the programs are all ones the jit compiles, so a jit warning fails
+# the run too. every program is also assembled with -O1, -O2 and --stream,
+# which must not change its output, and the programs in tests/snapshot are
+# paused and restored part way through.
+#
+# run from anywhere: tests/run.sh. CC and CFLAGS override the compiler and
+# the flags the builds share.
+
+set -u
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+cc=${CC:-gcc}
+cflags=${CFLAGS:--std=c2x -D_DEFAULT_SOURCE -O2 -Wall -Wextra}
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+build() {
+    name=$1
+    shift
+    if ! $cc $cflags "$@" "$root"/src/pyrite*.c -o "$out/pyrite-$name" \
+        -pthread -lm; then
+        echo "FAIL: cannot build the $name variant"
+        exit 1
+    fi
+}
+
+if ! $cc $cflags "$root/src/pyasm.c" -o "$out/pyasm" -pthread; then
+    echo "FAIL: cannot build pyasm"
+    exit 1
+fi
+
+build switch
+build threaded -DPYRITE_THREADED_DISPATCH
+build nan-boxing -DPYRITE_NAN_BOXING
+build threaded-nan-boxing -DPYRITE_THREADED_DISPATCH -DPYRITE_NAN_BOXING
+
+failed=0
+for program in "$root"/tests/programs/*.pyasm; do
+    name=$(basename "$program" .pyasm)
+    if ! "$out/pyasm" "$program" "$out/$name.pyrite" > /dev/null; then
+        echo "FAIL: $name does not assemble"
+        failed=1
+        continue
+    fi
+
+    "$out/pyrite-switch" "$out/$name.pyrite" > "$out/$name.expected" 2>&1
+
+    for variant in switch threaded nan-boxing threaded-nan-boxing; do
+        for mode in interpreted jit; do
+            flag=
+            [ "$mode" = jit ] && flag=--jit
+
+            "$out/pyrite-$variant" $flag "$out/$name.pyrite" \
+                > "$out/$name.actual" 2>&1
+            if ! cmp -s "$out/$name.expected" "$out/$name.actual"; then
+                echo "FAIL: $name, $variant build, $mode"
+                diff "$out/$name.expected" "$out/$name.actual" | head -n 10
+                failed=1
+            fi
+        done
+    done
+done
+
+# the optimizer and the streaming assembler must not change what a program
+# prints. folding moves instructions, so the instruction an error names is
+# left out of the comparison.
+for program in "$root"/tests/programs/*.pyasm \
+    "$root"/tests/snapshot/*.pyasm; do
+    name=$(basename "$program" .pyasm)
+    "$out/pyasm" "$program" "$out/$name.pyrite" > /dev/null 2>&1 || continue
+    "$out/pyrite-switch" "$out/$name.pyrite" 2>&1 \
+        | sed 's/ at instruction [0-9]*$//' > "$out/$name.expected"
+
+    for flag in -O1 -O2 --stream; do
+        if ! "$out/pyasm" $flag "$program" "$out/$name$flag.pyrite" \
+            > /dev/null 2>&1; then
+            echo "FAIL: $name does not assemble with $flag"
+            failed=1
+            continue
+        fi
+
+        "$out/pyrite-switch" "$out/$name$flag.pyrite" 2>&1 \
+            | sed 's/ at instruction [0-9]*$//' > "$out/$name.actual"
+        if ! cmp -s "$out/$name.expected" "$out/$name.actual"; then
+            echo "FAIL: $name, assembled with $flag"
+            diff "$out/$name.expected" "$out/$name.actual" | head -n 10
+            failed=1
+        fi
+    done
+done
+
+# a run split by --snapshot and --restore has to print what the whole run
+# does, wherever it is paused. the programs in tests/snapshot use calls, so
+# they are only ever interpreted.
+for program in "$root"/tests/snapshot/*.pyasm; do
+    name=$(basename "$program" .pyasm)
+    if ! "$out/pyasm" "$program" "$out/$name.pyrite" > /dev/null; then
+        echo "FAIL: $name does not assemble"
+        failed=1
+        continue
+    fi
+
+    "$out/pyrite-switch" "$out/$name.pyrite" > "$out/$name.expected" 2>&1
+
+    for variant in switch threaded nan-boxing threaded-nan-boxing; do
+        for after in 1 100 5001; do
+            "$out/pyrite-$variant" --snapshot "$out/$name.snapshot" \
+                --snapshot-after "$after" "$out/$name.pyrite" \
+                > "$out/$name.actual" 2>&1
+            "$out/pyrite-$variant" --restore "$out/$name.snapshot" \
+                >> "$out/$name.actual" 2>&1
+            if ! cmp -s "$out/$name.expected" "$out/$name.actual"; then
+                echo "FAIL: $name, $variant build, restored after $after"
+                diff "$out/$name.expected" "$out/$name.actual" | head -n 10
+                failed=1
+            fi
+        done
+    done
+done
+
+if [ "$failed" -eq 0 ]; then
+    echo "all programs match"
+fi
+exit "$failed"